@@ -98,6 +98,10 @@ public:
     const std::vector<unsigned char>& Base58Prefix(Base58Type type) const { return base58Prefixes[type]; }
     const std::vector<CAddress>& FixedSeeds() const { return vFixedSeeds; }
     virtual const Checkpoints::CCheckpointData& Checkpoints() const = 0;
+    /** Default for -assumevalid: scripts in ancestors of this block are not verified */
+    const uint256& DefaultAssumeValid() const { return defaultAssumeValid; }
+    /** Default for -minimumchainwork: the least work a header chain needs before -assumevalid skips anything */
+    const uint256& DefaultMinimumChainWork() const { return defaultMinimumChainWork; }
     int PoolMaxTransactions() const { return nPoolMaxTransactions; }
     /** Return the number of blocks in a budget cycle */
     int GetBudgetCycleBlocks() const { return nBudgetCycleBlocks; }
@@ -165,6 +169,8 @@ protected:
     std::string strNetworkID;
     CBlock genesis;
     std::vector<CAddress> vFixedSeeds;
+    uint256 defaultAssumeValid;
+    uint256 defaultMinimumChainWork;
     bool fMiningRequiresPeers;
     bool fAllowMinDifficultyBlocks;
     bool fDefaultConsistencyChecks;
@@ -15,6 +15,19 @@
 template <typename T>
 class CCheckQueueControl;
 
+/**
+ * Run a worker's batch of checks, stopping at the first failure. Check types
+ * that can share work across a batch overload this for std::vector<T>.
+ */
+template <typename T>
+bool RunChecks(std::vector<T>& vChecks)
+{
+    for (T& check : vChecks)
+        if (!check())
+            return false;
+    return true;
+}
+
 /** 
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
@@ -118,9 +131,8 @@ private:
                 fOk = fAllOk;
             }
             // execute work
-            for (T& check : vChecks)
-                if (fOk)
-                    fOk = check();
+            if (fOk)
+                fOk = RunChecks(vChecks);
             vChecks.clear();
         } while (true);
     }
@@ -0,0 +1,174 @@
+// Copyright (c) 2017-2019 The Bitcoin Core developers
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/chacha20.h"
+#include "crypto/sha256.h"
+
+#include <string.h>
+
+namespace
+{
+/** 2^3072 - p, so 2^3072 = MAX_PRIME_DIFF (mod p) */
+const Num3072::limb_t MAX_PRIME_DIFF = 1103717;
+} // namespace
+
+Num3072::Num3072(const unsigned char (&data)[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; i++) {
+        limbs[i] = 0;
+        for (size_t j = 0; j < sizeof(limb_t); j++)
+            limbs[i] |= (limb_t)data[i * sizeof(limb_t) + j] << (8 * j);
+    }
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; i++)
+        limbs[i] = 0;
+}
+
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] < (limb_t)(0 - MAX_PRIME_DIFF))
+        return false;
+    for (int i = 1; i < LIMBS; i++) {
+        if (limbs[i] != (limb_t)-1)
+            return false;
+    }
+    return true;
+}
+
+void Num3072::FullReduce()
+{
+    // Subtract p by adding 2^3072 - p and dropping the carry out of the top
+    double_limb_t acc = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS && acc; i++) {
+        acc += limbs[i];
+        limbs[i] = (limb_t)acc;
+        acc >>= LIMB_SIZE;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Schoolbook product into twice the limbs
+    limb_t tmp[2 * LIMBS];
+    memset(tmp, 0, sizeof(tmp));
+    for (int i = 0; i < LIMBS; i++) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; j++) {
+            double_limb_t t = (double_limb_t)limbs[i] * a.limbs[j] + tmp[i + j] + carry;
+            tmp[i + j] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_SIZE);
+        }
+        tmp[i + LIMBS] = carry;
+    }
+
+    // Fold the high half onto the low half, as high * 2^3072 = high * MAX_PRIME_DIFF
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; i++) {
+        double_limb_t t = (double_limb_t)tmp[LIMBS + i] * MAX_PRIME_DIFF + tmp[i] + carry;
+        limbs[i] = (limb_t)t;
+        carry = (limb_t)(t >> LIMB_SIZE);
+    }
+    // And the few bits that are left over, at most twice
+    while (carry) {
+        double_limb_t acc = (double_limb_t)carry * MAX_PRIME_DIFF;
+        int i = 0;
+        for (; i < LIMBS && acc; i++) {
+            acc += limbs[i];
+            limbs[i] = (limb_t)acc;
+            acc >>= LIMB_SIZE;
+        }
+        carry = (limb_t)acc;
+    }
+
+    if (IsOverflow())
+        FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // By Fermat's little theorem a^-1 = a^(p-2) (mod p). The exponent
+    // p - 2 = 2^3072 - MAX_PRIME_DIFF - 2 has all bits set except some of the
+    // lowest limb's.
+    const limb_t nLowest = (limb_t)(0 - MAX_PRIME_DIFF - 2);
+    Num3072 result;
+    for (int i = LIMBS - 1; i >= 0; i--) {
+        limb_t nExponent = i == 0 ? nLowest : (limb_t)-1;
+        for (int bit = LIMB_SIZE - 1; bit >= 0; bit--) {
+            Num3072 square = result;
+            result.Multiply(square);
+            if ((nExponent >> bit) & 1)
+                result.Multiply(*this);
+        }
+    }
+    return result;
+}
+
+void Num3072::Divide(const Num3072& a)
+{
+    Multiply(a.GetInverse());
+}
+
+void Num3072::ToBytes(unsigned char (&out)[BYTE_SIZE])
+{
+    if (IsOverflow())
+        FullReduce();
+    for (int i = 0; i < LIMBS; i++) {
+        for (size_t j = 0; j < sizeof(limb_t); j++)
+            out[i * sizeof(limb_t) + j] = (unsigned char)(limbs[i] >> (8 * j));
+    }
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char key[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(key);
+    unsigned char tmp[Num3072::BYTE_SIZE];
+    ChaCha20(key, sizeof(key)).Output(tmp, sizeof(tmp));
+    return Num3072(tmp);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& mul)
+{
+    numerator.Multiply(mul.numerator);
+    denominator.Multiply(mul.denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& div)
+{
+    numerator.Multiply(div.denominator);
+    denominator.Multiply(div.numerator);
+    return *this;
+}
+
+uint256 MuHash3072::Finalize() const
+{
+    Num3072 num = numerator;
+    num.Divide(denominator);
+    unsigned char data[Num3072::BYTE_SIZE];
+    num.ToBytes(data);
+
+    uint256 hash;
+    CSHA256().Write(data, sizeof(data)).Finalize(hash.begin());
+    return hash;
+}
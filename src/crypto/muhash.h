@@ -0,0 +1,106 @@
+// Copyright (c) 2017-2019 The Bitcoin Core developers
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ALQO_CRYPTO_MUHASH_H
+#define ALQO_CRYPTO_MUHASH_H
+
+#include "uint256.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** A number modulo 2^3072 - 1103717, the largest 3072 bit safe prime. */
+class Num3072
+{
+public:
+    static const size_t BYTE_SIZE = 384;
+
+#ifdef __SIZEOF_INT128__
+    typedef uint64_t limb_t;
+    typedef unsigned __int128 double_limb_t;
+#else
+    typedef uint32_t limb_t;
+    typedef uint64_t double_limb_t;
+#endif
+    static const int LIMB_SIZE = 8 * sizeof(limb_t);
+    static const int LIMBS = 3072 / LIMB_SIZE;
+
+    limb_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+    explicit Num3072(const unsigned char (&data)[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    void Divide(const Num3072& a);
+    /** Write the fully reduced value as 384 little-endian bytes */
+    void ToBytes(unsigned char (&out)[BYTE_SIZE]);
+
+private:
+    bool IsOverflow() const;
+    void FullReduce();
+    Num3072 GetInverse() const;
+};
+
+/**
+ * A hash of a multiset of byte strings, invariant under reordering, with
+ * inserts and removals that cost one 3072 bit modular multiplication each
+ * (see https://cseweb.ucsd.edu/~mihir/papers/inchash.pdf). Elements are
+ * expanded to numbers with SHA256 and ChaCha20, and the set is hashed as the
+ * product of its elements. Removals are tracked in a separate denominator, so
+ * the one modular inversion happens when the hash is finalized.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    /** The hash of the empty set */
+    MuHash3072() {}
+
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+
+    /** Combine with another set: the result hashes the union (sum) of both */
+    MuHash3072& operator*=(const MuHash3072& mul);
+    /** Take out another set, which must be a subset of this one */
+    MuHash3072& operator/=(const MuHash3072& div);
+
+    /** Return the 256 bit hash of the set. Costs a modular inversion. */
+    uint256 Finalize() const;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 2 * Num3072::BYTE_SIZE;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        Num3072 num = numerator;
+        Num3072 den = denominator;
+        unsigned char data[Num3072::BYTE_SIZE];
+        num.ToBytes(data);
+        s.write((const char*)data, sizeof(data));
+        den.ToBytes(data);
+        s.write((const char*)data, sizeof(data));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned char data[Num3072::BYTE_SIZE];
+        s.read((char*)data, sizeof(data));
+        numerator = Num3072(data);
+        s.read((char*)data, sizeof(data));
+        denominator = Num3072(data);
+    }
+};
+
+#endif // ALQO_CRYPTO_MUHASH_H
@@ -3,9 +3,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 #include <chainparams.h>
+#include <crypto/common.h>
+#include <hash.h>
 #include <init.h>
 #include <kernel.h>
 #include <main.h>
@@ -16,6 +20,7 @@
 #include <wallet/db.h>
 #include <wallet/wallet.h>
 
+#include <atomic>
 #include <numeric>
 
 #define PRI64x  "llx"
@@ -42,13 +47,108 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd)
     return nIntervalEnd - nIntervalBeginning - Params().COINSTAKE_MIN_AGE();
 }
 
+/**
+ * The blocks of the active chain that generated a stake modifier. A block
+ * only generates one in a later modifier interval than the previous
+ * modifier's, so their times increase with their heights and the list can
+ * be binary searched by either. It follows chainActive lazily: the first
+ * lookup after the tip moved adds the new blocks, or drops the ones a reorg
+ * disconnected. Requires cs_main.
+ */
+class CStakeModifierIndex
+{
+private:
+    std::vector<const CBlockIndex*> vGenerated;
+    const CBlockIndex* pindexSynced;
+
+    static bool HeightLess(const CBlockIndex* pindex, int nHeight) { return pindex->nHeight < nHeight; }
+    static bool HeightGreater(int nHeight, const CBlockIndex* pindex) { return nHeight < pindex->nHeight; }
+    static bool TimeLess(const CBlockIndex* pindex, int64_t nTime) { return pindex->GetBlockTime() < nTime; }
+
+    void Sync()
+    {
+        AssertLockHeld(cs_main);
+        if (pindexSynced == chainActive.Tip())
+            return;
+        if (pindexSynced && !chainActive.Contains(pindexSynced))
+            pindexSynced = chainActive.FindFork(pindexSynced);
+        int nHeightSynced = pindexSynced ? pindexSynced->nHeight : -1;
+        while (!vGenerated.empty() && vGenerated.back()->nHeight > nHeightSynced)
+            vGenerated.pop_back();
+        for (int nHeight = nHeightSynced + 1; nHeight <= chainActive.Height(); nHeight++) {
+            if (chainActive[nHeight]->GeneratedStakeModifier())
+                vGenerated.push_back(chainActive[nHeight]);
+        }
+        pindexSynced = chainActive.Tip();
+    }
+
+public:
+    CStakeModifierIndex() : pindexSynced(NULL) {}
+
+    /** The last block at or below nHeight that generated a modifier, NULL if there is none */
+    const CBlockIndex* GetLast(int nHeight)
+    {
+        Sync();
+        std::vector<const CBlockIndex*>::iterator it = std::upper_bound(vGenerated.begin(), vGenerated.end(), nHeight, HeightGreater);
+        return it == vGenerated.begin() ? NULL : *(it - 1);
+    }
+
+    /** The first block above nHeight that generated a modifier no earlier than nTime, NULL if there is none yet */
+    const CBlockIndex* GetFirstAfter(int nHeight, int64_t nTime)
+    {
+        Sync();
+        std::vector<const CBlockIndex*>::iterator it = std::lower_bound(vGenerated.begin(), vGenerated.end(), nHeight + 1, HeightLess);
+        it = std::lower_bound(it, vGenerated.end(), nTime, TimeLess);
+        return it == vGenerated.end() ? NULL : *it;
+    }
+
+    /** Whether the index lists exactly the generating blocks of the active chain, in time order */
+    bool Check()
+    {
+        Sync();
+        size_t nPos = 0;
+        for (int nHeight = 0; nHeight <= chainActive.Height(); nHeight++) {
+            if (!chainActive[nHeight]->GeneratedStakeModifier())
+                continue;
+            if (nPos >= vGenerated.size() || vGenerated[nPos] != chainActive[nHeight])
+                return false;
+            if (nPos > 0 && vGenerated[nPos]->GetBlockTime() <= vGenerated[nPos - 1]->GetBlockTime())
+                return false;
+            nPos++;
+        }
+        return nPos == vGenerated.size();
+    }
+};
+
+static CStakeModifierIndex stakeModifierIndex;
+
+// Get the last stake modifier and its generation time from a given block,
+// by walking back block by block
+static const CBlockIndex* FindLastStakeModifierWalk(const CBlockIndex* pindex)
+{
+    while (pindex && pindex->pprev && !pindex->GeneratedStakeModifier())
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+// The same through the modifier index, walking back only until the active chain
+static const CBlockIndex* FindLastStakeModifier(const CBlockIndex* pindex)
+{
+    LOCK(cs_main);
+    while (pindex && pindex->pprev && !pindex->GeneratedStakeModifier() && !chainActive.Contains(pindex))
+        pindex = pindex->pprev;
+    if (!pindex || !pindex->pprev || pindex->GeneratedStakeModifier())
+        return pindex;
+    const CBlockIndex* pindexLast = stakeModifierIndex.GetLast(pindex->nHeight);
+    return pindexLast ? pindexLast : chainActive.Genesis();
+}
+
 // Get the last stake modifier and its generation time from a given block
 static bool GetLastStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModifier, int64_t& nModifierTime)
 {
     if (!pindex)
         return error("GetLastStakeModifier: null pindex");
-    while (pindex && pindex->pprev && !pindex->GeneratedStakeModifier())
-        pindex = pindex->pprev;
+    pindex = FindLastStakeModifier(pindex);
     if (!pindex->GeneratedStakeModifier()) {
         nStakeModifier = 0;
         return true;
@@ -74,13 +174,26 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+// A block that can contribute a bit to the next stake modifier
+struct CModifierCandidate {
+    int64_t nTime;
+    uint256 hashBlock;
+    const CBlockIndex* pindex;
+    uint256 hashSelection;
+
+    bool operator<(const CModifierCandidate& other) const
+    {
+        return nTime < other.nTime || (nTime == other.nTime && hashBlock < other.hashBlock);
+    }
+};
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
 // already selected blocks in vSelectedBlocks, and with timestamp up to
 // nSelectionIntervalStop.
 static bool SelectBlockFromCandidates(
-        vector<pair<int64_t, uint256> >& vSortedByTimestamp,
+        const vector<CModifierCandidate>& vSortedByTimestamp,
         map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-        int64_t nSelectionIntervalStop, uint64_t nStakeModifierPrev,
+        int64_t nSelectionIntervalStop,
         const CBlockIndex** pindexSelected)
 {
     bool fSelected = false;
@@ -88,24 +201,12 @@ static bool SelectBlockFromCandidates(
     *pindexSelected = nullptr;
     for(const auto &item : vSortedByTimestamp)
     {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
+        const CBlockIndex* pindex = item.pindex;
         if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
             break;
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
+        if (mapSelectedBlocks.count(item.hashBlock) > 0)
             continue;
-        // compute the selection hash by hashing its proof-hash and the
-        // previous proof-of-stake modifier
-        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : pindex->GetBlockHash();
-        CDataStream ss(SER_GETHASH, 0);
-        ss << hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
+        const uint256& hashSelection = item.hashSelection;
         if (fSelected && hashSelection < hashBest)
         {
             hashBest = hashSelection;
@@ -164,19 +265,34 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t &nStake
         return true;
     }
 
-    // Sort candidate blocks by timestamp
-    std::vector<std::pair<int64_t, uint256> > vSortedByTimestamp;
+    // Sort candidate blocks by timestamp. The selection hash of a candidate
+    // only depends on the previous modifier, so it is the same in every round.
+    std::vector<CModifierCandidate> vSortedByTimestamp;
     vSortedByTimestamp.reserve(64 * nModifierInterval / Params().TargetSpacing());
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / nModifierInterval) * nModifierInterval - nSelectionInterval;
     const CBlockIndex* pindex = pindexPrev;
     while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart)
     {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
+        CModifierCandidate candidate;
+        candidate.nTime = pindex->GetBlockTime();
+        candidate.hashBlock = pindex->GetBlockHash();
+        candidate.pindex = pindex;
+        // compute the selection hash by hashing its proof-hash and the
+        // previous proof-of-stake modifier
+        uint256 hashProof = pindex->IsProofOfStake()? pindex->hashProofOfStake : candidate.hashBlock;
+        CDataStream ss(SER_GETHASH, 0);
+        ss << hashProof << nStakeModifier;
+        candidate.hashSelection = Hash(ss.begin(), ss.end());
+        // the selection hash is divided by 2**32 so that proof-of-stake block
+        // is always favored over proof-of-work block. this is to preserve
+        // the energy efficiency property
+        if (pindex->IsProofOfStake())
+            candidate.hashSelection >>= 32;
+        vSortedByTimestamp.push_back(candidate);
         pindex = pindex->pprev;
     }
     int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
     sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
 
     // Select 64 blocks from candidate blocks to generate stake modifier
@@ -188,7 +304,7 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t &nStake
         // add an interval section to the current selection round
         nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
         // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
+        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, &pindex))
             return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
         // write the entropy bit of the selected block
         nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
@@ -226,14 +342,12 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t &nStake
     return true;
 }
 
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, unsigned int nTimeTx, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+// The kernel modifier found by walking the active chain forward block by block
+static void GetKernelStakeModifierWalk(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, bool& fFinal)
 {
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
-        return error("%s : block not indexed", __func__);
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
-    nStakeModifierHeight = pindexFrom->nHeight;
-    nStakeModifierTime = pindexFrom->GetBlockTime();
+    fFinal = false;
+    int64_t nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
     const CBlockIndex* pindex = pindexFrom;
     CBlockIndex* pindexNext = chainActive[pindex->nHeight + 1];
@@ -241,23 +355,66 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, unsigned int nTimeTx,
     // loop to find the stake modifier later by a selection interval
     while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval) {
         if (!pindexNext) {
-            nStakeModifierHeight = pindexFrom->nHeight;
-            nStakeModifierTime = pindexFrom->GetBlockTime();
             if(pindex->GeneratedStakeModifier())
                nStakeModifier = pindex->nStakeModifier;
-            return true;
+            return;
         }
         pindex = pindexNext;
         pindexNext = chainActive[pindexNext->nHeight + 1];
-        if (pindex->GeneratedStakeModifier()) {
-            nStakeModifierHeight = pindex->nHeight;
+        if (pindex->GeneratedStakeModifier())
             nStakeModifierTime = pindex->GetBlockTime();
-        }
     }
     nStakeModifier = pindex->nStakeModifier;
+    fFinal = true;
+}
+
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, bool& fFinal)
+{
+    LOCK(cs_main);
+    // The kernel hashes with the first modifier generated a selection interval after its block
+    nStakeModifier = 0;
+    fFinal = false;
+    const CBlockIndex* pindex = stakeModifierIndex.GetFirstAfter(pindexFrom->nHeight, pindexFrom->GetBlockTime() + GetStakeModifierSelectionInterval());
+    if (pindex) {
+        nStakeModifier = pindex->nStakeModifier;
+        fFinal = true;
+    } else if (chainActive.Height() > pindexFrom->nHeight && chainActive.Tip()->GeneratedStakeModifier())
+        nStakeModifier = chainActive.Tip()->nStakeModifier;
+    else if (chainActive.Height() <= pindexFrom->nHeight && pindexFrom->GeneratedStakeModifier())
+        nStakeModifier = pindexFrom->nStakeModifier;
     return true;
 }
 
+bool CheckStakeModifierIndex()
+{
+    LOCK(cs_main);
+    if (!stakeModifierIndex.Check())
+        return error("%s : modifier index doesn't match the active chain", __func__);
+
+    // Compare lookups with the chain walks for the most recent blocks
+    for (int nHeight = std::max(0, chainActive.Height() - 100); nHeight <= chainActive.Height(); nHeight++) {
+        const CBlockIndex* pindex = chainActive[nHeight];
+        if (FindLastStakeModifier(pindex) != FindLastStakeModifierWalk(pindex))
+            return error("%s : last modifier mismatch at height %d", __func__, nHeight);
+        uint64_t nStakeModifier, nStakeModifierWalk;
+        bool fFinal, fFinalWalk;
+        GetKernelStakeModifier(pindex, nStakeModifier, fFinal);
+        GetKernelStakeModifierWalk(pindex, nStakeModifierWalk, fFinalWalk);
+        if (nStakeModifier != nStakeModifierWalk || fFinal != fFinalWalk)
+            return error("%s : kernel modifier mismatch at height %d", __func__, nHeight);
+    }
+    return true;
+}
+
+static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier)
+{
+    nStakeModifier = 0;
+    if (!mapBlockIndex.count(hashBlockFrom))
+        return error("%s : block not indexed", __func__);
+    bool fFinal;
+    return GetKernelStakeModifier(mapBlockIndex[hashBlockFrom], nStakeModifier, fFinal);
+}
+
 uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom)
 {
     ss << nTimeBlockFrom << prevoutIndex << prevoutHash << nTimeTx;
@@ -288,10 +445,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, const CTr
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
     uint64_t nStakeModifier = 0;
-    int nStakeModifierHeight = 0;
-    int64_t nStakeModifierTime = 0;
-
-    if (!GetKernelStakeModifier(blockFrom.GetHash(), nTimeTx, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false))
+    if (!GetKernelStakeModifier(blockFrom.GetHash(), nStakeModifier))
         return false;
     ss << nStakeModifier;
     ss << nTimeBlockFrom << prevout.hash << txPrevTime << prevout.n << nTimeTx;
@@ -304,6 +458,288 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, const CTr
     return true;
 }
 
+CStakeKernelSearch::CStakeKernelSearch() : pindexTip(NULL), nBitsSearched(0), nTimeSearched(0), nThreads(1), vThreadHashes(1, 0), vThreadMicros(1, 0),
+                                           pjob(NULL), nJobSequence(0), nJobPartitions(0), nJobPending(0), fShutdownWorkers(false)
+{
+}
+
+CStakeKernelSearch::~CStakeKernelSearch()
+{
+    StopWorkers();
+}
+
+void CStakeKernelSearch::Refresh(Candidate& candidate)
+{
+    candidate.pindexFrom = NULL;
+    candidate.fFinal = false;
+    BlockMap::iterator it = mapBlockIndex.find(candidate.hashBlockFrom);
+    if (it == mapBlockIndex.end() || !chainActive.Contains(it->second))
+        return;
+
+    uint64_t nStakeModifier;
+    if (!GetKernelStakeModifier(it->second, nStakeModifier, candidate.fFinal))
+        return;
+    candidate.pindexFrom = it->second;
+    candidate.nTimeBlockFrom = it->second->GetBlockTime();
+
+    // Lay out the bytes CheckStakeKernelHash serializes, up to the timestamp
+    unsigned char* p = candidate.vchPrefix;
+    WriteLE64(p, nStakeModifier);
+    WriteLE32(p + 8, (uint32_t)candidate.nTimeBlockFrom);
+    memcpy(p + 12, candidate.prevout.hash.begin(), 32);
+    WriteLE64(p + 44, (uint64_t)candidate.nTimeBlockFrom);
+    WriteLE32(p + 52, candidate.prevout.n);
+}
+
+void CStakeKernelSearch::SetCoins(const std::vector<Coin>& vCoins)
+{
+    AssertLockHeld(cs_main);
+    std::map<COutPoint, size_t> mapKnown;
+    for (size_t i = 0; i < vCandidates.size(); i++)
+        mapKnown[vCandidates[i].prevout] = i;
+
+    std::vector<Candidate> vNew;
+    vNew.reserve(vCoins.size());
+    for (const Coin& coin : vCoins) {
+        std::map<COutPoint, size_t>::const_iterator it = mapKnown.find(coin.prevout);
+        if (it != mapKnown.end() && vCandidates[it->second].hashBlockFrom == coin.hashBlockFrom) {
+            vNew.push_back(vCandidates[it->second]);
+            continue;
+        }
+        Candidate candidate;
+        candidate.prevout = coin.prevout;
+        candidate.nValue = coin.nValue;
+        candidate.hashBlockFrom = coin.hashBlockFrom;
+        candidate.nTimeBlockFrom = 0;
+        Refresh(candidate);
+        vNew.push_back(candidate);
+    }
+    vCandidates.swap(vNew);
+
+    // New outputs haven't been tried at any timestamp yet
+    nTimeSearched = 0;
+    Update();
+}
+
+void CStakeKernelSearch::Update()
+{
+    AssertLockHeld(cs_main);
+    const CBlockIndex* pindexNew = chainActive.Tip();
+    if (pindexNew == pindexTip)
+        return;
+
+    // A reorg can replace the blocks a final modifier came from
+    bool fReorg = pindexTip && (!pindexNew || pindexNew->GetAncestor(pindexTip->nHeight) != pindexTip);
+    for (Candidate& candidate : vCandidates) {
+        if (fReorg || !candidate.fFinal)
+            Refresh(candidate);
+    }
+    pindexTip = pindexNew;
+    nTimeSearched = 0;
+}
+
+/** What the threads of one search share */
+struct CStakeKernelSearch::Job {
+    uint256 bnTargetPerCoinDay;
+    int64_t nTimeLast;
+    int64_t nTimeFirst;
+    std::atomic<int64_t> nTimeFloor; //! No partition needs timestamps before the latest kernel found
+    std::atomic<bool> fStop;
+
+    boost::mutex mutex;
+    bool fFound;
+    size_t nCoin;
+    int64_t nTime;
+    uint256 hashProofOfStake;
+};
+
+void CStakeKernelSearch::SearchPartition(Job& job, size_t nBegin, size_t nEnd, uint64_t& nHashesRet, int64_t& nMicrosRet, bool fInterruptible) const
+{
+    const int64_t nStakeMinAge = Params().COINSTAKE_MIN_AGE();
+    const int64_t nMaxTimeWeight = Params().COINSTAKE_MAX_AGE() - nStakeMinAge;
+    int64_t nTimeStart = GetTimeMicros();
+    uint64_t nHashes = 0;
+    unsigned char vchKernel[KERNEL_SIZE];
+    for (int64_t nTime = job.nTimeLast; nTime >= job.nTimeFloor && !job.fStop; nTime--) {
+        if (fInterruptible)
+            boost::this_thread::interruption_point();
+        WriteLE32(vchKernel + KERNEL_PREFIX_SIZE, (uint32_t)nTime);
+        for (size_t i = nBegin; i < nEnd; i++) {
+            const Candidate& candidate = vCandidates[i];
+            if (!candidate.pindexFrom || candidate.nTimeBlockFrom + nStakeMinAge > nTime)
+                continue;
+
+            memcpy(vchKernel, candidate.vchPrefix, KERNEL_PREFIX_SIZE);
+            uint256 hash;
+            CHash256().Write(vchKernel, KERNEL_SIZE).Finalize(hash.begin());
+            nHashes++;
+
+            int64_t nTimeWeight = std::min<int64_t>(nTime - candidate.nTimeBlockFrom, nMaxTimeWeight);
+            uint256 bnCoinDayWeight = candidate.nValue * nTimeWeight / COIN / 200;
+            if (hash > bnCoinDayWeight * job.bnTargetPerCoinDay)
+                continue;
+
+            // Keep the latest kernel if other partitions found one as well
+            boost::unique_lock<boost::mutex> lock(job.mutex);
+            if (!job.fFound || nTime > job.nTime || (nTime == job.nTime && i < job.nCoin)) {
+                job.fFound = true;
+                job.nCoin = i;
+                job.nTime = nTime;
+                job.hashProofOfStake = hash;
+            }
+            job.nTimeFloor = job.nTime;
+            break;
+        }
+    }
+    nHashesRet = nHashes;
+    nMicrosRet = GetTimeMicros() - nTimeStart;
+}
+
+bool CStakeKernelSearch::Search(unsigned int nBits, unsigned int nTimeTx, unsigned int nDrift, int64_t nTimePast, size_t& nCoinRet, unsigned int& nTimeRet, uint256& hashProofOfStake)
+{
+    if (nBits != nBitsSearched) {
+        nBitsSearched = nBits;
+        nTimeSearched = 0;
+    }
+
+    Job job;
+    job.bnTargetPerCoinDay.SetCompact(nBits);
+    job.nTimeLast = nTimeTx;
+    // Timestamps at or before the median time past won't be accepted
+    job.nTimeFirst = std::max<int64_t>((int64_t)nTimeTx - nDrift + 1, nTimePast + 1);
+    job.nTimeFirst = std::max<int64_t>(job.nTimeFirst, (int64_t)nTimeSearched + 1);
+    job.nTimeFloor = job.nTimeFirst;
+    job.fStop = false;
+    job.fFound = false;
+
+    // Each thread takes a contiguous share of the outputs and walks the same timestamps
+    size_t nPartitions = std::max<size_t>(1, std::min<size_t>(nThreads, vCandidates.size()));
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWorkers);
+        pjob = &job;
+        nJobPartitions = nPartitions;
+        nJobPending = nPartitions - 1;
+        vJobHashes.assign(nPartitions, 0);
+        vJobMicros.assign(nPartitions, 0);
+        nJobSequence++;
+    }
+    if (nPartitions > 1)
+        condJob.notify_all();
+    try {
+        SearchPartition(job, 0, vCandidates.size() / nPartitions, vJobHashes[0], vJobMicros[0], true);
+    } catch (...) {
+        job.fStop = true;
+        WaitForWorkers();
+        throw;
+    }
+    WaitForWorkers();
+
+    if (job.fFound) {
+        nCoinRet = job.nCoin;
+        nTimeRet = (unsigned int)job.nTime;
+        hashProofOfStake = job.hashProofOfStake;
+    } else if (nTimeTx > nTimeSearched)
+        nTimeSearched = nTimeTx;
+
+    uint64_t nHashes = 0;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStats);
+        for (size_t n = 0; n < nPartitions; n++) {
+            vThreadHashes[n] += vJobHashes[n];
+            vThreadMicros[n] += vJobMicros[n];
+            nHashes += vJobHashes[n];
+        }
+    }
+    if (nHashes > 0) {
+        LogPrint("staking", "%s : %u kernels over %u outputs on %u threads, %.0f kernels/s overall\n", __func__,
+            nHashes, vCandidates.size(), nPartitions, GetKernelsPerSecond());
+    }
+    return job.fFound;
+}
+
+void CStakeKernelSearch::WorkerThread(size_t nWorker)
+{
+    RenameThread("alqo-stakesearch");
+    // Starting from zero picks up a search handed out before this thread first took the lock
+    uint64_t nSequenceSeen = 0;
+    boost::unique_lock<boost::mutex> lock(mutexWorkers);
+    while (true) {
+        while (!fShutdownWorkers && nJobSequence == nSequenceSeen)
+            condJob.wait(lock);
+        if (fShutdownWorkers)
+            return;
+        nSequenceSeen = nJobSequence;
+        if (!pjob || nWorker >= nJobPartitions)
+            continue;
+
+        Job& job = *pjob;
+        size_t nBegin = nWorker * vCandidates.size() / nJobPartitions;
+        size_t nEnd = (nWorker + 1) * vCandidates.size() / nJobPartitions;
+        uint64_t nHashes = 0;
+        int64_t nMicros = 0;
+        lock.unlock();
+        SearchPartition(job, nBegin, nEnd, nHashes, nMicros, false);
+        lock.lock();
+        vJobHashes[nWorker] = nHashes;
+        vJobMicros[nWorker] = nMicros;
+        if (--nJobPending == 0)
+            condDone.notify_one();
+    }
+}
+
+void CStakeKernelSearch::WaitForWorkers()
+{
+    boost::unique_lock<boost::mutex> lock(mutexWorkers);
+    while (nJobPending > 0)
+        condDone.wait(lock);
+    pjob = NULL;
+}
+
+void CStakeKernelSearch::StopWorkers()
+{
+    if (!workers)
+        return;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexWorkers);
+        fShutdownWorkers = true;
+    }
+    condJob.notify_all();
+    workers->join_all();
+    workers.reset();
+    fShutdownWorkers = false;
+}
+
+void CStakeKernelSearch::SetThreads(int nThreadsIn)
+{
+    StopWorkers();
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStats);
+        nThreads = std::max(1, nThreadsIn);
+        vThreadHashes.resize(nThreads, 0);
+        vThreadMicros.resize(nThreads, 0);
+    }
+    if (nThreads > 1) {
+        workers.reset(new boost::thread_group());
+        for (int n = 1; n < nThreads; n++)
+            workers->create_thread(boost::bind(&CStakeKernelSearch::WorkerThread, this, (size_t)n));
+    }
+}
+
+std::vector<double> CStakeKernelSearch::GetThreadKernelsPerSecond() const
+{
+    boost::unique_lock<boost::mutex> lock(mutexStats);
+    std::vector<double> vRates;
+    for (size_t n = 0; n < vThreadHashes.size(); n++)
+        vRates.push_back(vThreadMicros[n] > 0 ? vThreadHashes[n] * 1000000.0 / vThreadMicros[n] : 0);
+    return vRates;
+}
+
+double CStakeKernelSearch::GetKernelsPerSecond() const
+{
+    std::vector<double> vRates = GetThreadKernelsPerSecond();
+    return std::accumulate(vRates.begin(), vRates.end(), 0.0);
+}
+
 bool CheckKernelScript(CScript scriptVin, CScript scriptVout)
 {
     auto extractKeyID = [](CScript scriptPubKey) {
@@ -344,24 +780,41 @@ bool CheckProofOfStake(const CBlock &block, uint256& hashProofOfStake)
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
     uint256 hashBlock;
     CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed");
-
-    CTxOut prevTxOut = txPrev.vout[txin.prevout.n];
-    CBlockIndex* pindex = NULL;
-    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
-    if (it != mapBlockIndex.end())
-        pindex = it->second;
-    else
-        return error("CheckProofOfStake() : read block failed");
-
-    // Read block header
     CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
+    bool fFoundCoin = false;
+    {
+        // The kernel only needs the output value and the header of the block holding it. For unspent
+        // inputs both come from the UTXO set and the block index, so pruned block files aren't needed.
+        LOCK(cs_main);
+        const Coin& coin = pcoinsTip->AccessCoin(txin.prevout);
+        if (!coin.IsSpent() && (int)coin.nHeight <= chainActive.Height()) {
+            CMutableTransaction txPrevOutput;
+            txPrevOutput.vout.resize(txin.prevout.n + 1);
+            txPrevOutput.vout[txin.prevout.n] = coin.out;
+            txPrev = CTransaction(txPrevOutput);
+            blockprev = chainActive[coin.nHeight]->GetBlockHeader();
+            fFoundCoin = true;
+        }
+    }
+
+    if (!fFoundCoin) {
+        // Otherwise try finding the previous transaction in database
+        if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
+            return error("CheckProofOfStake() : INFO: read txPrev failed");
+
+        CBlockIndex* pindex = NULL;
+        BlockMap::iterator it = mapBlockIndex.find(hashBlock);
+        if (it != mapBlockIndex.end())
+            pindex = it->second;
+        else
+            return error("CheckProofOfStake() : read block failed");
+
+        // Read block header
+        if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
+            return error("CheckProofOfStake(): INFO: failed to find block");
+    }
 
     unsigned int nTime = block.nTime;
     if (!CheckStakeKernelHash(block.nBits, blockprev, txPrev, txin.prevout, nTime, hashProofOfStake, false, true))
@@ -8,11 +8,22 @@
 #include <streams.h>
 #include <uint256.h>
 
+#include <memory>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
 class CBlock;
 class CWallet;
 class COutPoint;
 class CBlockIndex;
 
+/** Default for -stakethreads, the number of threads that hash stake kernels */
+static const int DEFAULT_STAKE_THREADS = 1;
+static const int MAX_STAKE_THREADS = 64;
+
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
 static const unsigned int MODIFIER_INTERVAL = 60;
 static const unsigned int MODIFIER_INTERVAL_TESTNET = 20;
@@ -26,6 +37,14 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Get the stake modifier a kernel from pindexFrom hashes with. fFinal is set
+// once the chain has grown far enough past pindexFrom that new blocks can't change it.
+// Requires cs_main.
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, bool& fFinal);
+
+// Compare the stake modifier index with walks of the active chain. For -checkblockindex.
+bool CheckStakeModifierIndex();
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, bool fMinting = true, bool fValidate = true);
@@ -37,6 +56,98 @@ bool CheckStake(unsigned int nBits, const CBlock blockFrom, const CTransaction t
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CBlock &block, uint256& hashProofOfStake);
 
+/**
+ * Searches a wallet's outputs for a stake kernel. Everything a kernel hash
+ * covers but the timestamp stays fixed for an output until its stake modifier
+ * changes, so it is serialized once and an attempt is a single hash of a fixed
+ * buffer. A search walks the allowed timestamps newest first and tries every
+ * output at each, and timestamps that already failed on the same tip and
+ * target are not tried again. With several threads the outputs are split
+ * between the caller and long-lived worker threads, and all stop once one
+ * finds a kernel. Only one search may run at a time.
+ */
+class CStakeKernelSearch
+{
+public:
+    /** Modifier, block time, prevout hash, block time (64 bit), prevout index and timestamp */
+    static const size_t KERNEL_SIZE = 60;
+    static const size_t KERNEL_PREFIX_SIZE = KERNEL_SIZE - 4;
+
+    struct Coin {
+        COutPoint prevout;
+        CAmount nValue;
+        uint256 hashBlockFrom;
+
+        Coin(const COutPoint& prevoutIn, CAmount nValueIn, const uint256& hashBlockFromIn) : prevout(prevoutIn), nValue(nValueIn), hashBlockFrom(hashBlockFromIn) {}
+    };
+
+    CStakeKernelSearch();
+    ~CStakeKernelSearch();
+
+    /** Replace the outputs to search, keeping what is cached for ones seen before. Requires cs_main. */
+    void SetCoins(const std::vector<Coin>& vCoins);
+
+    /** Bring the cached modifiers up to date with the active chain. Requires cs_main. */
+    void Update();
+
+    /**
+     * Look for a kernel at the nDrift timestamps up to nTimeTx that are later
+     * than nTimePast. On success nCoinRet is the index of the kernel in the
+     * outputs given to SetCoins and nTimeRet its timestamp.
+     */
+    bool Search(unsigned int nBits, unsigned int nTimeTx, unsigned int nDrift, int64_t nTimePast, size_t& nCoinRet, unsigned int& nTimeRet, uint256& hashProofOfStake);
+
+    /** Set the number of threads a search runs on */
+    void SetThreads(int nThreadsIn);
+
+    /** Kernel hashes evaluated per second by all threads, over all searches so far */
+    double GetKernelsPerSecond() const;
+    /** The same for each thread */
+    std::vector<double> GetThreadKernelsPerSecond() const;
+
+private:
+    struct Candidate {
+        COutPoint prevout;
+        CAmount nValue;
+        uint256 hashBlockFrom;
+        const CBlockIndex* pindexFrom; //! NULL while the output can't stake from the active chain
+        int64_t nTimeBlockFrom;
+        bool fFinal;                   //! The modifier in vchPrefix can't change any more
+        unsigned char vchPrefix[KERNEL_PREFIX_SIZE];
+    };
+
+    std::vector<Candidate> vCandidates;
+    const CBlockIndex* pindexTip;
+    unsigned int nBitsSearched;
+    unsigned int nTimeSearched; //! Timestamps up to this one failed for every output
+
+    int nThreads;
+    mutable boost::mutex mutexStats;
+    std::vector<uint64_t> vThreadHashes;
+    std::vector<int64_t> vThreadMicros;
+
+    struct Job;
+
+    //! Worker threads 1 to nThreads - 1; the searching thread is thread 0
+    std::unique_ptr<boost::thread_group> workers;
+    boost::mutex mutexWorkers;
+    boost::condition_variable condJob;
+    boost::condition_variable condDone;
+    Job* pjob;                     //! The running search, shared with the workers
+    uint64_t nJobSequence;         //! Incremented for each search handed to the workers
+    size_t nJobPartitions;         //! Partitions of the running search, one per thread
+    int nJobPending;               //! Workers that haven't finished their partition
+    bool fShutdownWorkers;
+    std::vector<uint64_t> vJobHashes;
+    std::vector<int64_t> vJobMicros;
+
+    void Refresh(Candidate& candidate);
+    void SearchPartition(Job& job, size_t nBegin, size_t nEnd, uint64_t& nHashesRet, int64_t& nMicrosRet, bool fInterruptible) const;
+    void WorkerThread(size_t nWorker);
+    void WaitForWorkers();
+    void StopWorkers();
+};
+
 // Get stake modifier checksum
 unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex);
 
@@ -9,12 +9,14 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "init.h"
 #include "kernel.h"
+#include "mappedfile.h"
 #include "masternode-budget.h"
 #include "masternode-payments.h"
 #include "masternodeman.h"
@@ -23,11 +25,13 @@
 #include "net.h"
 #include "obfuscation.h"
 #include "pow.h"
+#include "random.h"
 #include "spork.h"
 #include "sporkdb.h"
 #include "swifttx.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txorphanage.h"
 #include "guiinterface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -42,6 +46,10 @@
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <atomic>
+#include <deque>
+#include <limits>
+#include <list>
+#include <memory>
 #include <queue>
 
 
@@ -65,9 +73,14 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+uint256 hashAssumeValid;
+uint256 nMinimumChainWork;
 bool fImporting = false;
+std::atomic<bool> fMempoolLoaded(false);
 bool fReindex = false;
 bool fTxIndex = true;
+bool fHavePruned = false;
+bool fPruneMode = false;
 bool fHeaderCast = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
@@ -75,6 +88,7 @@ bool fVerifyingBlocks = false;
 unsigned int nCoinCacheSize = 5000;
 bool fAlerts = DEFAULT_ALERTS;
 bool fClearSpendCache = false;
+uint64_t nPruneTarget = 0;
 
 /* If the tip is older than this (in seconds), the node is considered to be in initial block download. */
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
@@ -89,17 +103,10 @@ CFeeRate minRelayTxFee = CFeeRate(10000);
 
 CTxMemPool mempool(::minRelayTxFee);
 
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-std::map<uint256, COrphanTx> mapOrphanTransactions;
-std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+CTxOrphanage orphanage;
 std::map<uint256, int64_t> mapRejectedBlocks;
 
 
-void EraseOrphansFor(NodeId peer);
-
 static void CheckBlockIndex();
 
 /** Constant stuff for coinbase transactions we create: */
@@ -168,20 +175,60 @@ struct QueuedBlock {
     int64_t nTime;              //! Time of "getdata" request in microseconds.
     int nValidatedQueuedBefore; //! Number of blocks queued with validated headers (globally) at the time this one is requested.
     bool fValidatedHeaders;     //! Whether this block has validated headers at the time of request.
+    std::shared_ptr<PartiallyDownloadedBlock> partialBlock; //! Optional, used for cmpctblock downloads.
 };
 std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
 /** Number of blocks in flight with validated headers. */
 int nQueuedValidatedHeaders = 0;
 
+/** Peers asked to announce new blocks with cmpctblock messages, oldest first. Requires cs_main. */
+std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
+/**
+ * Headers-first download schedule. Proof-of-stake headers can't be checked
+ * without the coinstake, so received headers don't go into mapBlockIndex;
+ * they only list the hashes of the chain ahead of us, which are then fetched
+ * from all peers in parallel. Protected by cs_main.
+ */
+std::deque<uint256> dequeHeaderChain;
+//! The peer each dequeHeaderChain entry came from.
+std::deque<NodeId> dequeHeaderSource;
+//! Height of the first entry in dequeHeaderChain.
+int nHeaderChainStart = 0;
+boost::unordered_map<uint256, int, BlockHasher> mapHeaderChainHeight;
+//! Number of peers that timed out delivering a scheduled block.
+boost::unordered_map<uint256, int, BlockHasher> mapHeaderChainMisses;
+//! The peer we request headers from, or -1.
+NodeId nodeHeaderSync = -1;
+//! Time of the outstanding getheaders request to nodeHeaderSync, or 0.
+int64_t nHeaderSyncRequestTime = 0;
+//! Whether nodeHeaderSync may have more headers for us.
+bool fHeaderSyncMore = true;
+
+/** Scheduled blocks that arrived before their parent. Protected by cs_main. */
+struct CPendingBlock {
+    NodeId nodeid;
+    CBlock block;
+    unsigned int nSize;
+};
+std::map<uint256, CPendingBlock> mapBlocksPendingParent;
+size_t nBlocksPendingParentSize = 0;
+
 /** Dirty block index entries. */
 std::set<CBlockIndex*> setDirtyBlockIndex;
 
 /** Dirty block file entries. */
 std::set<int> setDirtyFileInfo;
+
+/** Global flag to indicate we should check to see if there are
+ *  block/undo files that should be deleted.  Set on startup
+ *  or if we allocate more file space when we're in prune mode
+ */
+bool fCheckForPruning = false;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -307,6 +354,14 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer failed to answer getheaders with headers.
+    bool fNoHeaders;
+    //! Whether this peer wants new blocks announced with cmpctblock instead of inv.
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer sends us cmpctblocks when asked for them.
+    bool fProvidesHeaderAndIDs;
+    //! Size in bytes of the blocks from this peer waiting for their parent.
+    size_t nPendingParentSize;
 
     CNodeBlocks nodeBlocks;
 
@@ -322,6 +377,10 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        fNoHeaders = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
+        nPendingParentSize = 0;
     }
 };
 
@@ -381,8 +440,13 @@ void FinalizeNode(NodeId nodeid)
 
     for (const QueuedBlock& entry : state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
-    EraseOrphansFor(nodeid);
+    if (nodeHeaderSync == nodeid) {
+        nodeHeaderSync = -1;
+        nHeaderSyncRequestTime = 0;
+    }
+    orphanage.EraseForPeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
@@ -401,8 +465,8 @@ void MarkBlockAsReceived(const uint256& hash)
     }
 }
 
-// Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL)
+// Requires cs_main. With fPartial, the entry gets a block to reconstruct from a cmpctblock.
+std::list<QueuedBlock>::iterator MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex = NULL, bool fPartial = false)
 {
     CNodeState* state = State(nodeid);
     assert(state != NULL);
@@ -410,11 +474,45 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex* pindex
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, GetTimeMicros(), nQueuedValidatedHeaders, pindex != NULL,
+        std::shared_ptr<PartiallyDownloadedBlock>(fPartial ? new PartiallyDownloadedBlock(&mempool) : NULL)};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    return it;
+}
+
+/** Ask pfrom to announce new blocks with cmpctblock, dropping the peer that was asked longest ago
+ *  when there are more than MAX_CMPCTBLOCK_HB_PEERS. Called for peers that just gave us a new tip.
+ *  Requires cs_main. */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    CNodeState* nodestate = State(pfrom->GetId());
+    if (nodestate == NULL || !nodestate->fProvidesHeaderAndIDs)
+        return;
+    for (NodeId nodeid : lNodesAnnouncingHeaderAndIDs) {
+        if (nodeid == pfrom->GetId())
+            return;
+    }
+
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_CMPCTBLOCK_HB_PEERS) {
+        // As per the protocol, we only announce with cmpctblock to MAX_CMPCTBLOCK_HB_PEERS peers at once
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            if (pnode->GetId() == lNodesAnnouncingHeaderAndIDs.front()) {
+                pnode->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    fAnnounceUsingCMPCTBLOCK = true;
+    pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+    LogPrint("cmpctblock", "asked peer=%d to announce new blocks with cmpctblock\n", pfrom->id);
 }
 
 /** Check whether the last unknown block a peer advertised is not yet known. */
@@ -531,7 +629,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 // We consider the chain that this peer is on invalid.
                 return;
             }
-            if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
@@ -556,6 +654,134 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     }
 }
 
+void ErasePendingBlock(const uint256& hash)
+{
+    std::map<uint256, CPendingBlock>::iterator it = mapBlocksPendingParent.find(hash);
+    if (it != mapBlocksPendingParent.end()) {
+        CNodeState* state = State(it->second.nodeid);
+        if (state != NULL)
+            state->nPendingParentSize -= it->second.nSize;
+        nBlocksPendingParentSize -= it->second.nSize;
+        mapBlocksPendingParent.erase(it);
+    }
+}
+
+void ClearHeaderChain()
+{
+    dequeHeaderChain.clear();
+    dequeHeaderSource.clear();
+    mapHeaderChainHeight.clear();
+    mapHeaderChainMisses.clear();
+    nHeaderChainStart = 0;
+    while (!mapBlocksPendingParent.empty())
+        ErasePendingBlock(mapBlocksPendingParent.begin()->first);
+    fHeaderSyncMore = true;
+}
+
+/** Drop the schedule entries the active chain has caught up with. */
+void TrimHeaderChain()
+{
+    while (!dequeHeaderChain.empty() && nHeaderChainStart <= chainActive.Height()) {
+        const uint256 hash = dequeHeaderChain.front();
+        if (chainActive[nHeaderChainStart]->GetBlockHash() != hash) {
+            // The active chain went another way; the rest of the schedule is useless.
+            LogPrint("net", "header schedule diverged from the active chain at height %d\n", nHeaderChainStart);
+            ClearHeaderChain();
+            return;
+        }
+        mapHeaderChainHeight.erase(hash);
+        mapHeaderChainMisses.erase(hash);
+        ErasePendingBlock(hash);
+        dequeHeaderChain.pop_front();
+        dequeHeaderSource.pop_front();
+        nHeaderChainStart++;
+    }
+}
+
+/** Add scheduled blocks up to nPeerHeight that are neither received nor in flight to vHashes, until it
+ *  has at most count entries. Like FindNextBlocksToDownload, the window is bounded by the active tip. */
+void FindNextScheduledBlocks(NodeId nodeid, int nPeerHeight, unsigned int count, std::vector<uint256>& vHashes, NodeId& nodeStaller)
+{
+    TrimHeaderChain();
+    if (count == 0 || dequeHeaderChain.empty())
+        return;
+
+    // Shrink the window while too many blocks are waiting for their parent.
+    int nWindowEnd = chainActive.Height() + (nBlocksPendingParentSize > MAX_PENDING_BLOCKS_SIZE ? MAX_BLOCKS_IN_TRANSIT_PER_PEER : BLOCK_DOWNLOAD_WINDOW);
+    NodeId waitingfor = -1;
+    for (unsigned int i = 0; i < dequeHeaderChain.size(); i++) {
+        int nHeight = nHeaderChainStart + i;
+        if (nHeight > nPeerHeight)
+            return;
+        const uint256& hash = dequeHeaderChain[i];
+        if (mapBlocksPendingParent.count(hash) || mapBlockIndex.count(hash))
+            continue;
+        std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+        if (itInFlight != mapBlocksInFlight.end()) {
+            // A peer asked for a hash it never announced isn't stalling; the download timeout
+            // hands such blocks to another peer through ScheduledBlockMissed
+            if (waitingfor == -1 && itInFlight->second.second->pindex != NULL)
+                waitingfor = itInFlight->second.first;
+            continue;
+        }
+        if (nHeight > nWindowEnd) {
+            if (vHashes.size() == 0 && waitingfor != -1 && waitingfor != nodeid) {
+                // We aren't able to fetch anything, but we would be if the download window was one larger.
+                nodeStaller = waitingfor;
+            }
+            return;
+        }
+        vHashes.push_back(hash);
+        if (vHashes.size() == count)
+            return;
+    }
+}
+
+/** Keep a scheduled block whose parent hasn't arrived yet. Requires cs_main. */
+bool BufferBlockPendingParent(NodeId nodeid, const CBlock& block)
+{
+    const uint256 hash = block.GetHash();
+    if (!mapHeaderChainHeight.count(hash) || mapBlocksPendingParent.count(hash))
+        return false;
+    CNodeState* state = State(nodeid);
+    if (state == NULL || state->nPendingParentSize > MAX_PENDING_BLOCKS_SIZE_PER_PEER)
+        return false;
+
+    MarkBlockAsReceived(hash);
+    CPendingBlock& pending = mapBlocksPendingParent[hash];
+    pending.nodeid = nodeid;
+    pending.block = block;
+    pending.nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    state->nPendingParentSize += pending.nSize;
+    nBlocksPendingParentSize += pending.nSize;
+    return true;
+}
+
+/** A peer timed out delivering a scheduled block. Peers are only asked for scheduled hashes because the
+ *  headers sync peer listed them, so once enough peers failed to serve one, that peer gets the blame and
+ *  the schedule is dropped. Requires cs_main. */
+void ScheduledBlockMissed(const uint256& hash)
+{
+    boost::unordered_map<uint256, int, BlockHasher>::iterator itHeight = mapHeaderChainHeight.find(hash);
+    if (itHeight == mapHeaderChainHeight.end())
+        return;
+    if (++mapHeaderChainMisses[hash] < MAX_SCHEDULED_BLOCK_MISSES)
+        return;
+
+    NodeId source = dequeHeaderSource[itHeight->second - nHeaderChainStart];
+    LogPrint("net", "no peer serves scheduled block %s (%d) listed by peer=%d\n", hash.ToString(), itHeight->second, source);
+    CNodeState* state = State(source);
+    if (state != NULL) {
+        state->fNoHeaders = true;
+        Misbehaving(source, 50);
+    }
+    if (nodeHeaderSync == source) {
+        nodeHeaderSync = -1;
+        nHeaderSyncRequestTime = 0;
+    }
+    ClearHeaderChain();
+}
+
 } // anon namespace
 
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
@@ -607,89 +833,10 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewDB* pcoinsdbview = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CSporkDB* pSporkDB = NULL;
 
-//////////////////////////////////////////////////////////////////////////////
-//
-// mapOrphanTransactions
-//
-
-bool AddOrphanTx(const CTransaction& tx, NodeId peer)
-{
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000) {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
-    for (const CTxIn& txin : tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-void static EraseOrphanTx(uint256 hash)
-{
-    std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return;
-    for (const CTxIn& txin : it->second.tx.vin) {
-        std::map<uint256, std::set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-}
-
-void EraseOrphansFor(NodeId peer)
-{
-    int nErased = 0;
-    std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        std::map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
-{
-    unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
-}
-
 bool IsStandardTx(const CTransaction& tx, std::string& reason)
 {
     AssertLockHeld(cs_main);
@@ -894,11 +1041,11 @@ int GetInputAge(CTxIn& vin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(vin.prevout.hash);
+        const Coin& coin = view.AccessCoin(vin.prevout);
 
-        if (coins) {
-            if (coins->nHeight < 0) return 0;
-            return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
+        if (!coin.IsSpent()) {
+            if (coin.nHeight == MEMPOOL_HEIGHT) return 0;
+            return (chainActive.Tip()->nHeight + 1) - coin.nHeight;
         } else
             return -1;
     }
@@ -1070,8 +1217,44 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
     return nMinFee;
 }
 
+unsigned int GetBlockScriptFlags(const CBlockIndex* pindexPrev)
+{
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
+    if (pindexPrev && CBlockIndex::IsSuperMajority(5, pindexPrev, Params().EnforceBlockUpgradeMajority()))
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    return flags;
+}
+
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    std::vector<COutPoint> vNoSpendsRemaining;
+    pool.TrimToSize(limit, &vNoSpendsRemaining);
+    for (const COutPoint& removed : vNoSpendsRemaining)
+        pcoinsTip->Uncache(removed);
+}
+
+static bool IsCurrentForFeeEstimation()
+{
+    if (IsInitialBlockDownload())
+        return false;
+    if (chainActive.Tip()->GetBlockTime() < (GetTime() - MAX_FEE_ESTIMATION_TIP_AGE))
+        return false;
+    if (chainActive.Height() < pindexBestHeader->nHeight - 1)
+        return false;
+    return true;
+}
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, ignoreFees);
+}
+
+// Coins pulled into pcoinsTip while checking tx are added to vCoinsToUncache
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees, std::vector<COutPoint>& vCoinsToUncache)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1145,14 +1328,23 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 		view.SetBackend(viewMemPool);
 
 		// do we already have it?
-		if (view.HaveCoins(hash))
-			return false;
+		for (unsigned int i = 0; i < tx.vout.size(); i++) {
+			COutPoint outpoint(hash, i);
+			bool fHadCoinInCache = pcoinsTip->HaveCoinInCache(outpoint);
+			if (view.HaveCoin(outpoint)) {
+				if (!fHadCoinInCache)
+					vCoinsToUncache.push_back(outpoint);
+				return false;
+			}
+		}
 
 		// do all inputs exist?
-		// Note that this does not check for the presence of actual outputs (see the next check for that),
-		// only helps filling in pfMissingInputs (to determine missing vs spent).
+		// Note that a spent output is indistinguishable from a missing one here,
+		// so any unavailable input fills in pfMissingInputs.
 		for (const CTxIn& txin : tx.vin) {
-			if (!view.HaveCoins(txin.prevout.hash)) {
+			if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+				vCoinsToUncache.push_back(txin.prevout);
+			if (!view.HaveCoin(txin.prevout)) {
 				if (pfMissingInputs)
 					*pfMissingInputs = true;
 				return false;
@@ -1194,10 +1386,9 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
 
         CAmount nValueOut = tx.GetValueOut();
         CAmount nFees = nValueIn - nValueOut;
-        double dPriority = 0;
-        view.GetPriority(tx, chainActive.Height());
+        double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1211,6 +1402,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                                         hash.ToString(), nFees, txMinFee),
                     REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+            // A full pool raises the bar to the feerate of what it last evicted
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nFees, mempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Require that free transactions have sufficient priority to be mined in the next block.
             if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1245,6 +1443,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 hash.ToString(),
                 nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s: %s", hash.ToString(), errString),
+                REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         bool fCLTVHasMajority = CBlockIndex::IsSuperMajority(5, chainActive.Tip(), Params().EnforceBlockUpgradeMajority());
 
         // Check against previous transactions
@@ -1256,24 +1466,33 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
+        // Check again against the consensus flags the next block will be
+        // connected with, in case of bugs in the standard flags that cause
         // transactions to pass as valid when they're actually invalid. For
         // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
+        // CHECKSIG NOT scripts to pass, even though they were invalid. The
+        // signatures are in the cache by now, so this is cheap, and it leaves
+        // the result in the script execution cache for ConnectBlock.
         //
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        flags = MANDATORY_SCRIPT_VERIFY_FLAGS;
-        if (fCLTVHasMajority)
-            flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-        if (!CheckInputs(tx, state, view, true, flags, true)) {
-            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
+        if (!CheckInputs(tx, state, view, true, GetBlockScriptFlags(chainActive.Tip()), true)) {
+            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against consensus but not STANDARD flags %s", hash.ToString());
         }
 
+        // This transaction should only count for fee estimation if the
+        // node is not behind and it is not dependent on any other
+        // transactions in the mempool
+        bool validForFeeEstimation = IsCurrentForFeeEstimation() && pool.HasNoInputsOf(tx);
+
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors, validForFeeEstimation);
+
+        // Trim the pool, and don't keep the transaction if it was the one to go
+        LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        if (!pool.exists(hash))
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
     SyncWithWallets(tx, NULL);
@@ -1281,7 +1500,20 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     return true;
 }
 
-bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees)
+{
+    std::vector<COutPoint> vCoinsToUncache;
+    bool fAccepted = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, nAcceptTime, fRejectInsaneFee, ignoreFees, vCoinsToUncache);
+    if (!fAccepted) {
+        // Transactions that don't make it in must not leave their inputs in the coins cache
+        for (const COutPoint& outpoint : vCoinsToUncache)
+            pcoinsTip->Uncache(outpoint);
+    }
+    return fAccepted;
+}
+
+// Coins pulled into pcoinsTip while checking tx are added to vCoinsToUncache
+static bool AcceptableInputsWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX, std::vector<COutPoint>& vCoinsToUncache)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1343,14 +1575,23 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
             view.SetBackend(viewMemPool);
 
             // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
+            for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                COutPoint outpoint(hash, i);
+                bool fHadCoinInCache = pcoinsTip->HaveCoinInCache(outpoint);
+                if (view.HaveCoin(outpoint)) {
+                    if (!fHadCoinInCache)
+                        vCoinsToUncache.push_back(outpoint);
+                    return false;
+                }
+            }
 
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
+            // Note that a spent output is indistinguishable from a missing one here,
+            // so any unavailable input fills in pfMissingInputs.
             for (const CTxIn& txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!pcoinsTip->HaveCoinInCache(txin.prevout))
+                    vCoinsToUncache.push_back(txin.prevout);
+                if (!view.HaveCoin(txin.prevout)) {
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
@@ -1476,6 +1717,16 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     return true;
 }
 
+bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
+{
+    std::vector<COutPoint> vCoinsToUncache;
+    bool fAcceptable = AcceptableInputsWorker(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, isDSTX, vCoinsToUncache);
+    // The transaction is only checked, never stored, so nothing it pulled in stays cached
+    for (const COutPoint& outpoint : vCoinsToUncache)
+        pcoinsTip->Uncache(outpoint);
+    return fAcceptable;
+}
+
 bool GetOutput(const uint256& hash, unsigned int index, CValidationState& state, CTxOut& out)
 {
     CTransaction txPrev;
@@ -1529,10 +1780,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
             int nHeight = -1;
             {
-                CCoinsViewCache& view = *pcoinsTip;
-                const CCoins* coins = view.AccessCoins(hash);
-                if (coins)
-                    nHeight = coins->nHeight;
+                const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+                if (!coin.IsSpent())
+                    nHeight = coin.nHeight;
             }
             if (nHeight > 0)
                 pindexSlow = chainActive[nHeight];
@@ -1582,18 +1832,74 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
+/** Recently used mappings of finalized block files, most recent first. Protected by cs_MappedBlockFiles. */
+static CCriticalSection cs_MappedBlockFiles;
+static std::list<std::pair<int, std::shared_ptr<const CMappedFile> > > listMappedBlockFiles;
+
+/**
+ * Return a read-only mapping of a block file, or NULL if the file is still
+ * being appended to or could not be mapped. Files below nLastBlockFile were
+ * finalized by FlushBlockFile(true) and never change again.
+ */
+static std::shared_ptr<const CMappedFile> GetMappedBlockFile(int nFile)
+{
+    if (MAX_MAPPED_BLOCKFILES == 0)
+        return NULL;
+    {
+        LOCK(cs_LastBlockFile);
+        if (nFile >= nLastBlockFile)
+            return NULL;
+    }
+
+    LOCK(cs_MappedBlockFiles);
+    for (std::list<std::pair<int, std::shared_ptr<const CMappedFile> > >::iterator it = listMappedBlockFiles.begin(); it != listMappedBlockFiles.end(); ++it) {
+        if (it->first == nFile) {
+            listMappedBlockFiles.splice(listMappedBlockFiles.begin(), listMappedBlockFiles, it);
+            return it->second;
+        }
+    }
+
+    std::shared_ptr<CMappedFile> pmap = std::make_shared<CMappedFile>();
+    if (!pmap->Open(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"))) {
+        LogPrint("db", "%s : unable to map block file %d\n", __func__, nFile);
+        return NULL;
+    }
+    // Readers hold their own reference, so evicting a mapping never pulls it from under them
+    listMappedBlockFiles.push_front(std::make_pair(nFile, pmap));
+    if (listMappedBlockFiles.size() > MAX_MAPPED_BLOCKFILES)
+        listMappedBlockFiles.pop_back();
+    return pmap;
+}
+
+/** Forget the mapping of a block file that is being deleted. */
+static void UnmapBlockFile(int nFile)
+{
+    LOCK(cs_MappedBlockFiles);
+    for (std::list<std::pair<int, std::shared_ptr<const CMappedFile> > >::iterator it = listMappedBlockFiles.begin(); it != listMappedBlockFiles.end(); ++it) {
+        if (it->first == nFile) {
+            listMappedBlockFiles.erase(it);
+            return;
+        }
+    }
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
-    // Read block
     try {
-        filein >> block;
+        std::shared_ptr<const CMappedFile> pmap = GetMappedBlockFile(pos.nFile);
+        if (pmap && pos.nPos < pmap->size()) {
+            // Deserialize straight from the mapping
+            CSpanReader reader(pmap->data() + pos.nPos, pmap->data() + pmap->size(), SER_DISK, CLIENT_VERSION);
+            reader >> block;
+        } else {
+            // Open history file to read
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk : OpenBlockFile failed");
+            filein >> block;
+        }
     } catch (std::exception& e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
@@ -1745,6 +2051,8 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    // The masternode, budget and spork handlers call this without cs_main
+    LOCK(cs_main);
     CNodeState* state = State(pnode);
     if (state == NULL)
         return;
@@ -1799,25 +2107,64 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         for (const CTxIn& txin : tx.vin) {
-            txundo.vprevout.push_back(CTxInUndo());
-            bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
+            txundo.vprevout.push_back(Coin());
+            bool ret = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
             assert(ret);
         }
     }
 
     // add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
-bool CScriptCheck::operator()()
+bool CScriptCheck::operator()(CSignatureBatch* pbatch)
 {
     const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
+    // Deferred signatures are never stored in the cache, so only defer when not storing.
+    // Scripts whose outcome doesn't follow from a single signature check (multisig,
+    // CHECKSIG NOT, signature checks in the scriptSig) are not deferred.
+    txnouttype whichType;
+    std::vector<std::vector<unsigned char> > vSolutions;
+    if (pbatch && !cacheStore && scriptSig.IsPushOnly() && Solver(scriptPubKey, whichType, vSolutions) &&
+        (whichType == TX_PUBKEY || whichType == TX_PUBKEYHASH))
+        return VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, false, pbatch), &error);
     if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
 }
 
+namespace {
+/**
+ * Transactions whose scripts all passed under a given set of flags, keyed by
+ * a salted hash of (txid, flags). The txid commits to every prevout, and so to
+ * the scriptPubKeys being spent, which makes the entry valid in any view.
+ */
+CSignatureCache scriptExecutionCache;
+CSHA256 scriptExecutionCacheHasher;
+}
+
+void InitScriptExecutionCache()
+{
+    // Setup the salted hasher
+    uint256 nonce = GetRandHash();
+    // We want the nonce to be 64 bytes long to force the hasher to process
+    // this chunk, which makes later hash computations more efficient. We
+    // just write our 32-byte entropy twice to fill the 64 bytes.
+    scriptExecutionCacheHasher.Write(nonce.begin(), 32);
+    scriptExecutionCacheHasher.Write(nonce.begin(), 32);
+    // Half of -maxsigcachesize is for this cache, the other half for the signature cache
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t)1 << 20);
+    size_t nBytes = scriptExecutionCache.Setup(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu requested for script execution cache\n",
+        nBytes / (1 << 20), nMaxCacheSize / (1 << 20));
+}
+
+void GetScriptExecutionCacheStats(CSignatureCacheStats& stats)
+{
+    scriptExecutionCache.GetStats(stats);
+}
+
 bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks)
 {
     if (!tx.IsCoinBase())
@@ -1838,20 +2185,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         CAmount nFees = 0;
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase() || coins->IsCoinStake()) {
-                if (nSpendHeight - coins->nHeight < Params().COINBASE_MATURITY())
+            if (coin.IsCoinBase() || coin.IsCoinStake()) {
+                if (nSpendHeight - (int)coin.nHeight < Params().COINBASE_MATURITY())
                     return state.Invalid(
-                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - coins->nHeight, coins->IsCoinStake()),
+                        error("CheckInputs() : tried to spend coinbase at depth %d, coinstake=%d", nSpendHeight - (int)coin.nHeight, coin.IsCoinStake()),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs() : txin values out of range"),
                     REJECT_INVALID, "bad-txns-inputvalues-outofrange");
         }
@@ -1880,13 +2227,22 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // First check if these scripts were already executed with the
+            // same flags, e.g. when the transaction entered the mempool.
+            // Entries not needed again (cacheStore false) are dropped on a hit.
+            uint256 hashCacheEntry;
+            CSHA256 hasher = scriptExecutionCacheHasher;
+            hasher.Write(tx.GetHash().begin(), 32).Write((const unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            if (scriptExecutionCache.Get(hashCacheEntry, !cacheStore))
+                return true;
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out.scriptPubKey, tx, i, flags, cacheStore);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1898,7 +2254,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
+                        CScriptCheck check(coin.out.scriptPubKey, tx, i,
                             flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -1913,12 +2269,41 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                     return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Deferred checks haven't run yet, so only cache results we have
+            if (cacheStore && !pvChecks)
+                scriptExecutionCache.Set(hashCacheEntry);
         }
     }
 
     return true;
 }
 
+/**
+ * Restore the UTXO in a Coin at a given COutPoint. Returns false if the undo
+ * record lacks the metadata of the spent output and it cannot be recovered from
+ * the view; fClean is cleared when the restore overwrites an existing output.
+ */
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out, bool& fClean)
+{
+    bool fOverwrite = view.HaveCoin(out);
+    if (fOverwrite)
+        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height, coinbase and coinstake). Older versions included
+        // this information only in undo records for the last spend of a transaction's
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return false;
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+        undo.fCoinStake = alternate.fCoinStake;
+    }
+    view.AddCoin(out, std::move(undo), fOverwrite);
+    return true;
+}
+
 bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
 {
     if (pindex->GetBlockHash() != view.GetBestBlock())
@@ -1947,53 +2332,26 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
-        // exactly. Note that transactions with only provably unspendable outputs won't
-        // have outputs available even in the block itself, so we handle that case
-        // specially with outsEmpty.
-        {
-            CCoins outsEmpty;
-            CCoinsModifier outs = view.ModifyCoins(hash);
-            outs->ClearUnspendable();
-
-            CCoins outsBlock(tx, pindex->nHeight);
-            // The CCoins serialization does not serialize negative numbers.
-            // No network rules currently depend on the version here, so an inconsistency is harmless
-            // but it must be corrected before txout nversion ever influences a network rule.
-            if (outsBlock.nVersion < 0)
-                outs->nVersion = outsBlock.nVersion;
-            if (*outs != outsBlock)
+        // exactly. Provably unspendable outputs were never added to the UTXO set.
+        for (unsigned int o = 0; o < tx.vout.size(); o++) {
+            if (tx.vout[o].scriptPubKey.IsUnspendable())
+                continue;
+            Coin coin;
+            bool fSpent = view.SpendCoin(COutPoint(hash, o), &coin);
+            if (!fSpent || tx.vout[o] != coin.out || (unsigned int)pindex->nHeight != coin.nHeight ||
+                tx.IsCoinBase() != (bool)coin.fCoinBase || tx.IsCoinStake() != (bool)coin.fCoinStake)
                 fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-            // remove outputs
-            outs->Clear();
         }
 
         // restore inputs
         if (!tx.IsCoinBase()) {
-            const CTxUndo& txundo = blockUndo.vtxundo[i - 1];
+            CTxUndo& txundo = blockUndo.vtxundo[i - 1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock() : transaction and undo data inconsistent - txundo.vprevout.siz=%d tx.vin.siz=%d", txundo.vprevout.size(), tx.vin.size());
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint& out = tx.vin[j].prevout;
-                const CTxInUndo& undo = txundo.vprevout[j];
-                CCoinsModifier coins = view.ModifyCoins(out.hash);
-                if (undo.nHeight != 0) {
-                    // undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins->Clear();
-                    coins->fCoinBase = undo.fCoinBase;
-                    coins->nHeight = undo.nHeight;
-                    coins->nVersion = undo.nVersion;
-                } else {
-                    if (coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
-                }
-                if (coins->IsAvailable(out.n))
-                    fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                if (coins->vout.size() < out.n + 1)
-                    coins->vout.resize(out.n + 1);
-                coins->vout[out.n] = undo.txout;
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out, fClean))
+                    return error("DisconnectBlock() : undo data adding output to missing transaction");
             }
         }
     }
@@ -2034,6 +2392,21 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
+bool RunChecks(std::vector<CScriptCheck>& vChecks)
+{
+    // Run every script, deferring the signature checks of those that can be
+    // batched. A deferred signature decides its script, so any invalid one
+    // in the batch means an invalid script.
+    CSignatureBatch batch;
+    for (CScriptCheck& check : vChecks) {
+        if (!check(&batch))
+            return false;
+    }
+
+    std::vector<bool> vfValid;
+    return batch.Verify(vfValid);
+}
+
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
 void ThreadScriptCheck()
@@ -2042,6 +2415,109 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+/**
+ * Closure representing one lookup of a block input in the coins database.
+ * Each lookup writes to its own result slot, so the prefetch workers need
+ * no locking beyond what the database itself provides.
+ */
+class CCoinPrefetch
+{
+private:
+    const CCoinsView* pview;
+    COutPoint outpoint;
+    Coin* pcoin;
+    char* pfFound;
+
+public:
+    CCoinPrefetch() : pview(NULL), pcoin(NULL), pfFound(NULL) {}
+    CCoinPrefetch(const CCoinsView* pviewIn, const COutPoint& outpointIn, Coin* pcoinIn, char* pfFoundIn) : pview(pviewIn), outpoint(outpointIn), pcoin(pcoinIn), pfFound(pfFoundIn) {}
+
+    bool operator()()
+    {
+        try {
+            *pfFound = pview->GetCoin(outpoint, *pcoin);
+        } catch (const std::exception&) {
+            // Leave the lookup to ConnectBlock, which reports database errors.
+            *pfFound = false;
+        }
+        return true;
+    }
+
+    void swap(CCoinPrefetch& fetch)
+    {
+        std::swap(pview, fetch.pview);
+        std::swap(outpoint, fetch.outpoint);
+        std::swap(pcoin, fetch.pcoin);
+        std::swap(pfFound, fetch.pfFound);
+    }
+};
+
+static CCheckQueue<CCoinPrefetch> coinprefetchqueue(16);
+
+void ThreadCoinPrefetch()
+{
+    RenameThread("alqo-prefetch");
+    coinprefetchqueue.Thread();
+}
+
+static uint64_t nPrefetchCacheHits = 0;
+static uint64_t nPrefetchDiskReads = 0;
+
+/**
+ * Load the inputs spent by a block into pcoinsTip before ConnectBlock walks
+ * them. Inputs already held by the cache are counted as hits; the others are
+ * read from the coins database by the prefetch workers in parallel and then
+ * inserted into the cache on this thread, so the serial pass that follows
+ * only touches memory.
+ */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads)
+        return;
+
+    // Outputs created by the block itself are never on disk yet
+    std::set<uint256> setBlockTxids;
+    for (const CTransaction& tx : block.vtx)
+        setBlockTxids.insert(tx.GetHash());
+
+    std::vector<COutPoint> vMissing;
+    unsigned int nHits = 0;
+    for (const CTransaction& tx : block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        for (const CTxIn& txin : tx.vin) {
+            if (setBlockTxids.count(txin.prevout.hash))
+                continue;
+            if (pcoinsTip->HaveEntryInCache(txin.prevout))
+                nHits++;
+            else
+                vMissing.push_back(txin.prevout);
+        }
+    }
+
+    std::vector<Coin> vCoins(vMissing.size());
+    std::vector<char> vFound(vMissing.size(), 0);
+    if (!vMissing.empty()) {
+        std::vector<CCoinPrefetch> vFetches;
+        vFetches.reserve(vMissing.size());
+        for (unsigned int i = 0; i < vMissing.size(); i++)
+            vFetches.push_back(CCoinPrefetch(pcoinsdbview, vMissing[i], &vCoins[i], &vFound[i]));
+        CCheckQueueControl<CCoinPrefetch> control(&coinprefetchqueue);
+        control.Add(vFetches);
+        control.Wait();
+    }
+    for (unsigned int i = 0; i < vMissing.size(); i++) {
+        if (vFound[i])
+            pcoinsTip->PrefetchCoin(vMissing[i], std::move(vCoins[i]));
+    }
+
+    nPrefetchCacheHits += nHits;
+    nPrefetchDiskReads += vMissing.size();
+    LogPrint("bench", "  - Prefetch inputs: %u cached, %u from disk [%u cached, %u from disk]\n",
+        nHits, (unsigned int)vMissing.size(), nPrefetchCacheHits, nPrefetchDiskReads);
+}
+
 void AddWrappedSerialsInflation()
 {
     return;
@@ -2092,13 +2568,24 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return state.DoS(100, error("ConnectBlock() : PoW period ended"),
             REJECT_INVALID, "PoW-ended");
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fScriptChecks = true;
+    if (hashAssumeValid != uint256(0)) {
+        // Skip script verification for blocks that are ancestors of both the
+        // assumed-valid block and the best header we know of, as long as that
+        // header chain has the minimum chain work and reaches two weeks past
+        // the block. A fake header chain built to get scripts skipped would
+        // have to match real work and time. Everything else, including the
+        // UTXO accounting and input amounts, is still checked.
+        BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+        if (it != mapBlockIndex.end() && it->second->GetAncestor(pindex->nHeight) == pindex &&
+            pindexBestHeader && pindexBestHeader->GetAncestor(pindex->nHeight) == pindex &&
+            pindexBestHeader->nChainWork >= nMinimumChainWork &&
+            pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() > ASSUMEVALID_MIN_AGE)
+            fScriptChecks = false;
+    }
 
     // If scripts won't be checked anyways, don't bother seeing if CLTV is activated
-    bool fCLTVHasMajority = false;
-    if (fScriptChecks && pindex->pprev) {
-        fCLTVHasMajority = CBlockIndex::IsSuperMajority(5, pindex->pprev, Params().EnforceBlockUpgradeMajority());
-    }
+    unsigned int flags = fScriptChecks ? GetBlockScriptFlags(pindex->pprev) : (unsigned int)SCRIPT_VERIFY_NONE;
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -2117,10 +2604,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                              (pindex->nHeight == 91880 && pindex->GetBlockHash() == uint256("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
     if (fEnforceBIP30) {
         for (const CTransaction& tx : block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
-                    REJECT_INVALID, "bad-txns-BIP30");
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                    return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
+                        REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
@@ -2143,10 +2631,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
         const CTransaction& tx = block.vtx[i];
 
-        const CCoins* coins = view.AccessCoins(tx.GetHash());
-        if (coins && !coins->IsPruned())
-            return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
-                             REJECT_INVALID, "bad-txns-BIP30");
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
         if (nSigOps > nMaxBlockSigOps)
@@ -2170,11 +2654,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             nValueIn += view.GetValueIn(tx);
 
             std::vector<CScriptCheck> vChecks;
-            unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
-            if (fCLTVHasMajority)
-                flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            // Keep cache entries when only testing the block (e.g. for a new
+            // stake) so they are still there when it is connected for real
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fJustCheck, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -2263,30 +2745,141 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 }
 
 enum FlushStateMode {
+    FLUSH_STATE_NONE,
     FLUSH_STATE_IF_NEEDED,
     FLUSH_STATE_PERIODIC,
     FLUSH_STATE_ALWAYS
 };
 
-/**
- * Update the on-disk chain state.
- * The caches and indexes are flushed if either they're too large, forceWrite is set, or
- * fast is not set and it's been a while since the last write.
- */
-bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
+uint64_t CalculateCurrentUsage()
 {
-    LOCK(cs_main);
-    static int64_t nLastWrite = 0;
-    try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
+    uint64_t retval = 0;
+    for (const CBlockFileInfo& file : vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+void PruneOneBlockFile(const int fileNumber)
+{
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (pindex->nFile == fileNumber) {
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+            pindex->nStatus &= ~BLOCK_HAVE_UNDO;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            setDirtyBlockIndex.insert(pindex);
+
+            // Prune from mapBlocksUnlinked -- any block we prune would have
+            // to be downloaded again in order to consider its chain, at which
+            // point it would be considered as a candidate for
+            // mapBlocksUnlinked or setBlockIndexCandidates.
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+                range.first++;
+                if (itUnlinked->second == pindex) {
+                    mapBlocksUnlinked.erase(itUnlinked);
+                }
+            }
+        }
+    }
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        UnmapBlockFile(*it);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+/* Calculate the block/rev files that should be deleted to remain under target*/
+void static FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0) {
+        return;
+    }
+
+    unsigned int nLastBlockWeCanPrune = std::max(0, chainActive.Tip()->nHeight - MIN_BLOCKS_TO_KEEP);
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    // We don't check to prune until after we've allocated new space for files
+    // So we should leave a buffer under our target to account for another allocation
+    // before the next pruning.
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    uint64_t nBytesToPrune;
+    int count = 0;
+
+    if (nCurrentUsage + nBuffer >= nPruneTarget) {
+        for (int fileNumber = 0; fileNumber < nLastBlockFile; fileNumber++) {
+            nBytesToPrune = vinfoBlockFile[fileNumber].nSize + vinfoBlockFile[fileNumber].nUndoSize;
+
+            if (vinfoBlockFile[fileNumber].nSize == 0)
+                continue;
+
+            if (nCurrentUsage + nBuffer < nPruneTarget) // are we below our target?
+                break;
+
+            // don't prune files that could have a block within MIN_BLOCKS_TO_KEEP of the main chain's tip
+            if (vinfoBlockFile[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+                continue;
+
+            PruneOneBlockFile(fileNumber);
+            // Queue up the files for removal
+            setFilesToPrune.insert(fileNumber);
+            nCurrentUsage -= nBytesToPrune;
+            count++;
+        }
+    }
+
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+        nPruneTarget / 1024 / 1024, nCurrentUsage / 1024 / 1024,
+        ((int64_t)nPruneTarget - (int64_t)nCurrentUsage) / 1024 / 1024,
+        nLastBlockWeCanPrune, count);
+}
+
+/**
+ * Update the on-disk chain state.
+ * The caches and indexes are flushed if either they're too large, forceWrite is set, or
+ * fast is not set and it's been a while since the last write.
+ * In prune mode, block files above the target are deleted once the index no longer refers to them.
+ */
+bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
+{
+    LOCK(cs_main);
+    static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
+    try {
+        if (fPruneMode && fCheckForPruning && !fReindex) {
+            FindFilesToPrune(setFilesToPrune);
+            fCheckForPruning = false;
+            if (!setFilesToPrune.empty()) {
+                fFlushForPrune = true;
+                if (!fHavePruned) {
+                    pblocktree->WriteFlag("prunedblockfiles", true);
+                    fHavePruned = true;
+                }
+            }
+        }
+        if ((mode == FLUSH_STATE_ALWAYS) || fFlushForPrune ||
             ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
-            // Typical CCoins structures on disk are around 100 bytes in size.
+            // Typical Coin structures on disk are around 48 bytes in size.
             // Pushing a new one to the database can cause it to be written
             // twice (once in the log, and once in the tables). This is already
             // an overestimation, as most will delete an existing entry or
             // overwrite one. Still, use a conservative safety factor of 2.
-            if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+            if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
             // First make sure all block and undo data is flushed to disk.
             FlushBlockFile();
@@ -2310,7 +2903,10 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             }
 
             pblocktree->Sync();
-            // Finally flush the chainstate (which may refer to block index entries).
+            // Finally remove any pruned files
+            if (fFlushForPrune)
+                UnlinkPrunedFiles(setFilesToPrune);
+            // Then flush the chainstate (which may refer to block index entries).
             if (!pcoinsTip->Flush())
                 return state.Abort("Failed to write to coin database");
             // Update best block in wallet (so we can detect restored wallets).
@@ -2331,6 +2927,13 @@ void FlushStateToDisk()
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush()
+{
+    CValidationState state;
+    fCheckForPruning = true;
+    FlushStateToDisk(state, FLUSH_STATE_NONE);
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex* pindexNew)
 {
@@ -2391,13 +2994,22 @@ bool static DisconnectTip(CValidationState& state)
     if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     for (const CTransaction& tx : block.vtx) {
         // ignore validation errors in resurrected transactions
         std::list<CTransaction> removed;
         CValidationState stateDummy;
         if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
             mempool.remove(tx, removed, true);
-    }
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in this
+    // block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
@@ -2411,6 +3023,7 @@ bool static DisconnectTip(CValidationState& state)
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
@@ -2442,6 +3055,10 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    PrefetchBlockInputs(*pblock);
+    int64_t nTimePrefetched = GetTimeMicros();
+    nTimePrefetch += nTimePrefetched - nTime2;
+    LogPrint("bench", "  - Prefetch: %.2fms [%.2fs]\n", (nTimePrefetched - nTime2) * 0.001, nTimePrefetch * 0.000001);
     {
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
         bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
@@ -2453,8 +3070,8 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
         }
         mapBlockSource.erase(inv.hash);
         nTime3 = GetTimeMicros();
-        nTimeConnectTotal += nTime3 - nTime2;
-        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+        nTimeConnectTotal += nTime3 - nTimePrefetched;
+        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTimePrefetched) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
     }
     int64_t nTime4 = GetTimeMicros();
@@ -2735,6 +3352,7 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
         boost::this_thread::interruption_point();
 
         bool fInitialDownload;
+        std::set<NodeId> setHeaderAndIDsPeers;
         while (true) {
             TRY_LOCK(cs_main, lockMain);
             if (!lockMain) {
@@ -2753,6 +3371,11 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
 
             pindexNewTip = chainActive.Tip();
             fInitialDownload = IsInitialBlockDownload();
+            if (!fInitialDownload) {
+                for (const std::pair<const NodeId, CNodeState>& item : mapNodeState)
+                    if (item.second.fPreferHeaderAndIDs)
+                        setHeaderAndIDsPeers.insert(item.first);
+            }
             break;
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
@@ -2760,13 +3383,32 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            // Peers in high-bandwidth mode get the new tip as a cmpctblock right away, if we have it at hand.
+            // The message is serialized once and shared by all of them.
+            CSerializedMessageRef msgCmpctBlock;
+            if (pblock && pblock->GetHash() == hashNewTip && !setHeaderAndIDsPeers.empty())
+                msgCmpctBlock = MakeSerializedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*pblock));
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
                 LOCK(cs_vNodes);
-                for (CNode* pnode : vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                for (CNode* pnode : vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CInv inv(MSG_BLOCK, hashNewTip);
+                    if (msgCmpctBlock && setHeaderAndIDsPeers.count(pnode->GetId())) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = !pnode->setInventoryKnown.insert(inv).second;
+                        }
+                        if (!fKnown) {
+                            LogPrint("cmpctblock", "announcing block %s with cmpctblock to peer=%d\n", hashNewTip.ToString(), pnode->id);
+                            pnode->PushSerializedMessage(msgCmpctBlock);
+                        }
+                    } else
+                        pnode->PushInventory(inv);
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -3027,6 +3669,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
                     AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
                     fclose(file);
                 }
+                if (fPruneMode)
+                    fCheckForPruning = true;
             } else
                 return state.Error("out of disk space");
         }
@@ -3057,6 +3701,8 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
                 AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
                 fclose(file);
             }
+            if (fPruneMode)
+                fCheckForPruning = true;
         } else
             return state.Error("out of disk space");
     }
@@ -3513,17 +4159,11 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         // If the stake is not a zPoS then let's check if the inputs were spent on the main chain
         const CCoinsViewCache coins(pcoinsTip);
 		for (const CTxIn& in: stakeTxIn.vin) {
-			const CCoins* coin = coins.AccessCoins(in.prevout.hash);
+			const Coin& coin = coins.AccessCoin(in.prevout);
 
-			if(!coin && !isBlockFromFork){
-				// No coins on the main chain
-				return error("%s: coin stake inputs not available on main chain, received height %d vs current %d", __func__, nHeight, chainActive.Height());
-			}
-			if(coin && !coin->IsAvailable(in.prevout.n)){
-				if(!isBlockFromFork){
-					// Coins not available
-					return error("%s: coin stake inputs already spent in main chain", __func__);
-				}
+			if(coin.IsSpent() && !isBlockFromFork){
+				// No unspent coin on the main chain
+				return error("%s: coin stake inputs not available or already spent on main chain, received height %d vs current %d", __func__, nHeight, chainActive.Height());
 			}
 		}
     }
@@ -3824,7 +4464,9 @@ bool static LoadBlockIndexDB(std::string& strError)
 
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        // We can link the chain of blocks for which we've received transactions at some point.
+        // Pruned nodes may have deleted the block.
+        if (pindex->nTx > 0) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -3863,6 +4505,11 @@ bool static LoadBlockIndexDB(std::string& strError)
         }
     }
 
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
+
     // Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
     std::set<int> setBlkDataFiles;
@@ -3945,6 +4592,11 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
+        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruning, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -4007,8 +4659,7 @@ void UnloadBlockIndex()
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    orphanage.Clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -4016,6 +4667,9 @@ void UnloadBlockIndex()
     nBlockSequenceId = 1;
     mapBlockSource.clear();
     mapBlocksInFlight.clear();
+    ClearHeaderChain();
+    nodeHeaderSync = -1;
+    nHeaderSyncRequestTime = 0;
     nQueuedValidatedHeaders = 0;
     nPreferredDownload = 0;
     setDirtyBlockIndex.clear();
@@ -4213,6 +4867,7 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL;         // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL;         // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL;  // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL;    // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL;   // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
@@ -4220,6 +4875,7 @@ void static CheckBlockIndex()
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -4230,12 +4886,19 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis());                       // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
-        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
+        if (!fHavePruned) {
+            // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            // If we have pruned, then we can only say that HAVE_DATA implies nTx > 0
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
+        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0)); // This is pruning-independent.
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0); // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0));                                             // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0)); // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
         assert(pindex->nHeight == nHeight);                                                                          // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork);                            // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight)));                                // The pskip pointer must point back for all but the first 2 blocks.
@@ -4247,9 +4910,15 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
-                assert(setBlockIndexCandidates.count(pindex));
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            if (pindexFirstInvalid == NULL) {
+                // If this block sorts at least as good as the current tip and
+                // is valid and we have all data for its parents, it must be in
+                // setBlockIndexCandidates.  chainActive.Tip() must also be there
+                // even if some data has been pruned.
+                if (pindexFirstMissing == NULL || pindex == chainActive.Tip()) {
+                    assert(setBlockIndexCandidates.count(pindex));
+                }
             }
         } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
             assert(setBlockIndexCandidates.count(pindex) == 0);
@@ -4265,12 +4934,28 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked); // Can't be in mapBlocksUnlinked if we don't HAVE_DATA
+        if (pindexFirstMissing == NULL) assert(!foundInUnlinked);          // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // We HAVE_DATA for this block, have received data for all parents at some point, but we're currently missing data for some parent.
+            assert(fHavePruned); // We must have pruned.
+            // This block may have entered mapBlocksUnlinked if:
+            //  - it has a descendant that at some point had more work than the
+            //    tip, and
+            //  - we tried switching to that descendant but were missing
+            //    data for some intermediate block between chainActive and the
+            //    tip.
+            // So if this block is itself better than chainActive.Tip() and it wasn't in
+            // setBlockIndexCandidates, then it must be in mapBlocksUnlinked.
+            if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && setBlockIndexCandidates.count(pindex) == 0) {
+                if (pindexFirstInvalid == NULL) {
+                    assert(foundInUnlinked);
+                }
             }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
-            assert(!foundInUnlinked);
         }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
@@ -4290,6 +4975,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -4318,6 +5004,8 @@ void static CheckBlockIndex()
 
     // Check that we actually traversed the entire map.
     assert(nNodes == forward.size());
+
+    assert(CheckStakeModifierIndex());
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -4384,8 +5072,11 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TX: {
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
-        return txInMap || mapOrphanTransactions.count(inv.hash) ||
-               pcoinsTip->HaveCoins(inv.hash);
+        // Use pcoinsTip->HaveCoinInCache as a quick approximation to exclude
+        // requesting or processing some txs which have already been included in a block
+        return txInMap || orphanage.HaveTx(inv.hash) ||
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+               pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
     }
     case MSG_DSTX:
         return mapObfuscationBroadcastTxes.count(inv.hash);
@@ -4398,51 +5089,107 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TXLOCK_VOTE:
         return mapTxLockVote.count(inv.hash);
     case MSG_SPORK:
-        return mapSporks.count(inv.hash);
+        return sporkManager.HaveSporkMessage(inv.hash);
     case MSG_MASTERNODE_WINNER:
-        if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
+        if (masternodePayments.HasPayeeVote(inv.hash)) {
             masternodeSync.AddedMasternodeWinner(inv.hash);
             return true;
         }
         return false;
     case MSG_BUDGET_VOTE:
-        if (budget.mapSeenMasternodeBudgetVotes.count(inv.hash)) {
-            masternodeSync.AddedBudgetItem(inv.hash);
-            return true;
-        }
-        return false;
     case MSG_BUDGET_PROPOSAL:
-        if (budget.mapSeenMasternodeBudgetProposals.count(inv.hash)) {
-            masternodeSync.AddedBudgetItem(inv.hash);
-            return true;
-        }
-        return false;
     case MSG_BUDGET_FINALIZED_VOTE:
-        if (budget.mapSeenFinalizedBudgetVotes.count(inv.hash)) {
-            masternodeSync.AddedBudgetItem(inv.hash);
-            return true;
+    case MSG_BUDGET_FINALIZED: {
+        bool fSeen;
+        {
+            LOCK(budget.cs);
+            if (inv.type == MSG_BUDGET_VOTE)
+                fSeen = budget.mapSeenMasternodeBudgetVotes.count(inv.hash);
+            else if (inv.type == MSG_BUDGET_PROPOSAL)
+                fSeen = budget.mapSeenMasternodeBudgetProposals.count(inv.hash);
+            else if (inv.type == MSG_BUDGET_FINALIZED_VOTE)
+                fSeen = budget.mapSeenFinalizedBudgetVotes.count(inv.hash);
+            else
+                fSeen = budget.mapSeenFinalizedBudgets.count(inv.hash);
         }
-        return false;
-    case MSG_BUDGET_FINALIZED:
-        if (budget.mapSeenFinalizedBudgets.count(inv.hash)) {
+        if (fSeen)
             masternodeSync.AddedBudgetItem(inv.hash);
-            return true;
+        return fSeen;
+    }
+    case MSG_MASTERNODE_ANNOUNCE: {
+        bool fSeen;
+        {
+            LOCK(mnodeman.cs);
+            fSeen = mnodeman.mapSeenMasternodeBroadcast.count(inv.hash);
         }
-        return false;
-    case MSG_MASTERNODE_ANNOUNCE:
-        if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
+        if (fSeen)
             masternodeSync.AddedMasternodeList(inv.hash);
-            return true;
-        }
-        return false;
-    case MSG_MASTERNODE_PING:
+        return fSeen;
+    }
+    case MSG_MASTERNODE_PING: {
+        LOCK(mnodeman.cs);
         return mnodeman.mapSeenMasternodePing.count(inv.hash);
     }
+    }
     // Don't know what it is, just say we already got one
     return true;
 }
 
 
+// Messages are processed on one of two lanes, each serving one message at a time
+// like the single message handler thread did before: the core lane for blocks,
+// transactions and everything else touching validation state, and the extension
+// lane for masternodes, sporks, budgets and their sync. The masternode layer thus
+// doesn't wait behind block validation. The seen maps both lanes share are
+// guarded by the locks of their managers. Lanes are only ever try-locked, and
+// a message waits at the front of its peer's queue until its lane is free.
+static CCriticalSection cs_msgCore;
+static CCriticalSection cs_msgExtension;
+
+CCriticalSection* GetMessageLane(const std::string& strCommand)
+{
+    static const std::set<std::string> setExtensionCommands = {
+        "mnb", "mnp", "mnw", "mnget", "dseg", "dsee", "dseep",
+        "mnvs", "mprop", "mvote", "fbs", "fbvote",
+        "spork", "getsporks", "ssc"};
+
+    // Only touch the peer itself
+    if (strCommand == "ping" || strCommand == "pong")
+        return NULL;
+    if (setExtensionCommands.count(strCommand))
+        return &cs_msgExtension;
+    return &cs_msgCore;
+}
+
+/** The tip as served to peers, serialized on its first request. Requires cs_main. */
+static uint256 hashTipMessages;
+static CSerializedMessageRef msgTipBlock;
+static CSerializedMessageRef msgTipCmpctBlock;
+
+// Requires cs_main. Every peer hearing of a new tip asks for it at about the same
+// time: read and serialize the tip once, and queue the same message to all of them.
+static CSerializedMessageRef GetTipBlockMessage(bool fCompact)
+{
+    CBlockIndex* pindexTip = chainActive.Tip();
+    if (hashTipMessages != pindexTip->GetBlockHash()) {
+        hashTipMessages = pindexTip->GetBlockHash();
+        msgTipBlock.reset();
+        msgTipCmpctBlock.reset();
+    }
+    CSerializedMessageRef& msg = fCompact ? msgTipCmpctBlock : msgTipBlock;
+    if (!msg) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindexTip))
+            assert(!"cannot load block from disk");
+        if (fCompact)
+            msg = MakeSerializedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+        else
+            msg = MakeSerializedMessage("block", block);
+    }
+    return msg;
+}
+
+// requires the core message lane
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4461,7 +5208,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -4480,31 +5227,44 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
-                    {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter) {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didnt send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            for (PairType& pair : merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                    // Compact blocks only go to peers that sent sendcmpct, the others get the full block
+                    const bool fCompactNegotiated = inv.type == MSG_CMPCT_BLOCK && State(pfrom->GetId())->fProvidesHeaderAndIDs;
+                    if (mi->second == chainActive.Tip() && (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)) {
+                        pfrom->PushSerializedMessage(GetTipBlockMessage(fCompactNegotiated));
+                    } else {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
+                        if (inv.type == MSG_BLOCK)
+                            pfrom->PushMessage("block", block);
+                        else if (inv.type == MSG_CMPCT_BLOCK) {
+                            // A peer asking for an old block is unlikely to have a mempool that matches
+                            // it, so we don't bother building the compact block and send the full one.
+                            if (fCompactNegotiated && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH)
+                                pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                            else
+                                pfrom->PushMessage("block", block);
+                        } else // MSG_FILTERED_BLOCK)
+                        {
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter) {
+                                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                                pfrom->PushMessage("merkleblock", merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didnt send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                for (PairType& pair : merkleBlock.vMatchedTxn)
+                                    if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                        pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
+                            // else
+                            // no response
                         }
-                        // else
-                        // no response
                     }
 
                     // Trigger them to send a getblocks request for the next batch of inventory
@@ -4559,24 +5319,27 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_SPORK) {
-                    if (mapSporks.count(inv.hash)) {
+                    CSporkMessage spork;
+                    if (sporkManager.GetSporkMessage(inv.hash, spork)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << mapSporks[inv.hash];
+                        ss << spork;
                         pfrom->PushMessage("spork", ss);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
-                    if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
+                    CMasternodePaymentWinner winner;
+                    if (masternodePayments.GetPayeeVote(inv.hash, winner)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << masternodePayments.mapMasternodePayeeVotes[inv.hash];
+                        ss << winner;
                         pfrom->PushMessage("mnw", ss);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_BUDGET_VOTE) {
+                    LOCK(budget.cs);
                     if (budget.mapSeenMasternodeBudgetVotes.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4587,6 +5350,7 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_PROPOSAL) {
+                    LOCK(budget.cs);
                     if (budget.mapSeenMasternodeBudgetProposals.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4597,6 +5361,7 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_FINALIZED_VOTE) {
+                    LOCK(budget.cs);
                     if (budget.mapSeenFinalizedBudgetVotes.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4607,6 +5372,7 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_FINALIZED) {
+                    LOCK(budget.cs);
                     if (budget.mapSeenFinalizedBudgets.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4617,6 +5383,7 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
+                    LOCK(mnodeman.cs);
                     if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4627,6 +5394,7 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_PING) {
+                    LOCK(mnodeman.cs);
                     if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -4675,6 +5443,100 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Connect buffered blocks that were waiting for hashParent, following the header schedule. */
+void static ProcessBlocksPendingParent(uint256 hashParent)
+{
+    while (true) {
+        CPendingBlock pending;
+        uint256 hash;
+        {
+            LOCK(cs_main);
+            unsigned int nIndex = 0;
+            boost::unordered_map<uint256, int, BlockHasher>::iterator itHeight = mapHeaderChainHeight.find(hashParent);
+            if (itHeight != mapHeaderChainHeight.end())
+                nIndex = itHeight->second - nHeaderChainStart + 1;
+            if (nIndex >= dequeHeaderChain.size())
+                return;
+            hash = dequeHeaderChain[nIndex];
+            std::map<uint256, CPendingBlock>::iterator it = mapBlocksPendingParent.find(hash);
+            if (it == mapBlocksPendingParent.end() || it->second.block.hashPrevBlock != hashParent)
+                return;
+            pending = it->second;
+            ErasePendingBlock(hash);
+        }
+
+        CValidationState state;
+        if (!ProcessNewBlock(state, NULL, &pending.block)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(pending.nodeid, nDoS);
+            }
+            return;
+        }
+        hashParent = hash;
+    }
+}
+
+/** Handle a block a peer sent us, in full or reconstructed from a cmpctblock. */
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+
+    // Blocks fetched from the header schedule may arrive before their parent
+    bool fPendingParent = false;
+    if (!mapBlockIndex.count(block.hashPrevBlock)) {
+        LOCK(cs_main);
+        fPendingParent = BufferBlockPendingParent(pfrom->GetId(), block);
+    }
+
+    //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
+    if (fPendingParent) {
+        pfrom->AddInventoryKnown(inv);
+        LogPrint("net", "buffered block %s until its parent arrives peer=%d\n", hashBlock.ToString(), pfrom->id);
+    } else if (!mapBlockIndex.count(block.hashPrevBlock)) {
+        if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+            //we already asked for this block, so lets work backwards and ask for the previous block
+            pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
+            pfrom->vBlockRequested.push_back(block.hashPrevBlock);
+        } else {
+            //ask to sync to this block
+            pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+            pfrom->vBlockRequested.push_back(hashBlock);
+        }
+    } else {
+        pfrom->AddInventoryKnown(inv);
+
+        CValidationState state;
+        if (!mapBlockIndex.count(block.GetHash())) {
+            bool fAccepted = ProcessNewBlock(state, pfrom, &block);
+            int nDoS;
+            if(state.IsInvalid(nDoS)) {
+                pfrom->PushMessage("reject", std::string("block"), state.GetRejectCode(),
+                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+                if(nDoS > 0) {
+                    TRY_LOCK(cs_main, lockMain);
+                    if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+                }
+            } else if (fAccepted) {
+                {
+                    // The first peer to give us a new tip is a good candidate to announce the next one
+                    LOCK(cs_main);
+                    if (chainActive.Tip()->GetBlockHash() == hashBlock && !IsInitialBlockDownload())
+                        MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+                }
+                ProcessBlocksPendingParent(hashBlock);
+            }
+            //disconnect this node if its old protocol version
+            pfrom->DisconnectOldProtocol(ActiveProtocol(), "block");
+        } else {
+            LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+            ProcessBlocksPendingParent(hashBlock);
+        }
+    }
+}
+
 bool fRequestedSporksIDB = false;
 bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
@@ -4819,6 +5681,14 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell our peer we can reconstruct compact blocks, but want them announced
+            // with inv until it has proven to deliver new blocks quickly.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
     }
 
     else if (strCommand == "addr") {
@@ -4894,8 +5764,22 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
 
         LOCK(cs_main);
 
+        if (pfrom->GetId() == nodeHeaderSync && nHeaderSyncRequestTime && vInv.size() > 1 && vInv.back().type == MSG_BLOCK) {
+            // Older peers answer getheaders like getblocks. Keep the inventory, but find another headers peer.
+            LogPrint("net", "peer=%d answered getheaders with inventory, not using it for headers\n", pfrom->id);
+            State(pfrom->GetId())->fNoHeaders = true;
+            nodeHeaderSync = -1;
+            nHeaderSyncRequestTime = 0;
+        }
+
         std::vector<CInv> vToFetch;
 
+        // A single new block announced by a peer that can send compact blocks is fetched as one
+        unsigned int nBlockInvs = 0;
+        for (const CInv& inv : vInv)
+            nBlockInvs += inv.type == MSG_BLOCK;
+        const bool fFetchCompact = nBlockInvs == 1 && State(pfrom->GetId())->fProvidesHeaderAndIDs && !IsInitialBlockDownload();
+
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
             const CInv& inv = vInv[nInv];
 
@@ -4912,8 +5796,13 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
+                    // Add this to the list of blocks to request. A compact block is tracked in
+                    // flight, so that the cmpctblock answering it counts as requested.
+                    if (fFetchCompact && State(pfrom->GetId())->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                        vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                    } else
+                        vToFetch.push_back(inv);
                     LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
                 }
             }
@@ -4951,48 +5840,13 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
-
-        LOCK(cs_main);
-
-        // Find the last block the caller has in the main chain
-        CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
-
-        // Send the rest of the chain
-        if (pindex)
-            pindex = chainActive.Next(pindex);
-        int nLimit = 500;
-        LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop == uint256(0) ? "end" : hashStop.ToString(), nLimit, pfrom->id);
-        for (; pindex; pindex = chainActive.Next(pindex)) {
-            if (pindex->GetBlockHash() == hashStop) {
-                LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                break;
-            }
-            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-            if (--nLimit <= 0) {
-                // When this block is requested, we'll send an inv that'll make them
-                // getblocks the next batch of inventory.
-                LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                pfrom->hashContinue = pindex->GetBlockHash();
-                break;
-            }
-        }
-    }
-
-
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders" && Params().HeadersFirstSyncingActive()) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
         LOCK(cs_main);
 
-        if (IsInitialBlockDownload())
-            return true;
-
         CBlockIndex* pindex = NULL;
         if (locator.IsNull()) {
             // If locator is null, return the hashStop block
@@ -5010,8 +5864,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         std::vector<CBlock> vHeaders;
         int nLimit = MAX_HEADERS_RESULTS;
-        if (fDebug)
-            LogPrintf("getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+        LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
         for (; pindex; pindex = chainActive.Next(pindex)) {
             vHeaders.push_back(pindex->GetBlockHeader());
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
@@ -5021,9 +5874,40 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
     }
 
 
+    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+        CBlockLocator locator;
+        uint256 hashStop;
+        vRecv >> locator >> hashStop;
+
+        LOCK(cs_main);
+
+        // Find the last block the caller has in the main chain
+        CBlockIndex* pindex = FindForkInGlobalIndex(chainActive, locator);
+
+        // Send the rest of the chain
+        if (pindex)
+            pindex = chainActive.Next(pindex);
+        int nLimit = 500;
+        LogPrint("net", "getblocks %d to %s limit %d from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop == uint256(0) ? "end" : hashStop.ToString(), nLimit, pfrom->id);
+        for (; pindex; pindex = chainActive.Next(pindex)) {
+            if (pindex->GetBlockHash() == hashStop) {
+                LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
+            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+            if (--nLimit <= 0) {
+                // When this block is requested, we'll send an inv that'll make them
+                // getblocks the next batch of inventory.
+                LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                pfrom->hashContinue = pindex->GetBlockHash();
+                break;
+            }
+        }
+    }
+
+
     else if (strCommand == "tx" || strCommand == "dstx") {
         std::vector<uint256> vWorkQueue;
-        std::vector<uint256> vEraseQueue;
         CTransaction tx;
 
         //masternode signed transaction
@@ -5084,7 +5968,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
+            orphanage.GetChildren(tx, vWorkQueue);
 
             LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
                      pfrom->id, pfrom->cleanSubVer,
@@ -5093,57 +5977,51 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
 
             // Recursively process any orphan transactions that depended on this one
             std::set<NodeId> setMisbehaving;
-            for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                std::map<uint256, std::set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if(itByPrev == mapOrphanTransactionsByPrev.end())
+            for (unsigned int i = 0; i < vWorkQueue.size(); i++) {
+                const uint256 orphanHash = vWorkQueue[i];
+                CTransaction orphanTx;
+                NodeId fromPeer;
+                if (!orphanage.GetTx(orphanHash, orphanTx, fromPeer))
                     continue;
-                for(std::set<uint256>::iterator mi = itByPrev->second.begin();
-                    mi != itByPrev->second.end();
-                    ++mi) {
-                    const uint256 &orphanHash = *mi;
-                    const CTransaction &orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if(setMisbehaving.count(fromPeer))
-                        continue;
-                    if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if(!fMissingInputs2) {
-                        int nDos = 0;
-                        if(stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    orphanage.EraseTx(orphanHash);
+                    orphanage.GetChildren(orphanTx, vWorkQueue);
+                } else if (!fMissingInputs2) {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0) {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
                     }
-                    mempool.check(pcoinsTip);
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    orphanage.EraseTx(orphanHash);
                 }
+                mempool.check(pcoinsTip);
             }
 
-            for (uint256 hash : vEraseQueue) EraseOrphanTx(hash);
-
         } else if (fMissingInputs) {
-            AddOrphanTx(tx, pfrom->GetId());
+            orphanage.AddTx(tx, pfrom->GetId());
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            // DoS prevention: do not allow the orphanage to grow unbounded, nor one peer to fill it
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            unsigned int nMaxOrphanTxPerPeer = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantxperpeer", DEFAULT_MAX_ORPHAN_TRANSACTIONS_PER_PEER));
+            unsigned int nEvicted = orphanage.LimitOrphans(nMaxOrphanTx, nMaxOrphanTxPerPeer);
             if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+                LogPrint("mempool", "orphanage overflow, removed %u tx\n", nEvicted);
         } else if (pfrom->fWhitelisted) {
             // Always relay transactions received from whitelisted peers, even
             // if they are already in the mempool (allowing the node to function
@@ -5188,86 +6066,265 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
 
         LOCK(cs_main);
 
-        if (nCount == 0) {
-            // Nothing interesting. Stop asking this peers for more headers.
+        bool fFromSyncPeer = pfrom->GetId() == nodeHeaderSync;
+        if (fFromSyncPeer)
+            nHeaderSyncRequestTime = 0;
+
+        // Skip the headers we already have or have scheduled.
+        TrimHeaderChain();
+        unsigned int nFirst = 0;
+        while (nFirst < nCount && (mapBlockIndex.count(headers[nFirst].GetHash()) || mapHeaderChainHeight.count(headers[nFirst].GetHash())))
+            nFirst++;
+        if (nFirst == nCount) {
+            // Nothing interesting. Stop asking this peer for more headers.
+            if (fFromSyncPeer)
+                fHeaderSyncMore = false;
             return true;
         }
-        CBlockIndex* pindexLast = NULL;
-        for (const CBlockHeader& header : headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+
+        // New headers must extend the schedule, or fork it off the active chain.
+        const uint256 hashPrev = headers[nFirst].hashPrevBlock;
+        int nHeight;
+        if (!dequeHeaderChain.empty() && hashPrev == dequeHeaderChain.back()) {
+            nHeight = nHeaderChainStart + dequeHeaderChain.size();
+        } else {
+            BlockMap::iterator mi = mapBlockIndex.find(hashPrev);
+            if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second)) {
+                LogPrint("net", "headers from peer=%d do not connect to the header schedule\n", pfrom->id);
+                return true;
+            }
+            // Only the sync peer gets to replace an existing schedule.
+            if (!dequeHeaderChain.empty() && !fFromSyncPeer)
+                return true;
+            ClearHeaderChain();
+            nHeaderChainStart = mi->second->nHeight + 1;
+            nHeight = nHeaderChainStart;
+        }
+
+        uint256 hashLast = hashPrev;
+        unsigned int nAdded = 0;
+        for (unsigned int n = nFirst; n < nCount; n++) {
+            const CBlockHeader& header = headers[n];
+            if (header.hashPrevBlock != hashLast) {
                 Misbehaving(pfrom->GetId(), 20);
                 return error("non-continuous headers sequence");
             }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
-            if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
+            // Proof-of-stake headers can only be checked once the block arrives.
+            CValidationState state;
+            if (!CheckBlockHeader(header, state, nHeight <= Params().LAST_POW_BLOCK())) {
                 int nDoS;
-                if (state.IsInvalid(nDoS)) {
-                    if (nDoS > 0)
-                        Misbehaving(pfrom->GetId(), nDoS);
-                    std::string strError = "invalid header received " + header.GetHash().ToString();
-                    return error(strError.c_str());
-                }
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received %s", header.GetHash().ToString());
             }
-        }
-
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+            if (Params().NetworkID() != CBaseChainParams::REGTEST && header.GetBlockTime() > GetAdjustedTime() + 7200) {
+                Misbehaving(pfrom->GetId(), 20);
+                return error("header %s timestamp too far in the future", header.GetHash().ToString());
+            }
+            if (dequeHeaderChain.size() >= MAX_HEADERS_SYNC_AHEAD)
+                break;
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
-            // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrintf("more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256(0));
+            hashLast = header.GetHash();
+            mapHeaderChainHeight[hashLast] = nHeight;
+            dequeHeaderChain.push_back(hashLast);
+            dequeHeaderSource.push_back(pfrom->GetId());
+            nHeight++;
+            nAdded++;
         }
 
-        CheckBlockIndex();
+        if (nAdded > 0)
+            UpdateBlockAvailability(pfrom->GetId(), hashLast);
+        if (fFromSyncPeer)
+            fHeaderSyncMore = nAdded > 0 && (nCount == MAX_HEADERS_RESULTS || nFirst + nAdded < nCount);
+
+        LogPrint("net", "received %u headers, scheduled up to height %d peer=%d\n", nCount, nHeaderChainStart + (int)dequeHeaderChain.size() - 1, pfrom->id);
     }
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
         vRecv >> block;
-        uint256 hashBlock = block.GetHash();
-        CInv inv(MSG_BLOCK, hashBlock);
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
-
-        //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
-        if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
-                //we already asked for this block, so lets work backwards and ask for the previous block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
-                pfrom->vBlockRequested.push_back(block.hashPrevBlock);
-            } else {
-                //ask to sync to this block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
-                pfrom->vBlockRequested.push_back(hashBlock);
+        LogPrint("net", "received block %s peer=%d\n", block.GetHash().ToString(), pfrom->id);
+        ProcessReceivedBlock(pfrom, block);
+    }
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
+    }
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        const uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("cmpctblock", "received cmpctblock %s with %u txn peer=%d\n", hash.ToString(), cmpctblock.BlockTxCount(), pfrom->id);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+            if (mapBlockIndex.count(hash))
+                return true;
+
+            BlockMap::iterator mi = mapBlockIndex.find(cmpctblock.header.hashPrevBlock);
+            if (mi == mapBlockIndex.end()) {
+                // Doesn't connect, fetch the blocks in between like for a block announcement
+                if (!IsInitialBlockDownload()) {
+                    pfrom->PushMessage("getblocks", chainActive.GetLocator(), hash);
+                    pfrom->vBlockRequested.push_back(hash);
+                }
+                return true;
             }
-        } else {
-            pfrom->AddInventoryKnown(inv);
 
+            // Proof-of-stake headers can only be checked once the block is complete.
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            if (!CheckBlockHeader(cmpctblock.header, state, mi->second->nHeight + 1 <= Params().LAST_POW_BLOCK())) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid cmpctblock header received %s", hash.ToString());
+            }
+
+            // Reconstruct blocks we asked this peer for, and those announced by peers we asked to
+            // announce with cmpctblock, up to the per-peer limit of blocks in flight. The header of
+            // a made-up block can't be rejected before the block is complete.
+            std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+            const bool fRequested = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId();
+            const bool fAnnouncer = std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), pfrom->GetId()) != lNodesAnnouncingHeaderAndIDs.end();
+            std::shared_ptr<PartiallyDownloadedBlock> partialBlock;
+            bool fInFlight = true;
+            if (fRequested || (itInFlight == mapBlocksInFlight.end() && fAnnouncer &&
+                                  State(pfrom->GetId())->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER)) {
+                if (fRequested && itInFlight->second.second->partialBlock)
+                    return true; // We are already reconstructing this one from an earlier cmpctblock
+                partialBlock = MarkBlockAsInFlight(pfrom->GetId(), hash, NULL, true)->partialBlock;
+            } else {
+                // Another peer is already sending this block, or we didn't ask for it. Use it only
+                // if the mempool has everything, as we won't ask for the missing transactions.
+                partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                fInFlight = false;
+            }
+
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                if (fInFlight)
+                    MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us an invalid compact block", pfrom->id);
+            }
+
+            BlockTransactionsRequest req;
+            if (status == READ_STATUS_OK) {
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                    if (!partialBlock->IsTxAvailable(i))
+                        req.indexes.push_back(i);
                 }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+                if (req.indexes.empty())
+                    status = partialBlock->FillBlock(block, std::vector<CTransaction>());
+            }
+
+            if (fInFlight) {
+                if (status == READ_STATUS_FAILED) {
+                    // Duplicate short ids or a mismatched merkle root, fall back to the full block
+                    mapBlocksInFlight[hash].second->partialBlock.reset();
+                    std::vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                } else if (!req.indexes.empty()) {
+                    req.blockhash = hash;
+                    LogPrint("cmpctblock", "requesting %u missing txn of block %s peer=%d\n", req.indexes.size(), hash.ToString(), pfrom->id);
+                    pfrom->PushMessage("getblocktxn", req);
+                } else {
+                    MarkBlockAsReceived(hash);
+                    fBlockReconstructed = true;
+                }
+            } else
+                fBlockReconstructed = status == READ_STATUS_OK && req.indexes.empty();
+        }
+
+        if (fBlockReconstructed)
+            ProcessReceivedBlock(pfrom, block);
+    }
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // An old block is better served in full than by reading it from disk for every
+            // small getblocktxn a peer may send, as the peer then has to receive all of it.
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        bool fBlockRead = false;
+        {
+            LOCK(cs_main);
+
+            std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+            if (itInFlight == mapBlocksInFlight.end() || !itInFlight->second.second->partialBlock ||
+                itInFlight->second.first != pfrom->GetId()) {
+                LogPrint("net", "peer=%d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            ReadStatus status = itInFlight->second.second->partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us invalid compact block/non-matching block transactions", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now
+                itInFlight->second.second->partialBlock.reset();
+                std::vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
             } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                MarkBlockAsReceived(resp.blockhash);
+                fBlockRead = true;
             }
         }
+
+        if (fBlockRead)
+            ProcessReceivedBlock(pfrom, block);
     }
 
 
@@ -5524,8 +6581,12 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
+    if (!pfrom->vRecvGetData.empty()) {
+        TRY_LOCK(cs_msgCore, lockCore);
+        if (!lockCore)
+            return fOk;
         ProcessGetData(pfrom);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -5548,6 +6609,12 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // wait for the lane of the message, keeping the peer's messages in order
+        CCriticalSection* pcsLane = GetMessageLane(msg.hdr.GetCommand());
+        CCriticalBlock lockLane(pcsLane, "message lane", __FILE__, __LINE__, true);
+        if (pcsLane && !lockLane)
+            break;
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -5571,7 +6638,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        const uint256& hash = msg.GetMessageHash();
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum) {
@@ -5582,6 +6649,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
         try {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
             boost::this_thread::interruption_point();
@@ -5603,6 +6671,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->RecordMsgRecv(strCommand, nMessageSize + CMessageHeader::HEADER_SIZE, GetTimeMicros() - nProcessStart);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -5654,6 +6723,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
+        // Relayed addresses and inventory are also filled by core lane messages
+        TRY_LOCK(cs_msgCore, lockCore);
+        if (!lockCore)
+            return true;
+
         TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
         if (!lockMain)
             return true;
@@ -5724,10 +6798,39 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (Params().HeadersFirstSyncingActive() && nodeHeaderSync == -1 && !state.fNoHeaders) {
+                    // The getheaders request is sent below
+                    nodeHeaderSync = pto->GetId();
+                    fHeaderSyncMore = true;
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
+            }
+        }
+
+        // Keep the headers-first download schedule ahead of the active chain
+        if (Params().HeadersFirstSyncingActive() && !fReindex && !pto->fClient) {
+            if (nodeHeaderSync == -1 && fFetch && !state.fNoHeaders) {
+                nodeHeaderSync = pto->GetId();
+                fHeaderSyncMore = true;
+            }
+            if (nodeHeaderSync == pto->GetId()) {
+                if (nHeaderSyncRequestTime && nHeaderSyncRequestTime < GetTime() - HEADERS_RESPONSE_TIMEOUT) {
+                    LogPrint("net", "peer=%d did not answer getheaders, trying another peer\n", pto->id);
+                    state.fNoHeaders = true;
+                    nodeHeaderSync = -1;
+                    nHeaderSyncRequestTime = 0;
+                } else if (!nHeaderSyncRequestTime && fHeaderSyncMore) {
+                    TrimHeaderChain();
+                    if (dequeHeaderChain.size() + MAX_HEADERS_RESULTS <= MAX_HEADERS_SYNC_AHEAD) {
+                        CBlockLocator locator = chainActive.GetLocator();
+                        if (!dequeHeaderChain.empty())
+                            locator.vHave.insert(locator.vHave.begin(), dequeHeaderChain.back());
+                        LogPrint("net", "getheaders (%d) to peer=%d (startheight:%d)\n", nHeaderChainStart + (int)dequeHeaderChain.size() - 1, pto->id, pto->nStartingHeight);
+                        pto->PushMessage("getheaders", locator, uint256(0));
+                        nHeaderSyncRequestTime = GetTime();
+                    }
+                }
             }
         }
 
@@ -5796,8 +6899,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // being saturated. We only count validated in-flight blocks so peers can't advertise nonexisting block hashes
         // to unreasonably increase our timeout.
         if (!pto->fDisconnect && state.vBlocksInFlight.size() > 0 && state.vBlocksInFlight.front().nTime < nNow - 500000 * Params().TargetSpacing() * (4 + state.vBlocksInFlight.front().nValidatedQueuedBefore)) {
-            LogPrintf("Timeout downloading block %s from peer=%d, disconnecting\n", state.vBlocksInFlight.front().hash.ToString(), pto->id);
-            pto->fDisconnect = true;
+            const uint256 hash = state.vBlocksInFlight.front().hash;
+            if (state.vBlocksInFlight.front().pindex == NULL && mapHeaderChainHeight.count(hash)) {
+                // This peer never announced the scheduled hash; ask someone else.
+                LogPrint("net", "Timeout downloading scheduled block %s from peer=%d\n", hash.ToString(), pto->id);
+                MarkBlockAsReceived(hash);
+                ScheduledBlockMissed(hash);
+            } else {
+                LogPrintf("Timeout downloading block %s from peer=%d, disconnecting\n", hash.ToString(), pto->id);
+                pto->fDisconnect = true;
+            }
         }
 
         //
@@ -5814,6 +6925,19 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 LogPrintf("Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
+            if (Params().HeadersFirstSyncingActive() && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                // Fill the remaining slots from the header schedule, up to what this peer claims to have.
+                int nPeerHeight = std::max(pto->nStartingHeight, state.pindexBestKnownBlock ? state.pindexBestKnownBlock->nHeight : -1);
+                if (pto->GetId() == nodeHeaderSync)
+                    nPeerHeight = std::numeric_limits<int>::max();
+                std::vector<uint256> vScheduled;
+                FindNextScheduledBlocks(pto->GetId(), nPeerHeight, MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vScheduled, staller);
+                for (const uint256& hash : vScheduled) {
+                    vGetData.push_back(CInv(MSG_BLOCK, hash));
+                    MarkBlockAsInFlight(pto->GetId(), hash);
+                    LogPrint("net", "Requesting scheduled block %s (%d) peer=%d\n", hash.ToString(), mapHeaderChainHeight[hash], pto->id);
+                }
+            }
             if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
@@ -5903,6 +7027,111 @@ std::string CBlockFileInfo::ToString() const
     return strprintf("CBlockFileInfo(blocks=%u, size=%u, heights=%u...%u, time=%s...%s)", nBlocks, nSize, nHeightFirst, nHeightLast, DateTimeStrFormat("%Y-%m-%d", nTimeFirst), DateTimeStrFormat("%Y-%m-%d", nTimeLast));
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t count = 0;
+    int64_t skipped = 0;
+    int64_t failed = 0;
+    int64_t nNow = GetTime();
+
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION)
+            return false;
+
+        // The deltas go first, so prioritised transactions are judged with
+        // their modified fee when they are accepted again
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (const auto& i : mapDeltas)
+            mempool.PrioritiseTransaction(i.first, i.first.ToString(), i.second.first, i.second.second);
+
+        uint64_t num;
+        file >> num;
+        while (num--) {
+            CTransaction tx;
+            int64_t nTime;
+            file >> tx;
+            file >> nTime;
+
+            if (nTime + nExpiryTimeout > nNow) {
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime))
+                    ++count;
+                else
+                    ++failed;
+            } else {
+                ++skipped;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", count, failed, skipped);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t start = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransaction, int64_t> > vTx;
+
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vTx.reserve(mempool.mapTx.size());
+        for (const CTxMemPoolEntry& e : mempool.mapTx)
+            vTx.push_back(std::make_pair(e.GetTx(), e.GetTime()));
+    }
+
+    int64_t mid = GetTimeMicros();
+
+    try {
+        FILE* filestr = fopen((GetDataDir() / "mempool.dat.new").string().c_str(), "wb");
+        if (!filestr)
+            return false;
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        uint64_t version = MEMPOOL_DUMP_VERSION;
+        file << version;
+        file << mapDeltas;
+
+        file << (uint64_t)vTx.size();
+        for (const auto& i : vTx) {
+            file << i.first;
+            file << i.second;
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
+        int64_t last = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (mid - start) * 0.000001, (last - mid) * 0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
 
 class CMainCleanup
 {
@@ -5917,7 +7146,6 @@ public:
         mapBlockIndex.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanage.Clear();
     }
 } instance_of_cmaincleanup;
@@ -30,6 +30,7 @@
 #include "undo.h"
 
 #include <algorithm>
+#include <atomic>
 #include <exception>
 #include <map>
 #include <set>
@@ -43,6 +44,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewDB;
 class CZerocoinDB;
 class CSporkDB;
 class CBloomFilter;
@@ -50,6 +52,7 @@ class CInv;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
+class CTxOrphanage;
 
 struct CBlockTemplate;
 struct CNodeStateStats;
@@ -74,12 +77,28 @@ static const unsigned int MAX_TX_SIGOPS_CURRENT = MAX_BLOCK_SIGOPS_CURRENT / 5;
 static const unsigned int MAX_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Number of finalized blk?????.dat files kept memory mapped for block reads (none on 32-bit, to spare address space) */
+static const unsigned int MAX_MAPPED_BLOCKFILES = sizeof(void*) >= 8 ? 8 : 0;
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
@@ -96,6 +115,23 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum number of headers kept in the headers-first download schedule ahead of the active tip. */
+static const unsigned int MAX_HEADERS_SYNC_AHEAD = 10 * MAX_HEADERS_RESULTS;
+/** Size in bytes of out-of-order blocks buffered before the download window shrinks. */
+static const size_t MAX_PENDING_BLOCKS_SIZE = 32 * 1000 * 1000;
+/** Size in bytes of out-of-order blocks buffered from a single peer. */
+static const size_t MAX_PENDING_BLOCKS_SIZE_PER_PEER = 8 * 1000 * 1000;
+/** Number of peers that must time out on a scheduled block before the peer that listed it is punished. */
+static const int MAX_SCHEDULED_BLOCK_MISSES = 3;
+/** Timeout in seconds for the headers sync peer to answer a getheaders request. */
+static const int64_t HEADERS_RESPONSE_TIMEOUT = 2 * 60;
+/** Maximum depth of blocks we're willing to serve as compact blocks to peers
+ *  when requested. For older blocks, a regular block response will be sent. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of blocks we're willing to respond to getblocktxn requests for. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers asked to announce new blocks with cmpctblock messages right away (high-bandwidth mode). */
+static const unsigned int MAX_CMPCTBLOCK_HB_PEERS = 3;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -107,6 +143,8 @@ static const bool DEFAULT_PEERBLOOMFILTERS_ZC = false;
 
 /** If the tip is older than this (in seconds), the node is considered to be in initial block download. */
 static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
+/** Maximum age of our tip in seconds for us to be considered current for fee estimation */
+static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 3 * 60 * 60;
 
 /** Default for -blockspamfilter, use header spam filter */
 static const bool DEFAULT_BLOCK_SPAM_FILTER = true;
@@ -138,6 +176,7 @@ struct BlockHasher {
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
+extern CTxOrphanage orphanage;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
@@ -146,10 +185,23 @@ extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern CWaitableCriticalSection csBestBlock;
 extern CConditionVariable cvBlockChange;
+/** -assumevalid only skips blocks this many seconds older than the best header */
+static const int64_t ASSUMEVALID_MIN_AGE = 2 * 7 * 24 * 60 * 60;
 extern bool fImporting;
+extern std::atomic<bool> fMempoolLoaded;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+/** Block whose ancestors are assumed to have valid scripts (-assumevalid), zero to verify all */
+extern uint256 hashAssumeValid;
+/** Scripts are only skipped under -assumevalid while the best header has this much work (-minimumchainwork) */
+extern uint256 nMinimumChainWork;
 extern bool fTxIndex;
+/** True if any block files have ever been pruned. */
+extern bool fHavePruned;
+/** True if we're running in -prune mode. */
+extern bool fPruneMode;
+/** Number of MiB of block files that we're trying to stay below. */
+extern uint64_t nPruneTarget;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern unsigned int nCoinCacheSize;
@@ -174,6 +226,13 @@ extern CBlockIndex* pindexBestHeader;
 /** Minimum disk space required - used in CheckDiskSpace() */
 static const uint64_t nMinDiskSpace = 52428800;
 
+/** Block files containing a block-height within MIN_BLOCKS_TO_KEEP of chainActive.Tip() will not be pruned. */
+static const signed int MIN_BLOCKS_TO_KEEP = 288;
+/** Require that user allocate at least 550MiB for block & undo files (blk???.dat and rev???.dat).
+ *  At 1MB per block, 288 blocks = 288MB. Add 15% for undo data = 331MB, add 20% for orphan
+ *  block rate = 397MB, plus a margin for the block file currently being written. */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
+
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
 /** Unregister a network node */
@@ -211,6 +270,8 @@ void UnloadBlockIndex();
 int ActiveProtocol();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** The lane a message is processed on, or NULL if processing it only touches the peer */
+CCriticalSection* GetMessageLane(const std::string& strCommand);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -220,6 +281,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the block input prefetching thread */
+void ThreadCoinPrefetch();
 
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
@@ -245,11 +308,31 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats);
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Prune block files and flush state to disk. */
+void PruneAndFlush();
+/** Calculate the amount of disk space the block & undo files currently use */
+uint64_t CalculateCurrentUsage();
+/** Mark one block file as pruned: clear the data and undo flags of its blocks and reset its file info. */
+void PruneOneBlockFile(const int fileNumber);
+/** Actually unlink the specified files */
+void UnlinkPrunedFiles(std::set<int>& setFilesToPrune);
+
 
+/** Expire old transactions from the memory pool and trim it to at most limit bytes of memory */
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age);
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
 
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee = false, bool ignoreFees = false);
+
+/** Dump the mempool to disk. */
+bool DumpMempool();
+
+/** Load the mempool from disk. */
+bool LoadMempool();
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
 int GetInputAge(CTxIn& vin);
@@ -338,6 +421,14 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
  */
 bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks = NULL);
 
+/** Script verification flags ConnectBlock enforces for a block on top of pindexPrev */
+unsigned int GetBlockScriptFlags(const CBlockIndex* pindexPrev);
+
+/** Salt and size the script execution cache consulted by CheckInputs. Call once at startup. */
+void InitScriptExecutionCache();
+/** Return the counters of the script execution cache */
+void GetScriptExecutionCacheStats(CSignatureCacheStats& stats);
+
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
 
@@ -408,10 +499,17 @@ private:
 
 public:
     CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) : scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-                                                                                                                                ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-
-    bool operator()();
+    CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) : scriptPubKey(scriptPubKeyIn),
+                                                                                                                                        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
+
+    /**
+     * Run the script. With a batch, a pay-to-pubkey(-hash) output spent by a
+     * push-only scriptSig has its signature added to the batch and assumed
+     * valid (see CachingTransactionSignatureChecker). Its only signature check
+     * then decides the result, so the script is valid exactly when the batch
+     * accepts that signature. Other scripts are run right away.
+     */
+    bool operator()(CSignatureBatch* pbatch = NULL);
 
     void swap(CScriptCheck& check)
     {
@@ -427,6 +525,13 @@ public:
 };
 
 
+/**
+ * Run a script check queue worker's checks, verifying the deferred signatures
+ * as one batch. Returns whether all checks passed.
+ */
+bool RunChecks(std::vector<CScriptCheck>& vChecks);
+
+
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
@@ -619,6 +724,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** Global variable that points to the coins database backing pcoinsTip (protected by cs_main) */
+extern CCoinsViewDB* pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
@@ -632,6 +740,8 @@ struct CBlockTemplate {
     CBlock block;
     std::vector<CAmount> vTxFees;
     std::vector<int64_t> vTxSigOps;
+    int64_t nSelectionTime; //! Microseconds spent selecting transactions
+    int64_t nValidityTime;  //! ... and checking the resulting block
 };
 
 #endif // ALQO_MAIN_H
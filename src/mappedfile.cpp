@@ -0,0 +1,48 @@
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool CMappedFile::Open(const boost::filesystem::path& path)
+{
+    Close();
+#ifdef WIN32
+    // Not implemented; callers fall back to regular file reads.
+    return false;
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    pbegin = static_cast<const char*>(p);
+    nSize = st.st_size;
+    return true;
+#endif
+}
+
+void CMappedFile::Close()
+{
+#ifndef WIN32
+    if (pbegin)
+        munmap(const_cast<char*>(pbegin), nSize);
+#endif
+    pbegin = NULL;
+    nSize = 0;
+}
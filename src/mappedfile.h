@@ -0,0 +1,39 @@
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ALQO_MAPPEDFILE_H
+#define ALQO_MAPPEDFILE_H
+
+#include <stddef.h>
+
+#include <boost/filesystem/path.hpp>
+
+/**
+ * Read-only memory mapping of a whole file. The file must not be modified or
+ * truncated while it is mapped; this is meant for files that are never written
+ * to again, such as finalized block files.
+ */
+class CMappedFile
+{
+private:
+    const char* pbegin;
+    size_t nSize;
+
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    CMappedFile() : pbegin(NULL), nSize(0) {}
+    ~CMappedFile() { Close(); }
+
+    //! Map the given file, returns false if it could not be mapped
+    bool Open(const boost::filesystem::path& path);
+    void Close();
+
+    bool IsNull() const { return pbegin == NULL; }
+    const char* data() const { return pbegin; }
+    size_t size() const { return nSize; }
+};
+
+#endif // ALQO_MAPPEDFILE_H
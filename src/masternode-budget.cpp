@@ -191,7 +191,12 @@ void CBudgetManager::SubmitFinalBudget()
     }
 
     CFinalizedBudgetBroadcast tempBudget(strBudgetName, nBlockStart, vecTxBudgetPayments, 0);
-    if (mapSeenFinalizedBudgets.count(tempBudget.GetHash())) {
+    bool fSeen;
+    {
+        LOCK(cs);
+        fSeen = mapSeenFinalizedBudgets.count(tempBudget.GetHash());
+    }
+    if (fSeen) {
         LogPrint("mnbudget","CBudgetManager::SubmitFinalBudget - Budget already exists - %s\n", tempBudget.GetHash().ToString());
         nSubmittedHeight = nCurrentHeight;
         return; //already exists
@@ -1088,7 +1093,12 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         CBudgetProposalBroadcast budgetProposalBroadcast;
         vRecv >> budgetProposalBroadcast;
 
-        if (mapSeenMasternodeBudgetProposals.count(budgetProposalBroadcast.GetHash())) {
+        bool fSeen;
+        {
+            LOCK(cs);
+            fSeen = mapSeenMasternodeBudgetProposals.count(budgetProposalBroadcast.GetHash());
+        }
+        if (fSeen) {
             masternodeSync.AddedBudgetItem(budgetProposalBroadcast.GetHash());
             return;
         }
@@ -1101,7 +1111,10 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             return;
         }
 
-        mapSeenMasternodeBudgetProposals.insert(std::make_pair(budgetProposalBroadcast.GetHash(), budgetProposalBroadcast));
+        {
+            LOCK(cs);
+            mapSeenMasternodeBudgetProposals.insert(std::make_pair(budgetProposalBroadcast.GetHash(), budgetProposalBroadcast));
+        }
 
         if (!budgetProposalBroadcast.IsValid(strError)) {
             LogPrint("mnbudget","mprop - invalid budget proposal - %s\n", strError);
@@ -1125,7 +1138,12 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         vRecv >> vote;
         vote.fValid = true;
 
-        if (mapSeenMasternodeBudgetVotes.count(vote.GetHash())) {
+        bool fSeen;
+        {
+            LOCK(cs);
+            fSeen = mapSeenMasternodeBudgetVotes.count(vote.GetHash());
+        }
+        if (fSeen) {
             masternodeSync.AddedBudgetItem(vote.GetHash());
             return;
         }
@@ -1138,7 +1156,10 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         }
 
 
-        mapSeenMasternodeBudgetVotes.insert(std::make_pair(vote.GetHash(), vote));
+        {
+            LOCK(cs);
+            mapSeenMasternodeBudgetVotes.insert(std::make_pair(vote.GetHash(), vote));
+        }
         if (!vote.CheckSignature(true)) {
             if (masternodeSync.IsSynced()) {
                 LogPrintf("CBudgetManager::ProcessMessage() : mvote - signature invalid\n");
@@ -1162,7 +1183,12 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         CFinalizedBudgetBroadcast finalizedBudgetBroadcast;
         vRecv >> finalizedBudgetBroadcast;
 
-        if (mapSeenFinalizedBudgets.count(finalizedBudgetBroadcast.GetHash())) {
+        bool fSeen;
+        {
+            LOCK(cs);
+            fSeen = mapSeenFinalizedBudgets.count(finalizedBudgetBroadcast.GetHash());
+        }
+        if (fSeen) {
             masternodeSync.AddedBudgetItem(finalizedBudgetBroadcast.GetHash());
             return;
         }
@@ -1176,7 +1202,10 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             return;
         }
 
-        mapSeenFinalizedBudgets.insert(std::make_pair(finalizedBudgetBroadcast.GetHash(), finalizedBudgetBroadcast));
+        {
+            LOCK(cs);
+            mapSeenFinalizedBudgets.insert(std::make_pair(finalizedBudgetBroadcast.GetHash(), finalizedBudgetBroadcast));
+        }
 
         if (!finalizedBudgetBroadcast.IsValid(strError)) {
             LogPrint("mnbudget","fbs - invalid finalized budget - %s\n", strError);
@@ -1200,7 +1229,12 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         vRecv >> vote;
         vote.fValid = true;
 
-        if (mapSeenFinalizedBudgetVotes.count(vote.GetHash())) {
+        bool fSeen;
+        {
+            LOCK(cs);
+            fSeen = mapSeenFinalizedBudgetVotes.count(vote.GetHash());
+        }
+        if (fSeen) {
             masternodeSync.AddedBudgetItem(vote.GetHash());
             return;
         }
@@ -1212,7 +1246,10 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             return;
         }
 
-        mapSeenFinalizedBudgetVotes.insert(std::make_pair(vote.GetHash(), vote));
+        {
+            LOCK(cs);
+            mapSeenFinalizedBudgetVotes.insert(std::make_pair(vote.GetHash(), vote));
+        }
         if (!vote.CheckSignature(true)) {
             if (masternodeSync.IsSynced()) {
                 LogPrintf("CBudgetManager::ProcessMessage() : fbvote - signature from masternode %s invalid\n", HexStr(pmn->pubKeyMasternode));
@@ -2213,7 +2250,10 @@ void CFinalizedBudget::SubmitVote()
     if (budget.UpdateFinalizedBudget(vote, NULL, strError)) {
         LogPrint("mnbudget","CFinalizedBudget::SubmitVote  - new finalized budget vote - %s\n", vote.GetHash().ToString());
 
-        budget.mapSeenFinalizedBudgetVotes.insert(std::make_pair(vote.GetHash(), vote));
+        {
+            LOCK(budget.cs);
+            budget.mapSeenFinalizedBudgetVotes.insert(std::make_pair(vote.GetHash(), vote));
+        }
         vote.Relay();
     } else {
         LogPrint("mnbudget","CFinalizedBudget::SubmitVote : Error submitting vote - %s\n", strError);
@@ -204,6 +204,7 @@ public:
 
     void ClearSeen()
     {
+        LOCK(cs);
         mapSeenMasternodeBudgetProposals.clear();
         mapSeenMasternodeBudgetVotes.clear();
         mapSeenFinalizedBudgets.clear();
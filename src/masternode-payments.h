@@ -251,6 +251,22 @@ public:
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
+
+    bool HasPayeeVote(const uint256& hash)
+    {
+        LOCK(cs_mapMasternodePayeeVotes);
+        return mapMasternodePayeeVotes.count(hash);
+    }
+
+    bool GetPayeeVote(const uint256& hash, CMasternodePaymentWinner& winnerRet)
+    {
+        LOCK(cs_mapMasternodePayeeVotes);
+        std::map<uint256, CMasternodePaymentWinner>::const_iterator it = mapMasternodePayeeVotes.find(hash);
+        if (it == mapMasternodePayeeVotes.end())
+            return false;
+        winnerRet = it->second;
+        return true;
+    }
     bool ProcessBlock(int nBlockHeight);
 
     void Sync(CNode* node, int nCountNeeded);
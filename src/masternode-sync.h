@@ -29,36 +29,39 @@ extern CMasternodeSync masternodeSync;
 class CMasternodeSync
 {
 public:
+    // critical section to protect the seen maps, never held while calling out
+    mutable CCriticalSection cs;
+
     std::map<uint256, int> mapSeenSyncMNB;
     std::map<uint256, int> mapSeenSyncMNW;
     std::map<uint256, int> mapSeenSyncBudget;
 
-    int64_t lastMasternodeList;
-    int64_t lastMasternodeWinner;
-    int64_t lastBudgetItem;
-    int64_t lastFailure;
-    int nCountFailures;
+    std::atomic<int64_t> lastMasternodeList;
+    std::atomic<int64_t> lastMasternodeWinner;
+    std::atomic<int64_t> lastBudgetItem;
+    std::atomic<int64_t> lastFailure;
+    std::atomic<int> nCountFailures;
 
     std::atomic<int64_t> lastProcess;
     std::atomic<bool> fBlockchainSynced;
 
     // sum of all counts
-    int sumMasternodeList;
-    int sumMasternodeWinner;
-    int sumBudgetItemProp;
-    int sumBudgetItemFin;
+    std::atomic<int> sumMasternodeList;
+    std::atomic<int> sumMasternodeWinner;
+    std::atomic<int> sumBudgetItemProp;
+    std::atomic<int> sumBudgetItemFin;
     // peers that reported counts
-    int countMasternodeList;
-    int countMasternodeWinner;
-    int countBudgetItemProp;
-    int countBudgetItemFin;
+    std::atomic<int> countMasternodeList;
+    std::atomic<int> countMasternodeWinner;
+    std::atomic<int> countBudgetItemProp;
+    std::atomic<int> countBudgetItemFin;
 
     // Count peers we've requested the list from
-    int RequestedMasternodeAssets;
-    int RequestedMasternodeAttempt;
+    std::atomic<int> RequestedMasternodeAssets;
+    std::atomic<int> RequestedMasternodeAttempt;
 
     // Time when current masternode asset sync started
-    int64_t nAssetSyncStarted;
+    std::atomic<int64_t> nAssetSyncStarted;
 
     CMasternodeSync();
 
@@ -144,6 +144,7 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
         int nDoS = 0;
         if (mnb.lastPing == CMasternodePing() || (mnb.lastPing != CMasternodePing() && mnb.lastPing.CheckAndUpdate(nDoS, false))) {
             lastPing = mnb.lastPing;
+            LOCK(mnodeman.cs);
             mnodeman.mapSeenMasternodePing.insert(std::make_pair(lastPing.GetHash(), lastPing));
         }
         return true;
@@ -623,8 +624,14 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
         TRY_LOCK(cs_main, lockMain);
         if (!lockMain) {
             // not mnb fault, let it to be checked again later
-            mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
-            masternodeSync.mapSeenSyncMNB.erase(GetHash());
+            {
+                LOCK(mnodeman.cs);
+                mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
+            }
+            {
+                LOCK(masternodeSync.cs);
+                masternodeSync.mapSeenSyncMNB.erase(GetHash());
+            }
             return false;
         }
 
@@ -640,8 +647,14 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
     if (GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) {
         LogPrint("masternode","mnb - Input must have at least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
         // maybe we miss few blocks, let this mnb to be checked again later
-        mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
-        masternodeSync.mapSeenSyncMNB.erase(GetHash());
+        {
+            LOCK(mnodeman.cs);
+            mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
+        }
+        {
+            LOCK(masternodeSync.cs);
+            masternodeSync.mapSeenSyncMNB.erase(GetHash());
+        }
         return false;
     }
 
@@ -790,8 +803,11 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled, bool fChec
             //mnodeman.mapSeenMasternodeBroadcast.lastPing is probably outdated, so we'll update it
             CMasternodeBroadcast mnb(*pmn);
             uint256 hash = mnb.GetHash();
-            if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
-                mnodeman.mapSeenMasternodeBroadcast[hash].lastPing = *this;
+            {
+                LOCK(mnodeman.cs);
+                if (mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
+                    mnodeman.mapSeenMasternodeBroadcast[hash].lastPing = *this;
+                }
             }
 
             pmn->Check(true);
@@ -50,9 +50,6 @@ public:
 class CMasternodeMan
 {
 private:
-    // critical section to protect the inner data structures
-    mutable CCriticalSection cs;
-
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
@@ -66,6 +63,9 @@ private:
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
 public:
+    // critical section to protect the inner data structures, including the seen maps below
+    mutable CCriticalSection cs;
+
     // Keep track of all broadcasts I've seen
     std::map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
     // Keep track of all pings I've seen
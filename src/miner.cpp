@@ -27,8 +27,8 @@
 #include "spork.h"
 
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -36,53 +36,470 @@
 // ALQOMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
 //
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// Block assembly takes mempool transactions as whole "packages": a
+// transaction together with its unconfirmed ancestors, which have to be in
+// the block before it. The mempool keeps its entries sorted by ancestor
+// feerate, so the best package is always at the front of that index and
+// the walk over it stops about as soon as the block is full.
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    std::set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+// Once part of a package is in the block, the rest of it is worth more
+// (or less) than the mempool's statistics say. Those descendants are
+// tracked here, with their ancestor statistics adjusted for what is already
+// in the block, in a separate set with the same ordering.
+//
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    const CTransaction& GetTx() const { return iter->GetTx(); }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
+
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
     {
+        return entry.iter;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CTxMemPool::CompareIteratorByHash>,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareTxMemPoolEntryByAncestorFee> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+    }
+
+private:
+    CTxMemPool::txiter iter;
+};
+
+// Ancestors first: a package sorted this way can be added in order
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
 // We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByAncestorFee()(*b.second, *a.second); // Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
+
+/** Fills a block template with mempool transactions. Requires cs_main and mempool.cs. */
+class BlockAssembler
 {
-    bool byFee;
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+    const int nHeight;
+    const unsigned int nScriptFlags; //! The script flags the block will be checked with
+    CCoinsViewCache view;
+
+    // Configuration parameters for the block size
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    bool fPrintPriority;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+    CTxMemPool::setEntries failedTx;
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+    int nPackagesSelected;
+    int nDescendantsUpdated;
+
+    BlockAssembler(CBlockTemplate* pblocktemplateIn, const CBlockIndex* pindexPrev);
+
+    /** Add transactions by coin age priority, up to -blockprioritysize */
+    void AddPriorityTxs();
+    /** Add transactions by the feerate of their package of unconfirmed ancestors */
+    void AddPackageTxs();
+
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    CAmount GetFees() const { return nFees; }
+
+private:
+    /** Check the package, sorted ancestors first, against the block and
+     *  its inputs, and add it if it fits. An invalid transaction goes into
+     *  failedTx, so nothing that depends on it is tried again. */
+    bool TestAndAddPackage(const std::vector<CTxMemPool::txiter>& vPackage);
+    /** Whether one of the transaction's in-mempool parents isn't in the block yet */
+    bool IsStillDependent(CTxMemPool::txiter iter) const;
+    /** Update the modified ancestor state of the descendants of newly added
+     *  transactions. Returns the number of updated descendants. */
+    int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx);
+    /** Whether the transaction is already dealt with, or has to be looked
+     *  at through mapModifiedTx */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx) const;
+};
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
-    {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+BlockAssembler::BlockAssembler(CBlockTemplate* pblocktemplateIn, const CBlockIndex* pindexPrev) : pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block), nHeight(pindexPrev->nHeight + 1),
+                                                                                                 nScriptFlags(GetBlockScriptFlags(pindexPrev)), view(pcoinsTip)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE_CURRENT;
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    fPrintPriority = GetBoolArg("-printpriority", false);
+
+    // Reserve space for the coinbase (and coinstake) transaction
+    nBlockSize = 1000;
+    nBlockTx = 0;
+    nBlockSigOps = 100;
+    nFees = 0;
+    nPackagesSelected = 0;
+    nDescendantsUpdated = 0;
+}
+
+bool BlockAssembler::TestAndAddPackage(const std::vector<CTxMemPool::txiter>& vPackage)
+{
+    // Apply the package to a scratch view first, so one that fails part way
+    // leaves nothing behind
+    CCoinsViewCache viewPackage(&view);
+    std::vector<CAmount> vTxFees;
+    std::vector<unsigned int> vTxSigOps;
+    unsigned int nPackageSigOps = 0;
+    for (CTxMemPool::txiter it : vPackage) {
+        const CTransaction& tx = it->GetTx();
+
+        // Mempool entries are valid against the chain tip, but not
+        // necessarily in this block: check what the block needs.
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight) || !viewPackage.HaveInputs(tx)) {
+            failedTx.insert(it);
+            return false;
+        }
+
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nTxSigOps;
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS_CURRENT)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        // Checking with the block's own flags hits the script execution
+        // cache entries ATMP stored for the mempool transactions.
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, nScriptFlags, true)) {
+            failedTx.insert(it);
+            return false;
+        }
+
+        vTxFees.push_back(viewPackage.GetValueIn(tx) - tx.GetValueOut());
+        vTxSigOps.push_back(nTxSigOps);
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+    }
+    viewPackage.Flush();
+
+    for (unsigned int i = 0; i < vPackage.size(); i++) {
+        const CTransaction& tx = vPackage[i]->GetTx();
+        pblock->vtx.push_back(tx);
+        pblocktemplate->vTxFees.push_back(vTxFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vTxSigOps[i]);
+        nBlockSize += vPackage[i]->GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += vTxSigOps[i];
+        nFees += vTxFees[i];
+        inBlock.insert(vPackage[i]);
+
+        if (fPrintPriority) {
+            double dPriority = vPackage[i]->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(tx.GetHash(), dPriority, dummy);
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                dPriority, CFeeRate(vPackage[i]->GetModifiedFee(), vPackage[i]->GetTxSize()).ToString(), tx.GetHash().ToString());
+        }
+    }
+    return true;
+}
+
+bool BlockAssembler::IsStillDependent(CTxMemPool::txiter iter) const
+{
+    for (CTxMemPool::txiter parent : mempool.GetMemPoolParents(iter)) {
+        if (!inBlock.count(parent))
+            return true;
+    }
+    return false;
+}
+
+int BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx)
+{
+    int nDescendantsUpdated = 0;
+    for (const CTxMemPool::txiter it : alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        for (CTxMemPool::txiter desc : descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            ++nDescendantsUpdated;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+    return nDescendantsUpdated;
+}
+
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx) const
+{
+    assert(it != mempool.mapTx.end());
+    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+}
+
+void BlockAssembler::AddPriorityTxs()
+{
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // Coin age priority grows with every block at a different rate for each
+    // transaction, so unlike feerates it can't be kept sorted in the mempool;
+    // use the priority cached in the entries instead of resolving inputs.
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+    double actualPriority = -1;
+
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi) {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        // Transactions too low for the free area are left to the feerate selection
+        if (AllowFree(dPriority))
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    // Prioritise by fee once past the priority size or we run out of
+    // high-priority transactions
+    while (!vecPriority.empty() && nBlockSize < nBlockPrioritySize) {
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        if (inBlock.count(iter) || failedTx.count(iter))
+            continue;
+
+        // Has to wait for its in-mempool parents
+        if (IsStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
+
+        // Size limits
+        if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize)
+            continue;
+
+        if (TestAndAddPackage(std::vector<CTxMemPool::txiter>(1, iter))) {
+            // Add transactions that depend on this one to the priority queue
+            for (CTxMemPool::txiter child : mempool.GetMemPoolChildren(iter)) {
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
+        }
+    }
+}
+
+void BlockAssembler::AddPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    nDescendantsUpdated += UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+
+    // Limit the number of attempts to add transactions to the block when it is
+    // close to full; this is just a simple heuristic to finish quickly if the
+    // mempool has a lot of entries.
+    const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
+    int64_t nConsecutiveFailed = 0;
+
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
+            SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx)) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
         } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareTxMemPoolEntryByAncestorFee()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
+            }
+        }
+
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
         }
+
+        // Skip free transactions if we're past the minimum block size;
+        // everything after this pays even less.
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize)
+            break;
+
+        bool fFits = nBlockSize + packageSize < nBlockMaxSize;
+
+        CTxMemPool::setEntries ancestors;
+        if (fFits) {
+            uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            ancestors.insert(iter);
+            for (CTxMemPool::setEntries::iterator it = ancestors.begin(); it != ancestors.end();) {
+                if (inBlock.count(*it)) {
+                    ancestors.erase(it++);
+                    continue;
+                }
+                // Nothing that depends on an invalid transaction can go in
+                if (failedTx.count(*it))
+                    fFits = false;
+                ++it;
+            }
+        }
+
+        std::vector<CTxMemPool::txiter> sortedEntries;
+        if (fFits) {
+            sortedEntries.assign(ancestors.begin(), ancestors.end());
+            std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
+            fFits = TestAndAddPackage(sortedEntries);
+        }
+
+        if (!fFits) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+
+            ++nConsecutiveFailed;
+            if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 1000) {
+                // Give up if we're close to full and haven't succeeded in a while
+                break;
+            }
+            continue;
+        }
+
+        nConsecutiveFailed = 0;
+        ++nPackagesSelected;
+        for (CTxMemPool::txiter it : sortedEntries)
+            mapModifiedTx.erase(it);
+
+        // Update transactions that depend on each of these
+        nDescendantsUpdated += UpdatePackagesForAdded(ancestors, mapModifiedTx);
     }
-};
+}
 
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
@@ -149,196 +566,24 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         }
     }
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    unsigned int nBlockMaxSizeNetwork = MAX_BLOCK_SIZE_CURRENT;
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((nBlockMaxSizeNetwork - 1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
     CAmount nFees = 0;
 
     {
         LOCK2(cs_main, mempool.cs);
+        int64_t nTimeStart = GetTimeMicros();
 
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        std::list<COrphan> vOrphan; // list memory doesn't move
-        std::map<uint256, std::vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        std::vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (std::map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            for (const CTxIn& txin : tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
 
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
+        BlockAssembler assembler(pblocktemplate.get(), pindexPrev);
+        assembler.AddPriorityTxs();
+        assembler.AddPackageTxs();
+        nFees = assembler.GetFees();
+        uint64_t nBlockTx = assembler.GetBlockTx();
+        uint64_t nBlockSize = assembler.GetBlockSize();
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                for (COrphan* porphan : mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        int64_t nTime1 = GetTimeMicros();
 
         if (!fProofOfStake) {
             //Masternode and general budget payments
@@ -377,6 +622,12 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             LogPrintf("CreateNewBlock() : TestBlockValidity failed\n");
             return NULL;
         }
+        int64_t nTime2 = GetTimeMicros();
+
+        pblocktemplate->nSelectionTime = nTime1 - nTimeStart;
+        pblocktemplate->nValidityTime = nTime2 - nTime1;
+        LogPrint("bench", "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n",
+            0.001 * (nTime1 - nTimeStart), assembler.nPackagesSelected, assembler.nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
     }
 
     return pblocktemplate.release();
@@ -459,6 +710,66 @@ bool fGenerateBitcoins = false;
 bool fMintableCoins = false;
 int nMintableLastCheck = 0;
 
+/**
+ * Wakes the stake minter when what it waits for may have changed: a new tip,
+ * or a wallet transaction or lock state change. Between those the minter
+ * sleeps until the clock reaches the next timestamp it could stake at.
+ */
+class CStakeNotifier : public CValidationInterface
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fNotified;
+    bool fWalletChanged;
+
+public:
+    CStakeNotifier() : fNotified(false), fWalletChanged(false) {}
+
+    void Notify(bool fWallet)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fNotified = true;
+            fWalletChanged |= fWallet;
+        }
+        cond.notify_all();
+    }
+
+    void NotifyWalletTransaction(CWallet* wallet, const uint256& hashTx, ChangeType status) { Notify(true); }
+    void NotifyWalletStatus(CCryptoKeyStore* wallet) { Notify(true); }
+
+    /** Wait for a notification for at most nMillis. Interruptible. */
+    void Wait(int64_t nMillis)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!fNotified && nMillis > 0)
+            cond.timed_wait(lock, boost::posix_time::milliseconds(nMillis));
+        fNotified = false;
+    }
+
+    /** Whether the wallet changed since the last call */
+    bool WalletChanged()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        bool fChanged = fWalletChanged;
+        fWalletChanged = false;
+        return fChanged;
+    }
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindex) override { Notify(false); }
+};
+
+static CStakeNotifier stakeNotifier;
+
+// Milliseconds until the adjusted clock reaches nTime
+static int64_t MillisUntilAdjustedTime(int64_t nTime)
+{
+    int64_t nNowMillis = GetTimeMillis() + (GetAdjustedTime() - GetTime()) * 1000;
+    return nTime * 1000 - nNowMillis;
+}
+
 // ***TODO*** that part changed in alqo, we are using a mix with old one here for now
 
 void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
@@ -470,17 +781,16 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
     // Each thread has its own key and counter
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
-    bool fLastLoopOrphan = false;
     while (fGenerateBitcoins || fProofOfStake) {
         if (fProofOfStake) {
             if (chainActive.Tip()->nHeight < Params().LAST_POW_BLOCK()) {
                 //  The last PoW block hasn't even been mined yet.
-                MilliSleep(Params().TargetSpacing() * 1000);       // sleep a block
+                stakeNotifier.Wait(Params().TargetSpacing() * 1000);       // wait for a block
                 continue;
             }
 
             //control the amount of times the client will check for mintable coins
-            if ((GetTime() - nMintableLastCheck > 5 * 60)) // 5 minute check time
+            if ((GetTime() - nMintableLastCheck > 5 * 60) || stakeNotifier.WalletChanged()) // 5 minute check time
             {
                 nMintableLastCheck = GetTime();
                 fMintableCoins = pwallet->MintableCoins();
@@ -488,27 +798,17 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
             while (vNodes.empty() || pwallet->IsLocked() || !fMintableCoins ||
                    (pwallet->GetBalance() > 0 && nReserveBalance >= pwallet->GetBalance()) || !masternodeSync.IsSynced()) {
                 nLastCoinStakeSearchInterval = 0;
-                MilliSleep(5000);
+                // Peers and masternode sync don't notify, so look again every few seconds
+                stakeNotifier.Wait(5000);
                 // Do a separate 1 minute check here to ensure fMintableCoins is updated
-                if (!fMintableCoins && (GetTime() - nMintableLastCheck > 1 * 60)) // 1 minute check time
+                if (stakeNotifier.WalletChanged() || (!fMintableCoins && (GetTime() - nMintableLastCheck > 1 * 60))) // 1 minute check time
                 {
                     nMintableLastCheck = GetTime();
                     fMintableCoins = pwallet->MintableCoins();
                 }
-                MilliSleep(5000);
                 if (!fGenerateBitcoins && !fProofOfStake)
                     continue;
             }
-            //search our map of hashed blocks, see if bestblock has been hashed yet
-            if (mapHashedBlocks.count(chainActive.Tip()->nHeight) && !fLastLoopOrphan)
-            {
-                // wait half of the nHashDrift with max wait of 3 minutes
-                if (GetTime() - mapHashedBlocks[chainActive.Tip()->nHeight] < std::max(pwallet->nHashInterval, (unsigned int)1))
-                {
-                    MilliSleep(5000);
-                    continue;
-                }
-            }
         } else { // PoW
             if ((chainActive.Tip()->nHeight - 6) > Params().LAST_POW_BLOCK())
             {
@@ -528,8 +828,15 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
             continue;
 
         std::unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake));
-        if (!pblocktemplate.get())
+        if (!pblocktemplate.get()) {
+            if (fProofOfStake) {
+                // Every timestamp up to now has been tried on this tip, the next one to
+                // try is the coming second, and never one at or before the tip's
+                int64_t nTimeNext = std::max(GetAdjustedTime(), pindexPrev->GetBlockTime()) + 1;
+                stakeNotifier.Wait(MillisUntilAdjustedTime(nTimeNext));
+            }
             continue;
+        }
 
         CBlock* pblock = &pblocktemplate->block;
         IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
@@ -544,16 +851,7 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
 
             LogPrintf("CPUMiner : proof-of-stake block was signed %s \n", pblock->GetHash().ToString().c_str());
             SetThreadPriority(THREAD_PRIORITY_NORMAL);
-            bool fSuccess = ProcessBlockFound(pblock, *pwallet, reservekey);
-            if (!fSuccess) {
-                fLastLoopOrphan = true;
-                continue;
-            } else {
-                for (unsigned int i = 0; i < 15; i++) {
-                     MilliSleep(100);
-                     LogPrintf("%d..", i);
-                }
-            }
+            ProcessBlockFound(pblock, *pwallet, reservekey);
             SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
             continue;
@@ -689,6 +987,9 @@ void ThreadStakeMinter()
     boost::this_thread::interruption_point();
     LogPrintf("ThreadStakeMinter started\n");
     CWallet* pwallet = pwalletMain;
+    RegisterValidationInterface(&stakeNotifier);
+    boost::signals2::scoped_connection connTransaction(pwallet->NotifyTransactionChanged.connect(boost::bind(&CStakeNotifier::NotifyWalletTransaction, &stakeNotifier, _1, _2, _3)));
+    boost::signals2::scoped_connection connStatus(pwallet->NotifyStatusChanged.connect(boost::bind(&CStakeNotifier::NotifyWalletStatus, &stakeNotifier, _1)));
     try {
         BitcoinMiner(pwallet, true);
         boost::this_thread::interruption_point();
@@ -697,6 +998,7 @@ void ThreadStakeMinter()
     } catch (...) {
         LogPrintf("ThreadStakeMinter() error \n");
     }
+    UnregisterValidationInterface(&stakeNotifier);
     LogPrintf("ThreadStakeMinter exiting,\n");
 }
 
@@ -24,6 +24,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -33,6 +34,10 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -106,10 +111,71 @@ CCriticalSection cs_nLastNodeId;
 static CSemaphore* semOutbound = NULL;
 boost::condition_variable messageHandlerCondition;
 
+/** Message handler threads, each with its own queue of nodes to serve */
+static std::vector<std::deque<CNode*> > vMessageHandlerQueues;
+/** Nodes whose pending messages are waiting for a busy message lane */
+static std::vector<CNode*> vMessageHandlerDeferred;
+static boost::mutex cs_messageHandler;
+static bool fMessageHandlerWake = false;
+static int64_t nMessageHandlerNextScan = 0;
+static NodeId nMessageHandlerTrickleNode = -1;
+
+static void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(cs_messageHandler);
+        fMessageHandlerWake = true;
+    }
+    messageHandlerCondition.notify_one();
+}
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+#ifdef USE_EPOLL
+/** Most socket events handled per wakeup of the socket handler */
+static const int MAX_EPOLL_EVENTS = 256;
+/** Wait before retrying peers whose buffers another thread held, in milliseconds */
+static const int SOCKET_RETRY_WAIT_MS = 2;
+
+// Nodes with readiness left to consume, only used by the socket handler thread
+static std::set<CNode*> setNodesReady;
+
+static int EpollHandle()
+{
+    static const int hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    return hEpoll;
+}
+
+static bool EpollAdd(SOCKET hSocket, void* ptr, uint32_t nEvents)
+{
+    struct epoll_event event;
+    event.events = nEvents;
+    event.data.ptr = ptr;
+    if (epoll_ctl(EpollHandle(), EPOLL_CTL_ADD, hSocket, &event) == SOCKET_ERROR) {
+        LogPrintf("epoll_ctl failed to add socket: %s\n", NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+    return true;
+}
+#endif
+
+// Hand a connected node to the socket handler
+static void AddConnectedNode(CNode* pnode)
+{
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+#ifdef USE_EPOLL
+    // Edge-triggered: every readiness change is reported once, and the
+    // socket handler keeps track of what it has not consumed yet
+    if (!EpollAdd(pnode->hSocket, pnode, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+        pnode->CloseSocketDisconnect();
+#endif
+}
+
 void AddOneShot(std::string strDest)
 {
     LOCK(cs_vOneShots);
@@ -424,10 +490,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
 
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
+        AddConnectedNode(pnode);
 
         pnode->nTimeConnected = GetTime();
         if (obfuScationMaster) pnode->fObfuScationMaster = true;
@@ -447,6 +510,10 @@ void CNode::CloseSocketDisconnect()
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET) {
         LogPrint("net", "disconnecting peer=%d\n", id);
+#ifdef USE_EPOLL
+        // Unregister explicitly, a forked child may keep the socket itself open
+        epoll_ctl(EpollHandle(), EPOLL_CTL_DEL, hSocket, NULL);
+#endif
         CloseSocket(hSocket);
     }
 
@@ -700,9 +767,93 @@ void CNode::copyStats(CNodeStats& stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_msgStats);
+        stats.mapMsgStats = mapMsgStats;
+    }
 }
 #undef X
 
+/** Message traffic of the peers that disconnected since startup */
+static CCriticalSection cs_msgStatsDisconnected;
+static mapMsgStats_t mapMsgStatsDisconnected;
+
+CNetMsgStats::CNetMsgStats() : nMsgsRecv(0), nBytesRecv(0), nMsgsSent(0), nBytesSent(0), nProcessUsec(0), nMaxProcessUsec(0)
+{
+    for (int i = 0; i < PROCESS_TIME_BUCKETS; i++)
+        vProcessTime[i] = 0;
+}
+
+void CNetMsgStats::RecordRecv(unsigned int nBytes, int64_t nUsec)
+{
+    nMsgsRecv++;
+    nBytesRecv += nBytes;
+    nProcessUsec += nUsec;
+    nMaxProcessUsec = std::max(nMaxProcessUsec, nUsec);
+    // Buckets grow tenfold from 100us
+    int nBucket = 0;
+    for (int64_t nBound = 100; nBucket < PROCESS_TIME_BUCKETS - 1 && nUsec >= nBound; nBound *= 10)
+        nBucket++;
+    vProcessTime[nBucket]++;
+}
+
+void CNetMsgStats::RecordSend(unsigned int nBytes)
+{
+    nMsgsSent++;
+    nBytesSent += nBytes;
+}
+
+CNetMsgStats& CNetMsgStats::operator+=(const CNetMsgStats& other)
+{
+    nMsgsRecv += other.nMsgsRecv;
+    nBytesRecv += other.nBytesRecv;
+    nMsgsSent += other.nMsgsSent;
+    nBytesSent += other.nBytesSent;
+    nProcessUsec += other.nProcessUsec;
+    nMaxProcessUsec = std::max(nMaxProcessUsec, other.nMaxProcessUsec);
+    for (int i = 0; i < PROCESS_TIME_BUCKETS; i++)
+        vProcessTime[i] += other.vProcessTime[i];
+    return *this;
+}
+
+// Peers choose the commands they send, only the ones we know get an entry of their own
+static const std::string& AccountedCommand(const std::string& strCommand)
+{
+    static const std::set<std::string> setKnown(GetAllNetMessageTypes().begin(), GetAllNetMessageTypes().end());
+    static const std::string strOther(NET_MESSAGE_COMMAND_OTHER);
+
+    std::set<std::string>::const_iterator it = setKnown.find(strCommand);
+    return it != setKnown.end() ? *it : strOther;
+}
+
+void CNode::RecordMsgRecv(const std::string& strCommand, unsigned int nBytes, int64_t nProcessUsec)
+{
+    LOCK(cs_msgStats);
+    mapMsgStats[AccountedCommand(strCommand)].RecordRecv(nBytes, nProcessUsec);
+}
+
+void CNode::RecordMsgSend(const std::string& strCommand, unsigned int nBytes)
+{
+    LOCK(cs_msgStats);
+    mapMsgStats[AccountedCommand(strCommand)].RecordSend(nBytes);
+}
+
+void GetNetMsgStats(mapMsgStats_t& mapStats)
+{
+    {
+        LOCK(cs_msgStatsDisconnected);
+        mapStats = mapMsgStatsDisconnected;
+    }
+
+    LOCK(cs_vNodes);
+    for (CNode* pnode : vNodes) {
+        LOCK(pnode->cs_msgStats);
+        for (const std::pair<const std::string, CNetMsgStats>& item : pnode->mapMsgStats)
+            mapStats[item.first] += item.second;
+    }
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 {
@@ -710,7 +861,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+            vRecvMsg.emplace_back(SER_NETWORK, nRecvVersion);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -734,29 +885,95 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            WakeMessageHandler();
         }
     }
 
     return true;
 }
 
+/** Capacities of the pooled receive buffers, a message body gets the smallest that fits it */
+static const size_t RECV_BUFFER_CLASSES[] = {512, 4 * 1024, 32 * 1024, 256 * 1024};
+/** How many buffers of each class are kept for reuse */
+static const size_t MAX_POOLED_RECV_BUFFERS[] = {1024, 256, 32, 8};
+
+static boost::mutex cs_recvBufferPool;
+static std::vector<CSerializeData> vRecvBufferPool[ARRAYLEN(RECV_BUFFER_CLASSES)];
+
+// Give the empty vRecv a buffer with room for nSize bytes, or for the largest class
+static void AcquireReceiveBuffer(CDataStream& vRecv, unsigned int nSize)
+{
+    size_t nClass = 0;
+    while (nClass + 1 < ARRAYLEN(RECV_BUFFER_CLASSES) && RECV_BUFFER_CLASSES[nClass] < nSize)
+        nClass++;
+
+    CSerializeData buf;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_recvBufferPool);
+        if (!vRecvBufferPool[nClass].empty()) {
+            buf.swap(vRecvBufferPool[nClass].back());
+            vRecvBufferPool[nClass].pop_back();
+        }
+    }
+    if (buf.capacity() == 0)
+        buf.reserve(RECV_BUFFER_CLASSES[nClass]);
+    vRecv.SwapAndClear(buf);
+}
+
+// Take vRecv's buffer back into the pool; buffers grown past the largest class are freed
+static void ReleaseReceiveBuffer(CDataStream& vRecv)
+{
+    CSerializeData buf;
+    vRecv.clear();
+    vRecv.SwapAndClear(buf);
+
+    size_t nCapacity = buf.capacity();
+    if (nCapacity < RECV_BUFFER_CLASSES[0] || nCapacity > RECV_BUFFER_CLASSES[ARRAYLEN(RECV_BUFFER_CLASSES) - 1])
+        return;
+    size_t nClass = ARRAYLEN(RECV_BUFFER_CLASSES) - 1;
+    while (RECV_BUFFER_CLASSES[nClass] > nCapacity)
+        nClass--;
+
+    boost::unique_lock<boost::mutex> lock(cs_recvBufferPool);
+    if (vRecvBufferPool[nClass].size() < MAX_POOLED_RECV_BUFFERS[nClass]) {
+        vRecvBufferPool[nClass].push_back(CSerializeData());
+        vRecvBufferPool[nClass].back().swap(buf);
+    }
+}
+
+CNetMessage::~CNetMessage()
+{
+    ReleaseReceiveBuffer(vRecv);
+}
+
+const uint256& CNetMessage::GetMessageHash() const
+{
+    assert(complete());
+    if (data_hash.IsNull())
+        hasher.Finalize(data_hash.begin());
+    return data_hash;
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
-    // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    // A header that arrived in one piece is parsed where it lies, only a split one is gathered first
+    const char* pchHeader = pch;
+    if (nCopy < CMessageHeader::HEADER_SIZE) {
+        memcpy(&pchHdr[nHdrPos], pch, nCopy);
+        pchHeader = pchHdr;
+    }
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
     // deserialize to CMessageHeader
     try {
-        hdrbuf >> hdr;
+        CSpanReader(pchHeader, pchHeader + CMessageHeader::HEADER_SIZE, vRecv.GetType(), vRecv.GetVersion()) >> hdr;
     } catch (const std::exception&) {
         return -1;
     }
@@ -767,6 +984,7 @@ int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
+    AcquireReceiveBuffer(vRecv, hdr.nMessageSize);
 
     return nCopy;
 }
@@ -781,6 +999,7 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
         vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
     }
 
+    hasher.Write((const unsigned char*)pch, nCopy);
     memcpy(&vRecv[nDataPos], pch, nCopy);
     nDataPos += nCopy;
 
@@ -788,25 +1007,110 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 }
 
 
+/** Send buffers kept for reuse, so serializing a message rarely has to grow a fresh buffer */
+static const size_t MAX_POOLED_SEND_BUFFERS = 256;
+/** Larger buffers are freed, a burst of blocks should not stay pinned in the pool */
+static const size_t MAX_POOLED_SEND_BUFFER_CAPACITY = 64 * 1024;
+/** The most queued messages handed to a single sendmsg() call */
+static const int MAX_SEND_IOVECS = 64;
+
+static boost::mutex cs_sendBufferPool;
+static std::vector<CSerializeData*> vSendBufferPool;
+
+static void ReleaseSendBuffer(CSerializeData* pdata)
+{
+    if (pdata->capacity() <= MAX_POOLED_SEND_BUFFER_CAPACITY) {
+        // The contents went out on the wire unencrypted, there is nothing to cleanse before reuse
+        pdata->clear();
+        boost::unique_lock<boost::mutex> lock(cs_sendBufferPool);
+        if (vSendBufferPool.size() < MAX_POOLED_SEND_BUFFERS) {
+            vSendBufferPool.push_back(pdata);
+            return;
+        }
+    }
+    delete pdata;
+}
+
+std::shared_ptr<CSerializeData> AcquireSendBuffer()
+{
+    CSerializeData* pdata = NULL;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_sendBufferPool);
+        if (!vSendBufferPool.empty()) {
+            pdata = vSendBufferPool.back();
+            vSendBufferPool.pop_back();
+        }
+    }
+    if (pdata == NULL)
+        pdata = new CSerializeData();
+    return std::shared_ptr<CSerializeData>(pdata, ReleaseSendBuffer);
+}
+
+// The command of a serialized message, read from its header
+static std::string GetMessageCommand(const char* pchMessage)
+{
+    const char* pchCommand = pchMessage + MESSAGE_START_SIZE;
+    return std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE));
+}
+
+void FinalizeMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedMessageRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData& data = **it;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather as many queued messages as one call takes, straight from their buffers
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSerializedMessageRef>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++itIov, ++nIov) {
+            iov[nIov].iov_base = const_cast<char*>(&(**itIov)[nOffset]);
+            iov[nIov].iov_len = (*itIov)->size() - nOffset;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that went out in full, the shared ones stay alive for the other peers
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nRemaining = (*it)->size() - pnode->nSendOffset;
+                if (nSent < nRemaining) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
+            }
+            if (pnode->nSendOffset != 0) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -833,71 +1137,329 @@ void SocketSendData(CNode* pnode)
 
 static std::list<CNode*> vNodesDisconnected;
 
+static CCriticalSection cs_socketHandlerStats;
+static CSocketHandlerStats socketHandlerStats;
+
+static void RecordSocketHandlerLoop(unsigned int nEvents, int64_t nStartUsec)
+{
+    int64_t nUsec = GetTimeMicros() - nStartUsec;
+    LOCK(cs_socketHandlerStats);
+    socketHandlerStats.nLoops++;
+    socketHandlerStats.nEvents += nEvents;
+    socketHandlerStats.nTotalUsec += nUsec;
+    socketHandlerStats.nMaxUsec = std::max(socketHandlerStats.nMaxUsec, nUsec);
+}
+
+void GetSocketHandlerStats(CSocketHandlerStats& stats)
+{
+    LOCK(cs_socketHandlerStats);
+    stats = socketHandlerStats;
+#ifdef USE_EPOLL
+    stats.strBackend = "epoll";
+#else
+    stats.strBackend = "select";
+#endif
+}
+
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        std::vector<CNode*> vNodesCopy = vNodes;
+        for (CNode* pnode : vNodesCopy) {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+#ifdef USE_EPOLL
+                setNodesReady.erase(pnode);
+#endif
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+    }
+    {
+        // Delete disconnected nodes
+        std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        for (CNode* pnode : vNodesDisconnectedCopy) {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend) {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv) {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
+                        }
+                    }
+                }
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    size_t vNodesSize;
+    {
+        LOCK(cs_vNodes);
+        vNodesSize = vNodes.size();
+    }
+    if(vNodesSize != nPrevNodeCount) {
+        nPrevNodeCount = vNodesSize;
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    } else if (!IsSelectableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        AddConnectedNode(pnode);
+    }
+}
+
+// requires LOCK(cs_vRecvMsg)
+// Returns false once the socket has nothing more to read for now
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    } else if (nBytes < 0) {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        } else if (nErr == WSAEINTR) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
 void ThreadSocketHandler()
 {
+    const int hEpoll = EpollHandle();
+    if (hEpoll == -1) {
+        LogPrintf("ThreadSocketHandler: could not create an epoll instance\n");
+        return;
+    }
+    // Listen sockets stay level-triggered, one connection is accepted per event
+    for (ListenSocket& hListenSocket : vhListenSocket)
+        EpollAdd(hListenSocket.socket, &hListenSocket, EPOLLIN);
+
+    std::vector<struct epoll_event> vEvents(MAX_EPOLL_EVENTS);
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    bool fRetry = false;
     while (true) {
+        DisconnectNodes(nPrevNodeCount);
+
+        // Peers whose buffers were locked by another thread keep their readiness
+        // and are retried shortly. The message handler holds the receive buffer
+        // while processing a message, so don't spin until it is done.
+        int nEvents = epoll_wait(hEpoll, &vEvents[0], vEvents.size(), fRetry ? SOCKET_RETRY_WAIT_MS : 50);
+        boost::this_thread::interruption_point();
+        int64_t nStartUsec = GetTimeMicros();
+
+        if (nEvents == SOCKET_ERROR) {
+            int nErr = WSAGetLastError();
+            nEvents = 0;
+            if (nErr != WSAEINTR) {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+                MilliSleep(50);
+            }
+        }
+
+        for (int i = 0; i < nEvents; i++) {
+            const struct epoll_event& event = vEvents[i];
+            const ListenSocket* pListenSocket = NULL;
+            for (const ListenSocket& hListenSocket : vhListenSocket) {
+                if (&hListenSocket == event.data.ptr)
+                    pListenSocket = &hListenSocket;
+            }
+            if (pListenSocket) {
+                AcceptConnection(*pListenSocket);
+                continue;
+            }
+
+            // Sockets are removed from epoll before they are closed, and nodes are
+            // only deleted by this thread, so the node is still alive here
+            CNode* pnode = static_cast<CNode*>(event.data.ptr);
+            if (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                pnode->fSocketRecvReady = true;
+            if (event.events & EPOLLOUT)
+                pnode->fSocketSendReady = true;
+            setNodesReady.insert(pnode);
+        }
+
         //
-        // Disconnect nodes
+        // Service the sockets that reported readiness
         //
+        std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            std::vector<CNode*> vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
-
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
-
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+            vNodesCopy.assign(setNodesReady.begin(), setNodesReady.end());
+            for (CNode* pnode : vNodesCopy)
+                pnode->AddRef();
+        }
+        fRetry = false;
+        for (CNode* pnode : vNodesCopy) {
+            boost::this_thread::interruption_point();
+
+            if (pnode->hSocket == INVALID_SOCKET) {
+                setNodesReady.erase(pnode);
+                continue;
+            }
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+            //
+            // Send
+            //
+            bool fSendQueued = true;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend) {
+                    // A send that blocks again gets a new edge once the socket drains
+                    if (pnode->fSocketSendReady && !pnode->vSendMsg.empty())
+                        SocketSendData(pnode);
+                    pnode->fSocketSendReady = false;
+                    fSendQueued = !pnode->vSendMsg.empty();
+                } else {
+                    fRetry = true;
                 }
             }
-        }
-        {
-            // Delete disconnected nodes
-            std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            for (CNode* pnode : vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
-                    }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+
+            //
+            // Receive
+            //
+            // As with select(), the send queue of a peer is drained before reading more
+            // from it, and reading pauses at -maxreceivebuffer. The readiness is kept
+            // meanwhile, since no new edge will report the data already waiting.
+            if (pnode->fSocketRecvReady && !fSendQueued) {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv) {
+                    while (pnode->fSocketRecvReady && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                                                          pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                        pnode->fSocketRecvReady = SocketRecvData(pnode);
+                } else {
+                    fRetry = true;
                 }
             }
+
+            if (!pnode->fSocketRecvReady && !pnode->fSocketSendReady)
+                setNodesReady.erase(pnode);
         }
-        size_t vNodesSize;
         {
             LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
+            for (CNode* pnode : vNodesCopy)
+                pnode->Release();
         }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+
+        //
+        // Inactivity checking, the timeouts are in seconds
+        //
+        int64_t nTime = GetTime();
+        if (nTime != nLastInactivityCheck) {
+            nLastInactivityCheck = nTime;
+            LOCK(cs_vNodes);
+            for (CNode* pnode : vNodes)
+                InactivityCheck(pnode);
         }
 
+        RecordSocketHandlerLoop(nEvents, nStartUsec);
+    }
+}
+#else
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    while (true) {
+        DisconnectNodes(nPrevNodeCount);
+
         //
         // Find which sockets have data to receive
         //
@@ -963,6 +1525,7 @@ void ThreadSocketHandler()
         int nSelect = select(have_fds ? hSocketMax + 1 : 0,
             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
         boost::this_thread::interruption_point();
+        int64_t nStartUsec = GetTimeMicros();
 
         if (nSelect == SOCKET_ERROR) {
             if (have_fds) {
@@ -980,49 +1543,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         for (const ListenSocket& hListenSocket : vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    for (CNode* pnode : vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -1045,33 +1567,8 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                if (lockRecv)
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1088,31 +1585,18 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
             for (CNode* pnode : vNodesCopy)
                 pnode->Release();
         }
+
+        RecordSocketHandlerLoop(std::max(nSelect, 0), nStartUsec);
     }
 }
-
+#endif
 
 #ifdef USE_UPNP
 void ThreadMapPort()
@@ -1490,68 +1974,166 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
-void ThreadMessageHandler()
+// requires cs_messageHandler
+static void QueueMessageHandling(CNode* pnode)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
-    while (true) {
-        std::vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
-                pnode->AddRef();
-            }
-        }
-
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+    vMessageHandlerQueues[pnode->id % vMessageHandlerQueues.size()].push_back(pnode);
+}
 
-        bool fSleep = true;
+// requires cs_messageHandler
+static void RequeueDeferredNodes()
+{
+    for (CNode* pnode : vMessageHandlerDeferred)
+        QueueMessageHandling(pnode);
+    vMessageHandlerDeferred.clear();
+}
 
-        for (CNode* pnode : vNodesCopy) {
-            if (pnode->fDisconnect)
+// Hand every node that is not already waiting or being served to the handler threads,
+// so that each one gets its messages processed and sent
+static void ScheduleMessageHandling()
+{
+    {
+        LOCK(cs_vNodes);
+        boost::lock_guard<boost::mutex> lock(cs_messageHandler);
+        nMessageHandlerTrickleNode = vNodes.empty() ? -1 : vNodes[GetRand(vNodes.size())]->id;
+        for (CNode* pnode : vNodes) {
+            if (pnode->fDisconnect || pnode->fMessageHandlerQueued)
                 continue;
+            pnode->fMessageHandlerQueued = true;
+            pnode->AddRef();
+            QueueMessageHandling(pnode);
+        }
+        RequeueDeferredNodes();
+    }
+    messageHandlerCondition.notify_all();
+}
 
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+// requires cs_messageHandler
+// Take the oldest node of our own queue, or steal the newest one of another thread
+static CNode* TakeMessageHandlerWork(size_t nThread)
+{
+    std::deque<CNode*>& queue = vMessageHandlerQueues[nThread];
+    if (!queue.empty()) {
+        CNode* pnode = queue.front();
+        queue.pop_front();
+        return pnode;
+    }
+    for (size_t i = 1; i < vMessageHandlerQueues.size(); i++) {
+        std::deque<CNode*>& victim = vMessageHandlerQueues[(nThread + i) % vMessageHandlerQueues.size()];
+        if (!victim.empty()) {
+            CNode* pnode = victim.back();
+            victim.pop_back();
+            return pnode;
+        }
+    }
+    return NULL;
+}
 
-                    if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
-                            fSleep = false;
-                        }
-                    }
+// Process and send the messages of one node. Only one handler thread serves a node at
+// a time, which keeps its messages in order. fProgress tells whether a message or
+// getdata request was processed, fPending whether more is waiting to be processed.
+static void HandleNodeMessages(CNode* pnode, bool fTrickle, bool& fProgress, bool& fPending)
+{
+    fProgress = false;
+    fPending = false;
+    if (pnode->fDisconnect)
+        return;
+
+    // Receive messages
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv) {
+            size_t nGetData = pnode->vRecvGetData.size();
+            size_t nRecvMsg = pnode->vRecvMsg.size();
+            if (!g_signals.ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+            fProgress = pnode->vRecvGetData.size() != nGetData || pnode->vRecvMsg.size() != nRecvMsg;
+
+            if (pnode->nSendSize < SendBufferSize()) {
+                if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
+                    fPending = true;
                 }
             }
-            boost::this_thread::interruption_point();
+        }
+    }
+    boost::this_thread::interruption_point();
 
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+    // Send messages
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            g_signals.SendMessages(pnode, fTrickle || pnode->fWhitelisted);
+    }
+    boost::this_thread::interruption_point();
+}
+
+void ThreadMessageHandler(size_t nThread)
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true) {
+        CNode* pnode = NULL;
+        bool fTrickle = false;
+        bool fScan = false;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_messageHandler);
+            pnode = TakeMessageHandlerWork(nThread);
+            int64_t nWait = nMessageHandlerNextScan - GetTimeMillis();
+            if (!pnode && !fMessageHandlerWake && nWait > 0) {
+                messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(nWait));
+                pnode = TakeMessageHandlerWork(nThread);
+            }
+            if (pnode) {
+                fTrickle = pnode->id == nMessageHandlerTrickleNode;
+            } else if (fMessageHandlerWake || GetTimeMillis() >= nMessageHandlerNextScan) {
+                // Every node is served at least every 100ms, or as soon as a message arrives
+                fMessageHandlerWake = false;
+                nMessageHandlerNextScan = GetTimeMillis() + 100;
+                fScan = true;
             }
-            boost::this_thread::interruption_point();
         }
+        if (fScan)
+            ScheduleMessageHandling();
+        if (!pnode)
+            continue;
 
-
+        bool fProgress, fPending;
+        HandleNodeMessages(pnode, fTrickle, fProgress, fPending);
         {
+            boost::lock_guard<boost::mutex> lock(cs_messageHandler);
+            if (fPending && fProgress) {
+                // Keep serving it, the reference stays with the queue
+                QueueMessageHandling(pnode);
+            } else if (fPending) {
+                // Its next message waits for a busy message lane
+                vMessageHandlerDeferred.push_back(pnode);
+            } else {
+                pnode->fMessageHandlerQueued = false;
+            }
+            // Processing a message released its lane for the nodes waiting on it
+            if (fProgress)
+                RequeueDeferredNodes();
+        }
+        if (fProgress)
+            messageHandlerCondition.notify_all();
+        if (!fPending) {
             LOCK(cs_vNodes);
-            for (CNode* pnode : vNodesCopy)
-                pnode->Release();
+            pnode->Release();
         }
+    }
+}
 
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+void StartMessageHandlerThreads(boost::thread_group& threadGroup, int nThreads)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(cs_messageHandler);
+        vMessageHandlerQueues.assign(nThreads, std::deque<CNode*>());
+        vMessageHandlerDeferred.clear();
+        fMessageHandlerWake = false;
+        nMessageHandlerNextScan = 0;
     }
+    LogPrintf("Using %d message handler threads\n", nThreads);
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 }
 
 bool BindListenPort(const CService& addrBind, std::string& strError, bool fWhitelisted)
@@ -1747,7 +2329,7 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    StartMessageHandlerThreads(threadGroup, std::max(1, std::min((int)GetArg("-msghandthreads", DEFAULT_MESSAGE_HANDLER_THREADS), MAX_MESSAGE_HANDLER_THREADS)));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2050,6 +2632,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fSocketRecvReady = false;
+    fSocketSendReady = false;
+    fMessageHandlerQueued = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -2089,6 +2674,12 @@ CNode::~CNode()
     if (pfilter)
         delete pfilter;
 
+    {
+        LOCK(cs_msgStatsDisconnected);
+        for (const std::pair<const std::string, CNetMsgStats>& item : mapMsgStats)
+            mapMsgStatsDisconnected[item.first] += item.second;
+    }
+
     GetNodeSignals().FinalizeNode(GetId());
 }
 
@@ -2157,30 +2748,39 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         return;
     }
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    FinalizeMessageHeader(ssSend);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
-
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LogPrint("net", "(%d bytes) peer=%d\n", ssSend.size() - CMessageHeader::HEADER_SIZE, id);
+    RecordMsgSend(GetMessageCommand(&ssSend[0]), ssSend.size());
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    // Move the message into a pooled buffer, ssSend takes over the pooled buffer's capacity for the next one
+    std::shared_ptr<CSerializeData> pdata = AcquireSendBuffer();
+    ssSend.SwapAndClear(*pdata);
+    nSendSize += pdata->size();
+    vSendMsg.push_back(pdata);
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushSerializedMessage(const CSerializedMessageRef& msg)
+{
+    LOCK(cs_vSend);
+    std::string strCommand = GetMessageCommand(&(*msg)[0]);
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(strCommand), msg->size() - CMessageHeader::HEADER_SIZE, id);
+    RecordMsgSend(strCommand, msg->size());
+
+    nSendSize += msg->size();
+    vSendMsg.push_back(msg);
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
 //
 // CBanDB
 //
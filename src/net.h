@@ -21,6 +21,8 @@
 #include "utilstrencodings.h"
 
 #include <deque>
+#include <map>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -60,6 +62,9 @@ static const bool DEFAULT_UPNP = USE_UPNP;
 #else
 static const bool DEFAULT_UPNP = false;
 #endif
+/** Default for -msghandthreads, the number of threads processing peer messages */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 
@@ -79,9 +84,44 @@ void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
+/** Start nThreads threads processing and sending the messages of the nodes in vNodes */
+void StartMessageHandlerThreads(boost::thread_group& threadGroup, int nThreads);
 bool StopNode();
 void SocketSendData(CNode* pnode);
 
+/** A message serialized with its header, exactly as it goes on the wire. Any number
+ *  of send queues can hold the same message, it is never copied per peer. */
+typedef std::shared_ptr<const CSerializeData> CSerializedMessageRef;
+
+/** An empty send buffer that goes back to a pool of reusable buffers with its last reference */
+std::shared_ptr<CSerializeData> AcquireSendBuffer();
+/** Fill in the payload size and checksum of the message header at the start of ss */
+void FinalizeMessageHeader(CDataStream& ss);
+
+/** Serialize a message once, to be queued to many peers with CNode::PushSerializedMessage.
+ *  Only for messages whose encoding does not depend on the peer's protocol version. */
+template <typename T1>
+CSerializedMessageRef MakeSerializedMessage(const char* pszCommand, const T1& a1)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << a1;
+    FinalizeMessageHeader(ss);
+    std::shared_ptr<CSerializeData> pdata = AcquireSendBuffer();
+    ss.SwapAndClear(*pdata);
+    return pdata;
+}
+
+/** Wakeups of the socket handler thread and the time spent handling them */
+struct CSocketHandlerStats {
+    std::string strBackend; // "epoll" or "select"
+    uint64_t nLoops;        // wakeups handled since startup
+    uint64_t nEvents;       // socket events reported by those wakeups
+    int64_t nTotalUsec;     // time spent handling them, excluding the wait
+    int64_t nMaxUsec;       // longest single wakeup
+};
+
+void GetSocketHandlerStats(CSocketHandlerStats& stats);
+
 typedef int NodeId;
 
 // Signals for message handling
@@ -154,6 +194,30 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Traffic of one message command. Bytes include the message header. */
+struct CNetMsgStats {
+    static const int PROCESS_TIME_BUCKETS = 6;
+
+    uint64_t nMsgsRecv;
+    uint64_t nBytesRecv;
+    uint64_t nMsgsSent;
+    uint64_t nBytesSent;
+    int64_t nProcessUsec;    // total time spent processing the received messages
+    int64_t nMaxProcessUsec; // longest time spent on one
+    uint64_t vProcessTime[PROCESS_TIME_BUCKETS]; // received messages processed in under 100us, 1ms, 10ms, 100ms, 1s, and longer
+
+    CNetMsgStats();
+
+    void RecordRecv(unsigned int nBytes, int64_t nUsec);
+    void RecordSend(unsigned int nBytes);
+    CNetMsgStats& operator+=(const CNetMsgStats& other);
+};
+
+typedef std::map<std::string, CNetMsgStats> mapMsgStats_t;
+
+/** Per-command traffic of all peers since startup, those already disconnected included */
+void GetNetMsgStats(mapMsgStats_t& mapStats);
+
 class CNodeStats
 {
 public:
@@ -174,32 +238,38 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    mapMsgStats_t mapMsgStats;
 };
 
 
 class CNetMessage
 {
+private:
+    mutable CHash256 hasher; // payload hash, fed as the data arrives
+    mutable uint256 data_hash;
+
 public:
     bool in_data; // parsing header (false) or data (true)
 
-    CDataStream hdrbuf; // partially received header
-    CMessageHeader hdr; // complete header
+    char pchHdr[CMessageHeader::HEADER_SIZE]; // partially received header
+    CMessageHeader hdr;                       // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv; // received message data
+    CDataStream vRecv; // received message data, in a pooled buffer once the header is in
     unsigned int nDataPos;
 
     int64_t nTime; // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
     {
-        hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -207,9 +277,11 @@ public:
         return (hdr.nMessageSize == nDataPos);
     }
 
+    /** Double-SHA256 of the payload of a complete message, as the checksum is taken from */
+    const uint256& GetMessageHash() const;
+
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
@@ -291,13 +363,15 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedMessageRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
+    mapMsgStats_t mapMsgStats;
+    CCriticalSection cs_msgStats;
     int nRecvVersion;
 
     int64_t nLastSend;
@@ -320,6 +394,11 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Edge-triggered readiness not yet consumed, only used by the socket handler thread
+    bool fSocketRecvReady;
+    bool fSocketSendReady;
+    // Waiting in a message handler queue or being served, guarded by the message handler lock
+    bool fMessageHandlerQueued;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
@@ -486,6 +565,9 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a message built with MakeSerializedMessage, sharing it with the other peers it goes to */
+    void PushSerializedMessage(const CSerializedMessageRef& msg);
+
     void PushVersion();
 
 
@@ -728,6 +810,10 @@ public:
     static void RecordBytesRecv(uint64_t bytes);
     static void RecordBytesSent(uint64_t bytes);
 
+    /** Account a received message and the time it took to process */
+    void RecordMsgRecv(const std::string& strCommand, unsigned int nBytes, int64_t nProcessUsec);
+    void RecordMsgSend(const std::string& strCommand, unsigned int nBytes);
+
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
 };
@@ -36,9 +36,26 @@ static const char* ppszTypeName[] =
         "dstx",
         "pubcoins",
         "genwit",
-        "accvalue"
+        "accvalue",
+        "cmpctblock"
     };
 
+static const char* ppszNetMessageTypes[] =
+    {
+        "addr", "alert", "block", "blocktxn", "cmpctblock", "dsc", "dsee", "dseep",
+        "dseg", "dsf", "dsq", "dsr", "dssu", "dstx", "fbs", "fbvote",
+        "filteradd", "filterclear", "filterload", "getaddr", "getblocks", "getblocktxn", "getdata", "getheaders",
+        "getsporks", "headers", "inv", "ix", "mempool", "merkleblock", "mnb", "mnget",
+        "mnp", "mnvs", "mnw", "mprop", "mvote", "notfound", "ping", "pong",
+        "reject", "sendcmpct", "spork", "ssc", "tx", "txlvote", "verack", "version"
+    };
+
+const std::vector<std::string>& GetAllNetMessageTypes()
+{
+    static const std::vector<std::string> vTypes(ppszNetMessageTypes, ppszNetMessageTypes + ARRAYLEN(ppszNetMessageTypes));
+    return vTypes;
+}
+
 CMessageHeader::CMessageHeader()
 {
     memcpy(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -65,6 +66,12 @@ public:
     unsigned int nChecksum;
 };
 
+/** Traffic in commands missing from GetAllNetMessageTypes() is accounted under this name */
+#define NET_MESSAGE_COMMAND_OTHER "*other*"
+
+/** The message commands this client sends or handles */
+const std::vector<std::string>& GetAllNetMessageTypes();
+
 /** nServices flags */
 enum {
     NODE_NETWORK = (1 << 0),
@@ -177,7 +184,10 @@ enum {
     MSG_DSTX,
     MSG_PUBCOINS,
     MSG_GENWIT,
-    MSG_ACC_VALUE
+    MSG_ACC_VALUE,
+    // Only valid in getdata, answered with a cmpctblock message to peers
+    // that negotiated compact block relay with sendcmpct.
+    MSG_CMPCT_BLOCK
 };
 
 #endif // ALQO_PROTOCOL_H
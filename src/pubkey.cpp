@@ -287,6 +287,44 @@ bool CExtPubKey::Derive(CExtPubKey& out, unsigned int _nChild) const
     return (!secp256k1_ecdsa_signature_normalize(secp256k1_context_verify, nullptr, &sig));
 }
 
+void CSignatureBatch::Add(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey)
+{
+    std::map<CPubKey, size_t>::iterator it = mapKeys.find(pubkey);
+    if (it == mapKeys.end()) {
+        it = mapKeys.insert(std::make_pair(pubkey, vKeys.size())).first;
+        vKeys.push_back(pubkey);
+    }
+    vEntries.push_back(Entry());
+    Entry& entry = vEntries.back();
+    entry.hash = hash;
+    entry.vchSig = vchSig;
+    entry.nKey = it->second;
+}
+
+bool CSignatureBatch::Verify(std::vector<bool>& vfValid) const
+{
+    // Each key is parsed once, on first use
+    std::vector<secp256k1_pubkey> vParsed(vKeys.size());
+    std::vector<signed char> vKeyState(vKeys.size(), 0);
+    bool fAllValid = true;
+    vfValid.assign(vEntries.size(), false);
+    for (size_t i = 0; i < vEntries.size(); i++) {
+        const Entry& entry = vEntries[i];
+        const CPubKey& pubkey = vKeys[entry.nKey];
+        signed char& nState = vKeyState[entry.nKey];
+        if (nState == 0)
+            nState = pubkey.IsValid() && secp256k1_ec_pubkey_parse(secp256k1_context_verify, &vParsed[entry.nKey], pubkey.begin(), pubkey.size()) ? 1 : -1;
+
+        secp256k1_ecdsa_signature sig;
+        if (nState == 1 && ecdsa_signature_parse_der_lax(secp256k1_context_verify, &sig, entry.vchSig.data(), entry.vchSig.size())) {
+            secp256k1_ecdsa_signature_normalize(secp256k1_context_verify, &sig, &sig);
+            vfValid[i] = secp256k1_ecdsa_verify(secp256k1_context_verify, &sig, entry.hash.begin(), &vParsed[entry.nKey]);
+        }
+        fAllValid = fAllValid && vfValid[i];
+    }
+    return fAllValid;
+}
+
 /* static */ int ECCVerifyHandle::refcount = 0;
 
 ECCVerifyHandle::ECCVerifyHandle()
@@ -11,6 +11,7 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <map>
 #include <stdexcept>
 #include <vector>
 
@@ -206,6 +207,38 @@ public:
 
 };
 
+/**
+ * A set of signature checks collected to be verified together. Each distinct
+ * public key is parsed (and decompressed) only once for the whole set.
+ * libsecp256k1 offers no combined ECDSA verification, as a signature only
+ * carries the x coordinate of its nonce point, so the signatures themselves
+ * are still checked one by one.
+ */
+class CSignatureBatch
+{
+private:
+    struct Entry {
+        uint256 hash;
+        std::vector<unsigned char> vchSig;
+        size_t nKey;
+    };
+
+    std::vector<CPubKey> vKeys;
+    std::map<CPubKey, size_t> mapKeys;
+    std::vector<Entry> vEntries;
+
+public:
+    void Add(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey);
+
+    size_t size() const { return vEntries.size(); }
+
+    /**
+     * Verify all collected signatures, as CPubKey::Verify would. vfValid
+     * receives one result per added check. Returns whether all are valid.
+     */
+    bool Verify(std::vector<bool>& vfValid) const;
+};
+
 struct CExtPubKey {
     unsigned char nDepth;
     unsigned char vchFingerprint[4];
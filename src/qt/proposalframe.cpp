@@ -305,7 +305,10 @@ void ProposalFrame::SendVote(std::string strHash, int nVote)
 
         std::string strError = "";
         if (budget.UpdateProposal(vote, NULL, strError)) {
-            budget.mapSeenMasternodeBudgetVotes.insert(std::make_pair(vote.GetHash(), vote));
+            {
+                LOCK(budget.cs);
+                budget.mapSeenMasternodeBudgetVotes.insert(std::make_pair(vote.GetHash(), vote));
+            }
             vote.Relay();
             mnresult += mne.getAlias() + ": " + "Success!" + "<br />";
             success++;
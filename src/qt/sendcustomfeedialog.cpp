@@ -93,7 +93,7 @@ void SendCustomFeeDialog::updateFee(){
     bool res = false;
     int nBlocksToConfirm = num.toInt(&res);
     if (res) {
-        feeRate = mempool.estimateFee(nBlocksToConfirm);
+        feeRate = mempool.estimateSmartFee(nBlocksToConfirm);
         if (feeRate <= CFeeRate(0)) { // not enough data => minfee
             feeRate = CWallet::minTxFee;
             ui->labelFee->setText(BitcoinUnits::formatWithUnit(walletModel->getOptionsModel()->getDisplayUnit(),
@@ -11,8 +11,10 @@
 #include "kernel.h"
 #include "main.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
 #include "sync.h"
 #include "txdb.h"
+#include "txorphanage.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "wallet/wallet.h"
@@ -338,16 +340,22 @@ UniValue mempoolToJSON(bool fVerbose = false)
     if (fVerbose) {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        for (const PAIRTYPE(uint256, CTxMemPoolEntry) & entry : mempool.mapTx) {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+        for (const CTxMemPoolEntry& e : mempool.mapTx) {
+            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+            info.push_back(Pair("modifiedfee", ValueFromAmount(e.GetModifiedFee())));
             info.push_back(Pair("time", e.GetTime()));
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
             const CTransaction& tx = e.GetTx();
             std::set<std::string> setDepends;
             for (const CTxIn& txin : tx.vin) {
@@ -400,7 +408,14 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "    \"time\" : n,             (numeric) local time transaction entered pool in seconds since 1 Jan 1970 GMT\n"
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
+            "    \"modifiedfee\" : n,      (numeric) transaction fee with fee deltas used for mining priority\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) modified fees (see above) of in-mempool descendants (including this one)\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) modified fees (see above) of in-mempool ancestors (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -519,6 +534,9 @@ UniValue getblock(const UniValue& params, bool fHelp)
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
     if (!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -586,30 +604,53 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw std::runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Note this call may take some time unless hash_type is \"muhash\".\n"
+
+            "\nArguments:\n"
+            "1. \"hash_type\"   (string, optional, default=\"hash_serialized\") Which UTXO set hash to return, \"hash_serialized\" or \"muhash\".\n"
+            "                  \"hash_serialized\" scans the whole set; \"muhash\" is maintained as blocks are connected and returns at once.\n"
 
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"transactions\": n,      (numeric) The number of transactions (only with hash_serialized)\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (only with hash_serialized)\n"
+            "  \"muhash\": \"hash\",   (string) The MuHash3072 of the set of unspent outputs (only with muhash)\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
 
             "\nExamples:\n" +
-            HelpExampleCli("gettxoutsetinfo", "") + HelpExampleRpc("gettxoutsetinfo", ""));
+            HelpExampleCli("gettxoutsetinfo", "") + HelpExampleCli("gettxoutsetinfo", "\"muhash\"") +
+            HelpExampleRpc("gettxoutsetinfo", ""));
+
+    std::string strHashType = params.size() > 0 ? params[0].get_str() : "hash_serialized";
+    if (strHashType != "muhash" && strHashType != "hash_serialized")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown hash_type " + strHashType);
 
     LOCK(cs_main);
 
     UniValue ret(UniValue::VOBJ);
 
+    if (strHashType == "muhash") {
+        CCoinsTally tally;
+        if (!pcoinsTip->GetTally(tally))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "UTXO set statistics are not available");
+        ret.push_back(Pair("height", (int64_t)chainActive.Height()));
+        ret.push_back(Pair("bestblock", pcoinsTip->GetBestBlock().GetHex()));
+        ret.push_back(Pair("txouts", tally.nTransactionOutputs));
+        ret.push_back(Pair("bytes_serialized", tally.nSerializedSize));
+        ret.push_back(Pair("muhash", tally.muhash.Finalize().GetHex()));
+        ret.push_back(Pair("total_amount", ValueFromAmount(tally.nTotalAmount)));
+        return ret;
+    }
+
     CCoinsStats stats;
     FlushStateToDisk();
     if (pcoinsTip->GetStats(stats)) {
@@ -651,7 +692,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "}\n"
 
@@ -674,33 +714,33 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out))
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n < 0 || (unsigned int)n >= coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex* pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
@@ -779,6 +819,8 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
+            "  \"pruneheight\": xxxxxx,    (numeric) lowest-height complete block stored (only present if pruning is enabled)\n"
             "  \"softforks\": [            (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",        (string) name of softfork\n"
@@ -807,10 +849,19 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("pruned", fPruneMode));
     CBlockIndex* tip = chainActive.Tip();
     UniValue softforks(UniValue::VARR);
     softforks.push_back(SoftForkDesc("bip65", 5, tip));
     obj.push_back(Pair("softforks",             softforks));
+
+    if (fPruneMode) {
+        CBlockIndex* block = chainActive.Tip();
+        while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
+            block = block->pprev;
+
+        obj.push_back(Pair("pruneheight", block->nHeight));
+    }
     return obj;
 }
 
@@ -962,7 +1013,10 @@ UniValue mempoolInfoToJSON()
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
-    //ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
 
     return ret;
 }
@@ -978,6 +1032,9 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -986,6 +1043,127 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getorphaninfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "getorphaninfo\n"
+            "\nReturns details on the transactions kept while their parents are missing.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"size\": xxxxx                (numeric) Current orphan count\n"
+            "  \"bytes\": xxxxx               (numeric) Sum of all orphan sizes\n"
+            "  \"maxorphantx\": xxxxx         (numeric) Maximum number of orphans kept\n"
+            "  \"maxorphantxperpeer\": xxxxx  (numeric) Maximum number of orphans kept for a single peer\n"
+            "  \"expired\": xxxxx             (numeric) Orphans dropped unresolved after their expiry time, since startup\n"
+            "  \"evicted\": xxxxx             (numeric) Orphans dropped to stay within the limits, since startup\n"
+            "  \"peers\": [                   (array) Peers currently holding orphans\n"
+            "    {\n"
+            "      \"peer\": n,               (numeric) Peer id\n"
+            "      \"count\": n,              (numeric) Number of orphans sent by this peer\n"
+            "      \"bytes\": n               (numeric) Sum of their sizes\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getorphaninfo", "") + HelpExampleRpc("getorphaninfo", ""));
+
+    COrphanageStats stats;
+    orphanage.GetStats(stats);
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("size", (int64_t) stats.nCount));
+    ret.push_back(Pair("bytes", (int64_t) stats.nBytes));
+    ret.push_back(Pair("maxorphantx", GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS)));
+    ret.push_back(Pair("maxorphantxperpeer", GetArg("-maxorphantxperpeer", DEFAULT_MAX_ORPHAN_TRANSACTIONS_PER_PEER)));
+    ret.push_back(Pair("expired", (uint64_t) stats.nExpired));
+    ret.push_back(Pair("evicted", (uint64_t) stats.nEvicted));
+    UniValue peers(UniValue::VARR);
+    for (const COrphanPeerStats& peerStats : stats.vPeers) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("peer", (int64_t) peerStats.peer));
+        obj.push_back(Pair("count", (int64_t) peerStats.nCount));
+        obj.push_back(Pair("bytes", (int64_t) peerStats.nBytes));
+        peers.push_back(obj);
+    }
+    ret.push_back(Pair("peers", peers));
+
+    return ret;
+}
+
+UniValue savemempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "savemempool\n"
+            "\nDumps the mempool to disk.\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("savemempool", "") + HelpExampleRpc("savemempool", ""));
+
+    if (!fMempoolLoaded)
+        throw JSONRPCError(RPC_MISC_ERROR, "The mempool was not loaded yet");
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return NullUniValue;
+}
+
+static UniValue sigCacheStatsToJSON(const CSignatureCacheStats& stats)
+{
+    uint64_t nLookups = stats.nHits + stats.nMisses;
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("slots", (uint64_t)stats.nSlots));
+    ret.push_back(Pair("bytes", (uint64_t)stats.nBytes));
+    ret.push_back(Pair("entries", (uint64_t)stats.nEntries));
+    ret.push_back(Pair("hits", stats.nHits));
+    ret.push_back(Pair("misses", stats.nMisses));
+    ret.push_back(Pair("hitrate", nLookups ? (double)stats.nHits / nLookups : 0.0));
+    ret.push_back(Pair("inserts", stats.nInserts));
+    ret.push_back(Pair("evictions", stats.nEvictions));
+    ret.push_back(Pair("contention", stats.nContention));
+    return ret;
+}
+
+UniValue getsigcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "getsigcacheinfo\n"
+            "\nReturns details on the signature cache.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"slots\": xxxxx               (numeric) Number of entries the cache can hold\n"
+            "  \"bytes\": xxxxx               (numeric) Memory allocated for the cache\n"
+            "  \"entries\": xxxxx             (numeric) Number of entries currently cached\n"
+            "  \"hits\": xxxxx                (numeric) Lookups that found their entry\n"
+            "  \"misses\": xxxxx              (numeric) Lookups that did not find their entry\n"
+            "  \"hitrate\": x.xxx             (numeric) Fraction of lookups that were hits\n"
+            "  \"inserts\": xxxxx             (numeric) Entries added\n"
+            "  \"evictions\": xxxxx           (numeric) Live entries dropped to make room\n"
+            "  \"contention\": xxxxx          (numeric) Inserts that had to wait for another writer\n"
+            "  \"scriptexecution\": {         (json object) The same counters for the cache of transactions\n"
+            "      ...                       whose scripts passed, keyed by txid and script flags\n"
+            "  }\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getsigcacheinfo", "") + HelpExampleRpc("getsigcacheinfo", ""));
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+    UniValue ret = sigCacheStatsToJSON(stats);
+
+    GetScriptExecutionCacheStats(stats);
+    ret.push_back(Pair("scriptexecution", sigCacheStatsToJSON(stats)));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -106,6 +106,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"prioritisetransaction", 2},
         {"setban", 2},
         {"setban", 3},
+        {"getnetmsgstats", 0},
         {"spork", 1},
         {"preparebudget", 2},
         {"preparebudget", 3},
@@ -13,6 +13,7 @@
 #include "main.h"
 #include "miner.h"
 #include "net.h"
+#include "policy/fees.h"
 #include "pow.h"
 #include "rpc/server.h"
 #include "util.h"
@@ -339,6 +340,10 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
             "  ],\n"
             "  \"masternode_payments\" : true|false,         (boolean) true, if masternode payments are enabled\n"
             "  \"enforce_masternode_payments\" : true|false  (boolean) true, if masternode payments are enforced\n"
+            "  \"assemblytime\" : {                 (json object) time it took to assemble this template\n"
+            "      \"selection\" : n,                (numeric) microseconds spent selecting transactions\n"
+            "      \"validity\" : n                  (numeric) microseconds spent checking the block\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -554,6 +559,11 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     result.push_back(Pair("masternode_payments", pblock->nTime > Params().StartMasternodePayments()));
     result.push_back(Pair("enforce_masternode_payments", true));
 
+    UniValue assemblyTime(UniValue::VOBJ);
+    assemblyTime.push_back(Pair("selection", pblocktemplate->nSelectionTime));
+    assemblyTime.push_back(Pair("validity", pblocktemplate->nValidityTime));
+    result.push_back(Pair("assemblytime", assemblyTime));
+
     return result;
 }
 
@@ -641,15 +651,26 @@ UniValue submitblock(const UniValue& params, bool fHelp)
 
 UniValue estimatefee(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 1)
+    if (fHelp || params.size() < 1 || params.size() > 2)
         throw std::runtime_error(
-            "estimatefee nblocks\n"
+            "estimatefee nblocks ( \"estimate_mode\" )\n"
             "\nEstimates the approximate fee per kilobyte\n"
             "needed for a transaction to begin confirmation\n"
-            "within nblocks blocks.\n"
+            "within nblocks blocks. If no estimate can be given\n"
+            "for nblocks, the estimate for the closest target\n"
+            "that has enough data is returned.\n"
 
             "\nArguments:\n"
-            "1. nblocks     (numeric)\n"
+            "1. nblocks         (numeric) Confirmation target in blocks (1 - 1008)\n"
+            "2. \"estimate_mode\" (string, optional, default=CONSERVATIVE) The fee estimate mode.\n"
+            "                   Whether to return a more conservative estimate which also satisfies\n"
+            "                   a longer history. A conservative estimate potentially returns a\n"
+            "                   higher feerate and is more likely to be sufficient for the desired\n"
+            "                   target, but is not as responsive to short term drops in the\n"
+            "                   prevailing fee market.  Must be one of:\n"
+            "       \"UNSET\" (defaults to CONSERVATIVE)\n"
+            "       \"ECONOMICAL\"\n"
+            "       \"CONSERVATIVE\"\n"
 
             "\nResult:\n"
             "n :    (numeric) estimated fee-per-kilobyte\n"
@@ -658,15 +679,25 @@ UniValue estimatefee(const UniValue& params, bool fHelp)
             "blocks have been observed to make an estimate.\n"
 
             "\nExample:\n" +
-            HelpExampleCli("estimatefee", "6"));
+            HelpExampleCli("estimatefee", "6") +
+            HelpExampleCli("estimatefee", "6 \"ECONOMICAL\""));
 
-    RPCTypeCheck(params, boost::assign::list_of(UniValue::VNUM));
+    RPCTypeCheck(params, boost::assign::list_of(UniValue::VNUM)(UniValue::VSTR));
 
     int nBlocks = params[0].get_int();
     if (nBlocks < 1)
         nBlocks = 1;
 
-    CFeeRate feeRate = mempool.estimateFee(nBlocks);
+    bool fConservative = true;
+    if (params.size() > 1 && !params[1].isNull()) {
+        FeeEstimateMode feeMode;
+        if (!FeeModeFromString(params[1].get_str(), feeMode))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid estimate_mode parameter");
+        if (feeMode == FeeEstimateMode::ECONOMICAL)
+            fConservative = false;
+    }
+
+    CFeeRate feeRate = mempool.estimateSmartFee(nBlocks, NULL, fConservative);
     if (feeRate == CFeeRate(0))
         return -1.0;
 
@@ -678,18 +709,15 @@ UniValue estimatepriority(const UniValue& params, bool fHelp)
     if (fHelp || params.size() != 1)
         throw std::runtime_error(
             "estimatepriority nblocks\n"
-            "\nEstimates the approximate priority\n"
-            "a zero-fee transaction needs to begin confirmation\n"
-            "within nblocks blocks.\n"
+            "\nDEPRECATED. Priority is no longer estimated and this call always\n"
+            "returns -1. Zero-fee transactions are still mined when their\n"
+            "priority is above the fixed free transaction threshold.\n"
 
             "\nArguments:\n"
             "1. nblocks     (numeric)\n"
 
             "\nResult:\n"
-            "n :    (numeric) estimated priority\n"
-            "\n"
-            "-1.0 is returned if not enough transactions and\n"
-            "blocks have been observed to make an estimate.\n"
+            "n :    (numeric) always -1.0\n"
 
             "\nExample:\n" +
             HelpExampleCli("estimatepriority", "6"));
@@ -592,6 +592,11 @@ UniValue getstakingstatus(const UniValue& params, bool fHelp)
             "  \"enoughcoins\": true|false,        (boolean) if available coins are greater than reserve balance\n"
             "  \"mnsync\": true|false,             (boolean) if masternode data is synced\n"
             "  \"staking status\": true|false,     (boolean) if the wallet is staking or not\n"
+            "  \"kernelspersec\": x.xxx,           (numeric) stake kernels the wallet has hashed per second while searching, over all threads\n"
+            "  \"threadkernelspersec\": [          (array) the same for each of the -stakethreads threads\n"
+            "    x.xxx,\n"
+            "    ...\n"
+            "  ]\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -620,6 +625,13 @@ UniValue getstakingstatus(const UniValue& params, bool fHelp)
     else if (mapHashedBlocks.count(chainActive.Tip()->nHeight - 1) && nLastCoinStakeSearchInterval)
         nStaking = true;
     obj.push_back(Pair("staking status", nStaking));
+    if (pwalletMain) {
+        obj.push_back(Pair("kernelspersec", pwalletMain->stakeSearch.GetKernelsPerSecond()));
+        UniValue threadRates(UniValue::VARR);
+        for (double dRate : pwalletMain->stakeSearch.GetThreadKernelsPerSecond())
+            threadRates.push_back(UniValue(dRate));
+        obj.push_back(Pair("threadkernelspersec", threadRates));
+    }
 
     return obj;
 }
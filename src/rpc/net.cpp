@@ -106,7 +106,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"bytessent_per_msg\": {\n"
+            "       \"command\": n,           (numeric) The total bytes sent in messages of this command, headers included\n"
+            "       ...\n"
+            "    },\n"
+            "    \"bytesrecv_per_msg\": {\n"
+            "       \"command\": n,           (numeric) The total bytes received in messages of this command, headers included\n"
+            "       ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -158,6 +167,17 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
+        UniValue sendPerMsg(UniValue::VOBJ);
+        UniValue recvPerMsg(UniValue::VOBJ);
+        for (const std::pair<const std::string, CNetMsgStats>& item : stats.mapMsgStats) {
+            if (item.second.nMsgsSent > 0)
+                sendPerMsg.push_back(Pair(item.first, item.second.nBytesSent));
+            if (item.second.nMsgsRecv > 0)
+                recvPerMsg.push_back(Pair(item.first, item.second.nBytesRecv));
+        }
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsg));
+        obj.push_back(Pair("bytesrecv_per_msg", recvPerMsg));
+
         ret.push_back(obj);
     }
 
@@ -365,6 +385,81 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     return obj;
 }
 
+static UniValue NetMsgStatsToJSON(const CNetMsgStats& stats)
+{
+    static const char* ppszBuckets[CNetMsgStats::PROCESS_TIME_BUCKETS] = {"<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s"};
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("msgssent", stats.nMsgsSent));
+    obj.push_back(Pair("bytessent", stats.nBytesSent));
+    obj.push_back(Pair("msgsrecv", stats.nMsgsRecv));
+    obj.push_back(Pair("bytesrecv", stats.nBytesRecv));
+    if (stats.nMsgsRecv > 0) {
+        obj.push_back(Pair("avgprocessmicros", stats.nProcessUsec / (int64_t)stats.nMsgsRecv));
+        obj.push_back(Pair("maxprocessmicros", stats.nMaxProcessUsec));
+        UniValue histogram(UniValue::VOBJ);
+        for (int i = 0; i < CNetMsgStats::PROCESS_TIME_BUCKETS; i++)
+            histogram.push_back(Pair(ppszBuckets[i], stats.vProcessTime[i]));
+        obj.push_back(Pair("processtimes", histogram));
+    }
+    return obj;
+}
+
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw std::runtime_error(
+            "getnetmsgstats ( nodeid )\n"
+            "\nReturns network traffic per message command, of all peers since startup or of one connected peer.\n"
+
+            "\nArguments:\n"
+            "1. nodeid     (numeric, optional) Only the traffic of this peer (see getpeerinfo for node ids)\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {                (string) The message command, \"" NET_MESSAGE_COMMAND_OTHER "\" for those we don't know\n"
+            "    \"msgssent\": n,            (numeric) Messages sent\n"
+            "    \"bytessent\": n,           (numeric) Bytes sent, headers included\n"
+            "    \"msgsrecv\": n,            (numeric) Messages received and processed\n"
+            "    \"bytesrecv\": n,           (numeric) Bytes received, headers included\n"
+            "    \"avgprocessmicros\": n,    (numeric) Average time spent processing one received message\n"
+            "    \"maxprocessmicros\": n,    (numeric) Longest time spent processing one received message\n"
+            "    \"processtimes\": {         (json object) Received messages by the time their processing took\n"
+            "      \"<100us\": n,\n"
+            "      \"<1ms\": n,\n"
+            "      \"<10ms\": n,\n"
+            "      \"<100ms\": n,\n"
+            "      \"<1s\": n,\n"
+            "      \">=1s\": n\n"
+            "    }\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getnetmsgstats", "") + HelpExampleCli("getnetmsgstats", "3") + HelpExampleRpc("getnetmsgstats", "3"));
+
+    mapMsgStats_t mapStats;
+    if (params.size() > 0) {
+        NodeId nodeid = params[0].get_int();
+        std::vector<CNodeStats> vstats;
+        CopyNodeStats(vstats);
+        std::vector<CNodeStats>::const_iterator it = vstats.begin();
+        while (it != vstats.end() && it->nodeid != nodeid)
+            it++;
+        if (it == vstats.end())
+            throw JSONRPCError(RPC_CLIENT_NODE_NOT_CONNECTED, "Node not found in connected nodes");
+        mapStats = it->mapMsgStats;
+    } else {
+        GetNetMsgStats(mapStats);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    for (const std::pair<const std::string, CNetMsgStats>& item : mapStats)
+        ret.push_back(Pair(item.first, NetMsgStatsToJSON(item.second)));
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
@@ -400,6 +495,13 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
             "  \"localservices\": \"xxxxxxxxxxxxxxxx\", (string) the services we offer to the network\n"
             "  \"timeoffset\": xxxxx,                   (numeric) the time offset\n"
             "  \"connections\": xxxxx,                  (numeric) the number of connections\n"
+            "  \"sockethandler\": {                     (object) the thread serving the peer sockets\n"
+            "    \"backend\": \"epoll|select\",          (string) how it waits for socket readiness\n"
+            "    \"loops\": xxxxx,                      (numeric) wakeups handled since startup\n"
+            "    \"events\": xxxxx,                     (numeric) socket events handled since startup\n"
+            "    \"avgloopmicros\": xxxxx,              (numeric) average time spent per wakeup, excluding the wait\n"
+            "    \"maxloopmicros\": xxxxx               (numeric) longest wakeup\n"
+            "  },\n"
             "  \"networks\": [                          (array) information per network\n"
             "  {\n"
             "    \"name\": \"xxx\",                     (string) network (ipv4, ipv6 or onion)\n"
@@ -432,6 +534,15 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("localservices", strprintf("%016x", nLocalServices)));
     obj.push_back(Pair("timeoffset", GetTimeOffset()));
     obj.push_back(Pair("connections", (int)vNodes.size()));
+    CSocketHandlerStats socketStats;
+    GetSocketHandlerStats(socketStats);
+    UniValue socketHandler(UniValue::VOBJ);
+    socketHandler.push_back(Pair("backend", socketStats.strBackend));
+    socketHandler.push_back(Pair("loops", socketStats.nLoops));
+    socketHandler.push_back(Pair("events", socketStats.nEvents));
+    socketHandler.push_back(Pair("avgloopmicros", socketStats.nLoops ? socketStats.nTotalUsec / (int64_t)socketStats.nLoops : 0));
+    socketHandler.push_back(Pair("maxloopmicros", socketStats.nMaxUsec));
+    obj.push_back(Pair("sockethandler", socketHandler));
     obj.push_back(Pair("networks", GetNetworksInfo()));
     obj.push_back(Pair("relayfee", ValueFromAmount(::minRelayTxFee.GetFeePerK())));
     UniValue localAddresses(UniValue::VARR);
@@ -10,79 +10,231 @@
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <algorithm>
+#include <string.h>
 
-namespace {
+CSignatureCache::CSignatureCache() : nSlotsPerShard(0), nMaxDepth(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0), nContention(0)
+{
+    uint256 nonce = GetRandHash();
+    // We want the nonce to be 64 bytes long to force the hasher to process
+    // this chunk, which makes later hash computations more efficient. We
+    // just write our 32-byte entropy twice to fill the 64 bytes.
+    saltedHasher.Write(nonce.begin(), 32);
+    saltedHasher.Write(nonce.begin(), 32);
+    for (unsigned int i = 0; i < NUM_SHARDS; i++) {
+        shards[i].nGeneration = 1;
+        shards[i].nInsertsInGeneration = 0;
+    }
+}
 
-/**
- * Valid signature cache, to avoid doing expensive ECDSA signature checking
- * twice for every transaction (once when accepted into memory pool, and
- * again when accepted into the block chain)
- */
-class CSignatureCache
+size_t CSignatureCache::Setup(size_t nBytes)
 {
-private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+    size_t nSlots = nBytes / sizeof(Slot);
+    nSlotsPerShard = nSlots / NUM_SHARDS;
+    if (nSlotsPerShard < NUM_WAYS)
+        nSlotsPerShard = nBytes ? NUM_WAYS : 0;
+    nMaxDepth = 1;
+    while ((size_t(1) << nMaxDepth) < nSlotsPerShard)
+        nMaxDepth++;
+
+    slots.reset(nSlotsPerShard ? new Slot[nSlotsPerShard * NUM_SHARDS] : NULL);
+    for (size_t i = 0; i < nSlotsPerShard * NUM_SHARDS; i++) {
+        for (unsigned int j = 0; j < 4; j++)
+            slots[i].digest[j].store(0, std::memory_order_relaxed);
+        slots[i].nGeneration.store(0, std::memory_order_relaxed);
+    }
+    for (unsigned int i = 0; i < NUM_SHARDS; i++) {
+        shards[i].nGeneration = 1;
+        shards[i].nInsertsInGeneration = 0;
+    }
+    return nSlotsPerShard * NUM_SHARDS * sizeof(Slot);
+}
+
+void CSignatureCache::ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+{
+    CSHA256 hasher = saltedHasher;
+    hasher.Write(hash.begin(), 32).Write(pubkey.begin(), pubkey.size()).Write(vchSig.data(), vchSig.size()).Finalize(entry.begin());
+}
+
+unsigned int CSignatureCache::ShardOf(const uint256& entry) const
+{
+    // The ways use up all 32 bytes of the entry. Folding them together keeps the
+    // shard independent of any single way's bits, so every way reaches all the
+    // slots of the shard.
+    unsigned char nFold = 0;
+    for (const unsigned char* p = entry.begin(); p != entry.end(); p++)
+        nFold ^= *p;
+    return nFold % NUM_SHARDS;
+}
+
+CSignatureCache::Slot& CSignatureCache::SlotAt(unsigned int nShard, const uint256& entry, unsigned int nWay) const
+{
+    // Each way takes its own 32 bits of the (uniformly distributed) entry and
+    // maps them onto the shard without a division.
+    uint32_t nHash;
+    memcpy(&nHash, entry.begin() + 4 * nWay, 4);
+    size_t nIndex = (size_t)(((uint64_t)nHash * (uint64_t)nSlotsPerShard) >> 32);
+    return slots[nShard * nSlotsPerShard + nIndex];
+}
+
+bool CSignatureCache::Matches(const Slot& slot, const uint256& entry)
+{
+    uint64_t digest[4];
+    memcpy(digest, entry.begin(), 32);
+    for (unsigned int i = 0; i < 4; i++) {
+        if (slot.digest[i].load(std::memory_order_relaxed) != digest[i])
+            return false;
+    }
+    return true;
+}
+
+void CSignatureCache::Store(Slot& slot, const uint256& entry, uint32_t nGeneration)
+{
+    uint64_t digest[4];
+    memcpy(digest, entry.begin(), 32);
+    // Free the slot first, so concurrent lookups skip it while it is rewritten
+    slot.nGeneration.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (unsigned int i = 0; i < 4; i++)
+        slot.digest[i].store(digest[i], std::memory_order_relaxed);
+    slot.nGeneration.store(nGeneration, std::memory_order_release);
+}
+
+bool CSignatureCache::Get(const uint256& entry, bool fErase)
+{
+    if (nSlotsPerShard == 0)
         return false;
+
+    unsigned int nShard = ShardOf(entry);
+    for (unsigned int nWay = 0; nWay < NUM_WAYS; nWay++) {
+        Slot& slot = SlotAt(nShard, entry, nWay);
+        if (slot.nGeneration.load(std::memory_order_acquire) != 0 && Matches(slot, entry)) {
+            if (fErase)
+                slot.nGeneration.store(0, std::memory_order_relaxed);
+            nHits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
     }
+    nMisses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::set<sigdata_type>::iterator it = setValid.lower_bound(sigdata_type(randomHash));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+void CSignatureCache::Set(const uint256& entry)
+{
+    if (nSlotsPerShard == 0)
+        return;
+
+    Shard& shard = shards[ShardOf(entry)];
+    boost::unique_lock<boost::mutex> lock(shard.cs, boost::try_to_lock);
+    if (!lock.owns_lock()) {
+        nContention.fetch_add(1, std::memory_order_relaxed);
+        lock.lock();
+    }
+    nInserts.fetch_add(1, std::memory_order_relaxed);
+
+    if (++shard.nInsertsInGeneration >= nSlotsPerShard / 2) {
+        shard.nInsertsInGeneration = 0;
+        if (++shard.nGeneration == 0)
+            shard.nGeneration = 1;
+    }
+
+    unsigned int nShard = ShardOf(entry);
+    uint256 current = entry;
+    uint32_t nCurrentGeneration = shard.nGeneration;
+    const Slot* pslotFrom = NULL;
+    for (unsigned int nDepth = 0; nDepth < nMaxDepth; nDepth++) {
+        Slot* pslotVictim = NULL;
+        uint32_t nVictimAge = 0;
+        for (unsigned int nWay = 0; nWay < NUM_WAYS; nWay++) {
+            Slot& slot = SlotAt(nShard, current, nWay);
+            uint32_t nGeneration = slot.nGeneration.load(std::memory_order_relaxed);
+            if (nGeneration != 0 && Matches(slot, current))
+                return;
+            uint32_t nAge = shard.nGeneration - nGeneration;
+            if (nGeneration == 0 || nAge >= 2) {
+                Store(slot, current, nCurrentGeneration);
+                return;
+            }
+            if (&slot != pslotFrom && (pslotVictim == NULL || nAge > nVictimAge)) {
+                pslotVictim = &slot;
+                nVictimAge = nAge;
+            }
         }
+        if (pslotVictim == NULL)
+            break;
+
+        // Every way holds a live entry: take the oldest one's place and move it on.
+        uint256 displaced;
+        for (unsigned int i = 0; i < 4; i++) {
+            uint64_t word = pslotVictim->digest[i].load(std::memory_order_relaxed);
+            memcpy(displaced.begin() + 8 * i, &word, 8);
+        }
+        uint32_t nDisplacedGeneration = pslotVictim->nGeneration.load(std::memory_order_relaxed);
+        Store(*pslotVictim, current, nCurrentGeneration);
+        current = displaced;
+        nCurrentGeneration = nDisplacedGeneration;
+        pslotFrom = pslotVictim;
+    }
+    // The last displaced entry found no place
+    nEvictions.fetch_add(1, std::memory_order_relaxed);
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+void CSignatureCache::GetStats(CSignatureCacheStats& stats) const
+{
+    stats.nSlots = nSlotsPerShard * NUM_SHARDS;
+    stats.nBytes = stats.nSlots * sizeof(Slot);
+    stats.nEntries = 0;
+    for (size_t i = 0; i < stats.nSlots; i++) {
+        if (slots[i].nGeneration.load(std::memory_order_relaxed) != 0)
+            stats.nEntries++;
     }
-};
+    stats.nHits = nHits.load(std::memory_order_relaxed);
+    stats.nMisses = nMisses.load(std::memory_order_relaxed);
+    stats.nInserts = nInserts.load(std::memory_order_relaxed);
+    stats.nEvictions = nEvictions.load(std::memory_order_relaxed);
+    stats.nContention = nContention.load(std::memory_order_relaxed);
+}
+
+namespace {
+CSignatureCache signatureCache;
+}
+
+void InitSignatureCache()
+{
+    // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
+    // Setup() will disable the cache. Half of it goes to the script
+    // execution cache, see InitScriptExecutionCache().
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t)1 << 20);
+    size_t nBytes = signatureCache.Setup(nMaxCacheSize);
+    CSignatureCacheStats stats;
+    signatureCache.GetStats(stats);
+    LogPrintf("Using %zu MiB out of %zu requested for signature cache, able to store %zu elements\n",
+        nBytes / (1 << 20), nMaxCacheSize / (1 << 20), stats.nSlots);
+}
 
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    signatureCache.GetStats(stats);
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    // Signatures checked while connecting a block are not needed again
+    if (signatureCache.Get(entry, !store))
         return true;
 
+    if (pbatch) {
+        pbatch->Add(sighash, vchSig, pubkey);
+        return true;
+    }
+
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
 
     if (store)
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
     return true;
 }
@@ -6,19 +6,124 @@
 #ifndef ALQO_SCRIPT_SIGCACHE_H
 #define ALQO_SCRIPT_SIGCACHE_H
 
+#include "crypto/sha256.h"
 #include "script/interpreter.h"
+#include "uint256.h"
 
+#include <atomic>
+#include <memory>
 #include <vector>
 
+#include <boost/thread/mutex.hpp>
+
+// DoS prevention: limit cache size to 32 MiB (over 900000 entries)
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+// Maximum sig cache size allowed, in MiB
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
+
 class CPubKey;
+class CSignatureBatch;
+
+/** Counters of a CSignatureCache, see GetSignatureCacheStats */
+struct CSignatureCacheStats {
+    size_t nSlots;
+    size_t nBytes;
+    size_t nEntries;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+    uint64_t nContention;
+};
+
+/**
+ * Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain).
+ *
+ * Entries are 32-byte salted hashes of (signature hash, public key, signature)
+ * kept in a fixed table split into shards. Every entry can live in one of
+ * NUM_WAYS slots of its shard. Lookups only read atomics and never lock; a
+ * lookup racing with a write to the same slot can only miss. Inserts take the
+ * shard's mutex, reuse empty or stale slots first, and otherwise move the
+ * oldest entry to one of its other slots, cuckoo style, dropping the last one
+ * displaced. Slots are stamped with the shard's generation, which advances
+ * every half shard of inserts; entries two generations old count as stale.
+ */
+class CSignatureCache
+{
+public:
+    static const unsigned int NUM_SHARDS = 16;
+    static const unsigned int NUM_WAYS = 8;
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> digest[4];
+        //! Generation the entry was stored in, 0 if the slot is free
+        std::atomic<uint32_t> nGeneration;
+    };
+
+    struct Shard {
+        //! Serializes inserts into this shard, lookups don't take it
+        boost::mutex cs;
+        uint32_t nGeneration;
+        size_t nInsertsInGeneration;
+    };
+
+    //! Salted hasher, so entry positions can't be predicted by others
+    CSHA256 saltedHasher;
+    std::unique_ptr<Slot[]> slots;
+    size_t nSlotsPerShard;
+    unsigned int nMaxDepth;
+    Shard shards[NUM_SHARDS];
+
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+    std::atomic<uint64_t> nInserts;
+    std::atomic<uint64_t> nEvictions;
+    std::atomic<uint64_t> nContention;
+
+    unsigned int ShardOf(const uint256& entry) const;
+    Slot& SlotAt(unsigned int nShard, const uint256& entry, unsigned int nWay) const;
+    static bool Matches(const Slot& slot, const uint256& entry);
+    static void Store(Slot& slot, const uint256& entry, uint32_t nGeneration);
+
+    CSignatureCache(const CSignatureCache&);
+    CSignatureCache& operator=(const CSignatureCache&);
+
+public:
+    CSignatureCache();
+
+    /** (Re)allocate the table for about nBytes of memory, dropping all entries. Not thread safe. Returns the bytes used. */
+    size_t Setup(size_t nBytes);
+
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const;
+
+    /** Look up an entry. With fErase a hit frees the slot, for entries not needed again. */
+    bool Get(const uint256& entry, bool fErase);
+    void Set(const uint256& entry);
+
+    void GetStats(CSignatureCacheStats& stats) const;
+};
+
+/** Size the signature cache from -maxsigcachesize. Call once at startup before verifying scripts. */
+void InitSignatureCache();
+/** Return the counters of the signature cache */
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
 
+/**
+ * Signature checker consulting the signature cache. With a batch, signatures
+ * missing from the cache are not verified but added to the batch and reported
+ * valid; the caller must verify the batch and redo the script if it fails.
+ */
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
     bool store;
+    CSignatureBatch* pbatch;
 
 public:
-    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true) : TransactionSignatureChecker(txToIn, nInIn), store(storeIn) {}
+    CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, bool storeIn=true, CSignatureBatch* pbatchIn=NULL) : TransactionSignatureChecker(txToIn, nInIn), store(storeIn), pbatch(pbatchIn) {}
 
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
@@ -56,8 +56,11 @@ void CSporkManager::LoadSporksFromDB()
         }
 
         // add spork to memory
-        mapSporks[spork.GetHash()] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+        {
+            LOCK(cs);
+            mapSporks[spork.GetHash()] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         std::time_t result = spork.nValue;
         // If SPORK Value is greater than 1,000,000 assume it's actually a Date and then convert to a more readable format
         std::string sporkName = sporkManager.GetSporkNameByID(spork.nSporkID);
@@ -176,6 +179,23 @@ bool CSporkManager::UpdateSpork(SporkId nSporkID, int64_t nValue)
     return false;
 }
 
+// look up a relayed spork message by its hash
+bool CSporkManager::HaveSporkMessage(const uint256& hash)
+{
+    LOCK(cs);
+    return mapSporks.count(hash);
+}
+
+bool CSporkManager::GetSporkMessage(const uint256& hash, CSporkMessage& sporkRet)
+{
+    LOCK(cs);
+    std::map<uint256, CSporkMessage>::const_iterator it = mapSporks.find(hash);
+    if (it == mapSporks.end())
+        return false;
+    sporkRet = it->second;
+    return true;
+}
+
 // grab the spork value, and see if it's off
 bool CSporkManager::IsSporkActive(SporkId nSporkID)
 {
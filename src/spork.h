@@ -23,7 +23,7 @@ class CSporkMessage;
 class CSporkManager;
 
 extern std::vector<CSporkDef> sporkDefs;
-extern std::map<uint256, CSporkMessage> mapSporks;
+extern std::map<uint256, CSporkMessage> mapSporks; // protected by sporkManager's lock
 extern CSporkManager sporkManager;
 
 //
@@ -106,6 +106,8 @@ public:
 
     void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
     int64_t GetSporkValue(SporkId nSporkID);
+    bool HaveSporkMessage(const uint256& hash);
+    bool GetSporkMessage(const uint256& hash, CSporkMessage& sporkRet);
     void ExecuteSpork(SporkId nSporkID, int nValue);
     bool UpdateSpork(SporkId nSporkID, int64_t nValue);
 
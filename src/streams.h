@@ -118,6 +118,7 @@ public:
     bool empty() const { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c = 0) { vch.resize(n + nReadPos, c); }
     void reserve(size_type n) { vch.reserve(n + nReadPos); }
+    size_type capacity() const { return vch.capacity() - nReadPos; }
     const_reference operator[](size_type pos) const { return vch[pos + nReadPos]; }
     reference operator[](size_type pos) { return vch[pos + nReadPos]; }
     void clear()
@@ -295,6 +296,17 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Hand the unread data over without copying it, the stream keeps the
+    // buffer data held before, emptied, to serialize into next.
+    void SwapAndClear(CSerializeData& data)
+    {
+        vch.swap(data);
+        if (nReadPos > 0)
+            data.erase(data.begin(), data.begin() + nReadPos);
+        vch.clear();
+        nReadPos = 0;
+    }
 };
 
 
@@ -588,4 +600,51 @@ public:
     }
 };
 
+
+/** Read-only stream over a range of memory that it does not own, such as a
+ *  memory mapped file. Deserializes in place without copying the range into
+ *  an intermediate buffer first.
+ */
+class CSpanReader
+{
+private:
+    const char* pcur;
+    const char* pend;
+    int nType;
+    int nVersion;
+
+public:
+    CSpanReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) : pcur(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType() { return nType; }
+    int GetVersion() { return nVersion; }
+    size_t size() const { return pend - pcur; }
+    bool empty() const { return pcur == pend; }
+
+    CSpanReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::read : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CSpanReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::ignore : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif // ALQO_STREAMS_H
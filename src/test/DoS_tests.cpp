@@ -14,27 +14,18 @@
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
+#include "txorphanage.h"
 #include "util.h"
 
 #include "test/test_alqo.h"
 
+#include <algorithm>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/test/unit_test.hpp>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -107,13 +98,22 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
-CTransaction RandomOrphan()
+static CTransaction RandomOrphan(const std::vector<CTransaction>& vOrphans)
+{
+    return vOrphans[GetRand(vOrphans.size())];
+}
+
+static CTransaction OrphanSpending(const uint256& hashPrev, const CKey& key)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    return tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -123,25 +123,21 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     CBasicKeyStore keystore;
     keystore.AddKey(key);
 
+    CTxOrphanage orphans;
+    std::vector<CTransaction> vAdded;
+
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
     {
-        CMutableTransaction tx;
-        tx.vin.resize(1);
-        tx.vin[0].prevout.n = 0;
-        tx.vin[0].prevout.hash = GetRandHash();
-        tx.vin[0].scriptSig << OP_1;
-        tx.vout.resize(1);
-        tx.vout[0].nValue = 1*CENT;
-        tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
-
-        AddOrphanTx(tx, i);
+        CTransaction tx = OrphanSpending(GetRandHash(), key);
+        BOOST_CHECK(orphans.AddTx(tx, i));
+        vAdded.push_back(tx);
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(vAdded);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -152,13 +148,19 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx, i);
+        if (orphans.AddTx(tx, i))
+            vAdded.push_back(tx);
+
+        // The parent resolves its children through the outpoint index
+        std::vector<uint256> vChildren;
+        orphans.GetChildren(txPrev, vChildren);
+        BOOST_CHECK(std::find(vChildren.begin(), vChildren.end(), tx.GetHash()) != vChildren.end());
     }
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(vAdded);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -176,25 +178,110 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!orphans.AddTx(tx, i));
     }
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphans.Size();
+        BOOST_CHECK(orphans.EraseForPeer(i) > 0);
+        BOOST_CHECK(orphans.Size() < sizeBefore);
+    }
+
+    // Test LimitOrphans() function:
+    orphans.LimitOrphans(40, DEFAULT_MAX_ORPHAN_TRANSACTIONS);
+    BOOST_CHECK(orphans.Size() <= 40);
+    orphans.LimitOrphans(10, DEFAULT_MAX_ORPHAN_TRANSACTIONS);
+    BOOST_CHECK(orphans.Size() <= 10);
+    orphans.LimitOrphans(0, DEFAULT_MAX_ORPHAN_TRANSACTIONS);
+    BOOST_CHECK_EQUAL(orphans.Size(), 0U);
+
+    COrphanageStats stats;
+    orphans.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBytes, 0U);
+    BOOST_CHECK(stats.vPeers.empty());
+    for (const CTransaction& tx : vAdded) {
+        std::vector<uint256> vChildren;
+        orphans.GetChildren(tx, vChildren);
+        BOOST_CHECK(vChildren.empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphansPerPeer)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    CTxOrphanage orphans;
+    std::vector<CTransaction> vFlood;
+
+    // One peer floods the pool, another sends a single orphan
+    for (int i = 0; i < 30; i++) {
+        vFlood.push_back(OrphanSpending(GetRandHash(), key));
+        BOOST_CHECK(orphans.AddTx(vFlood.back(), 1));
     }
+    CTransaction txHonest = OrphanSpending(GetRandHash(), key);
+    BOOST_CHECK(orphans.AddTx(txHonest, 2));
+
+    // The flooding peer loses its oldest orphans to its quota
+    BOOST_CHECK_EQUAL(orphans.LimitOrphans(100, 10), 20U);
+    BOOST_CHECK_EQUAL(orphans.Size(), 11U);
+    for (int i = 0; i < 20; i++)
+        BOOST_CHECK(!orphans.HaveTx(vFlood[i].GetHash()));
+    for (int i = 20; i < 30; i++)
+        BOOST_CHECK(orphans.HaveTx(vFlood[i].GetHash()));
+    BOOST_CHECK(orphans.HaveTx(txHonest.GetHash()));
+
+    // When the pool is full the peer holding the most orphans pays
+    BOOST_CHECK_EQUAL(orphans.LimitOrphans(5, 10), 6U);
+    BOOST_CHECK(orphans.HaveTx(txHonest.GetHash()));
+
+    COrphanageStats stats;
+    orphans.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nCount, 5U);
+    BOOST_CHECK_EQUAL(stats.nEvicted, 26U);
+    BOOST_CHECK_EQUAL(stats.vPeers.size(), 2U);
+
+    NodeId peer;
+    CTransaction tx;
+    BOOST_CHECK(orphans.GetTx(txHonest.GetHash(), tx, peer));
+    BOOST_CHECK_EQUAL(peer, 2);
+    BOOST_CHECK(orphans.EraseTx(txHonest.GetHash()));
+    BOOST_CHECK(!orphans.GetTx(txHonest.GetHash(), tx, peer));
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphansExpire)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    CTxOrphanage orphans;
+    CTransaction txOld = OrphanSpending(GetRandHash(), key);
+    BOOST_CHECK(orphans.AddTx(txOld, 0));
+
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME / 2);
+    CTransaction txNew = OrphanSpending(GetRandHash(), key);
+    BOOST_CHECK(orphans.AddTx(txNew, 0));
+
+    // The first sweep happens right away and finds nothing expired
+    orphans.LimitOrphans(100, 100);
+    BOOST_CHECK_EQUAL(orphans.Size(), 2U);
+
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL);
+    orphans.LimitOrphans(100, 100);
+    BOOST_CHECK(!orphans.HaveTx(txOld.GetHash()));
+    BOOST_CHECK(orphans.HaveTx(txNew.GetHash()));
+
+    COrphanageStats stats;
+    orphans.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nExpired, 1U);
+    BOOST_CHECK_EQUAL(stats.nEvicted, 0U);
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,7 +4,11 @@
 
 #include "coins.h"
 #include "random.h"
+#include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
+#include "undo.h"
+#include "version.h"
 #include "test/test_alqo.h"
 
 #include <vector>
@@ -17,47 +21,58 @@ namespace
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
+    CCoinsTally tally_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin) && !coin.IsSpent();
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
 
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsTally& tally)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
-            map_[it->first] = it->second.coins;
-            if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
-                // Randomly delete empty entries on write.
-                map_.erase(it->first);
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                // Same optimization used in CCoinsViewDB is to only write dirty entries.
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
+                    // Randomly delete empty entries on write.
+                    map_.erase(it->first);
+                }
             }
             mapCoins.erase(it++);
         }
         mapCoins.clear();
         hashBestBlock_ = hashBlock;
+        tally_ += tally;
         return true;
     }
 
     bool GetStats(CCoinsStats& stats) const { return false; }
+
+    bool GetTally(CCoinsTally& tally) const
+    {
+        tally = tally_;
+        return true;
+    }
 };
 }
 
@@ -68,8 +83,8 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
-// txids picked from a limited list of random 256-bit hashes. Occasionally, a
+// It will randomly create/update/delete Coin entries to a tip of caches, with
+// outpoints picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
@@ -86,12 +101,12 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool missed_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
     std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    stack.push_back(new CCoinsViewCache(&base, true)); // Start with one cache, which keeps the tally.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -103,39 +118,59 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
         // Do a random modification.
         {
-            uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], insecure_rand() % 2); // outpoint we're going to modify in this iteration.
+            Coin& coin = result[outpoint];
+            const Coin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin == entry);
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                if (coin.IsSpent()) {
                     added_an_entry = true;
                 } else {
                     updated_an_entry = true;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                newcoin.fCoinStake = insecure_rand() % 2;
+                stack.back()->AddCoin(outpoint, Coin(newcoin), !coin.IsSpent() || insecure_rand() % 2);
+                coin = newcoin;
             } else {
-                coins.Clear();
-                entry->Clear();
+                stack.back()->SpendCoin(outpoint);
+                coin.Clear();
                 removed_an_entry = true;
             }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    found_an_entry = true;
                 }
             }
+
+            // The statistics kept by the bottom cache match the set it holds,
+            // which includes everything flushed into it from the caches above.
+            CCoinsTally expected;
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                const Coin& coin = stack.front()->AccessCoin(it->first);
+                if (!coin.IsSpent())
+                    expected.AddCoin(it->first, coin);
+            }
+            CCoinsTally tally;
+            if (stack.size() > 1)
+                BOOST_CHECK(!stack.back()->GetTally(tally));
+            BOOST_CHECK(stack.front()->GetTally(tally));
+            BOOST_CHECK_EQUAL(tally.nTransactionOutputs, expected.nTransactionOutputs);
+            BOOST_CHECK_EQUAL(tally.nSerializedSize, expected.nSerializedSize);
+            BOOST_CHECK_EQUAL(tally.nTotalAmount, expected.nTotalAmount);
+            BOOST_CHECK(tally.muhash.Finalize() == expected.muhash.Finalize());
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -152,7 +187,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCache(tip, tip == &base));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -176,4 +211,56 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+// Round-trip a Coin through its disk serialization, including the coinstake flag.
+BOOST_AUTO_TEST_CASE(coin_serialization)
+{
+    Coin coin(CTxOut(12345, CScript() << OP_TRUE), 203998, false, true);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << coin;
+    Coin coin2;
+    ss >> coin2;
+    BOOST_CHECK(coin == coin2);
+    BOOST_CHECK_EQUAL((uint32_t)coin2.nHeight, 203998U);
+    BOOST_CHECK(!coin2.IsCoinBase());
+    BOOST_CHECK(coin2.IsCoinStake());
+    BOOST_CHECK_EQUAL(coin2.out.nValue, 12345);
+
+    // The undo serialization keeps the legacy layout: height, coinbase and
+    // coinstake in one VARINT followed by a dummy transaction version.
+    CTxUndo undo;
+    undo.vprevout.push_back(coin);
+    CDataStream ssUndo(SER_DISK, CLIENT_VERSION);
+    ssUndo << undo;
+    CTxUndo undo2;
+    ssUndo >> undo2;
+    BOOST_CHECK_EQUAL(undo2.vprevout.size(), 1U);
+    BOOST_CHECK(undo2.vprevout[0] == coin);
+}
+
+// A prefetched coin is served from the cache without being marked modified.
+BOOST_AUTO_TEST_CASE(coin_prefetch)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache cache(&base);
+    COutPoint outpoint(GetRandHash(), 0);
+    Coin coin(CTxOut(5000, CScript() << OP_TRUE), 100, false, false);
+
+    BOOST_CHECK(!cache.HaveEntryInCache(outpoint));
+    cache.PrefetchCoin(outpoint, Coin(coin));
+    BOOST_CHECK(cache.HaveEntryInCache(outpoint));
+    BOOST_CHECK(cache.HaveCoinInCache(outpoint));
+    BOOST_CHECK(cache.AccessCoin(outpoint) == coin);
+
+    // An existing entry is not replaced.
+    Coin other(CTxOut(1, CScript() << OP_TRUE), 200, false, false);
+    cache.PrefetchCoin(outpoint, Coin(other));
+    BOOST_CHECK(cache.AccessCoin(outpoint) == coin);
+
+    // Clean entries are not written back, and can be uncached.
+    cache.Uncache(outpoint);
+    BOOST_CHECK(!cache.HaveEntryInCache(outpoint));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!base.HaveCoin(outpoint));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
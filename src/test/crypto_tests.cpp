@@ -9,7 +9,10 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/muhash.h"
 #include "random.h"
+#include "streams.h"
+#include "version.h"
 #include "utilstrencodings.h"
 #include "test/test_alqo.h"
 
@@ -283,4 +286,71 @@ BOOST_AUTO_TEST_CASE(rfc6979_hmac_sha256)
             ("7597887cbd76321f32e30440679a22cf7f8d9d2eac390e581fea091ce202ba94"));
 }
 
+BOOST_AUTO_TEST_CASE(muhash_set_operations)
+{
+    std::vector<uint256> elements;
+    for (int i = 0; i < 4; i++)
+        elements.push_back(GetRandHash());
+
+    MuHash3072 forward, backward;
+    for (int i = 0; i < 4; i++) {
+        forward.Insert(elements[i].begin(), 32);
+        backward.Insert(elements[3 - i].begin(), 32);
+    }
+    BOOST_CHECK(forward.Finalize() == backward.Finalize());
+
+    // Removing an element gives the hash of the remaining set
+    MuHash3072 three;
+    for (int i = 0; i < 3; i++)
+        three.Insert(elements[i].begin(), 32);
+    MuHash3072 removed = forward;
+    removed.Remove(elements[3].begin(), 32);
+    BOOST_CHECK(removed.Finalize() == three.Finalize());
+    BOOST_CHECK(removed.Finalize() != forward.Finalize());
+    BOOST_CHECK(MuHash3072().Finalize() != three.Finalize());
+
+    // Combining sets
+    MuHash3072 last, combined = three;
+    last.Insert(elements[3].begin(), 32);
+    combined *= last;
+    BOOST_CHECK(combined.Finalize() == forward.Finalize());
+    combined /= last;
+    BOOST_CHECK(combined.Finalize() == three.Finalize());
+
+    // The serialized state keeps the removals
+    CDataStream ss(SER_DISK, PROTOCOL_VERSION);
+    ss << removed;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * Num3072::BYTE_SIZE);
+    MuHash3072 loaded;
+    ss >> loaded;
+    BOOST_CHECK(loaded.Finalize() == three.Finalize());
+}
+
+static MuHash3072 MuHashFromInt(unsigned char i)
+{
+    unsigned char tmp[32] = {i, 0};
+    MuHash3072 muhash;
+    muhash.Insert(tmp, sizeof(tmp));
+    return muhash;
+}
+
+BOOST_AUTO_TEST_CASE(muhash_known_answer)
+{
+    // Test vector shared with other MuHash3072 implementations
+    MuHash3072 acc = MuHashFromInt(0);
+    acc *= MuHashFromInt(1);
+    acc /= MuHashFromInt(2);
+    BOOST_CHECK_EQUAL(acc.Finalize().GetHex(), "10d312b100cbd32ada024a6646e40d3482fcff103668d2625f10002a607d5863");
+
+    // The same set built with Insert and Remove
+    MuHash3072 set;
+    unsigned char tmp[32] = {0};
+    set.Insert(tmp, sizeof(tmp));
+    tmp[0] = 1;
+    set.Insert(tmp, sizeof(tmp));
+    tmp[0] = 2;
+    set.Remove(tmp, sizeof(tmp));
+    BOOST_CHECK(set.Finalize() == acc.Finalize());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
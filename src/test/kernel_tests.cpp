@@ -0,0 +1,179 @@
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "kernel.h"
+#include "main.h"
+#include "random.h"
+#include "test_alqo.h"
+
+#include <deque>
+#include <limits>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+/**
+ * An active chain of block index entries one minute apart, every tenth one
+ * generating a stake modifier. The chain is built once and outlives the
+ * tests, as the stake modifier index keeps a pointer to the last tip it saw.
+ */
+struct KernelTestingSetup : public BasicTestingSetup {
+    static std::deque<CBlockIndex> vIndex;
+    static std::vector<CBlock> vBlocks;
+
+    KernelTestingSetup()
+    {
+        LOCK(cs_main);
+        for (int i = vBlocks.size(); i < 300; i++) {
+            CBlock block;
+            block.nVersion = 4;
+            block.nTime = 1560000000 + 60 * i;
+            block.nNonce = i;
+            if (i > 0)
+                block.hashPrevBlock = vBlocks.back().GetHash();
+            vBlocks.push_back(block);
+
+            vIndex.push_back(CBlockIndex(block));
+            CBlockIndex& index = vIndex.back();
+            index.nHeight = i;
+            index.pprev = i > 0 ? &vIndex[i - 1] : NULL;
+            index.BuildSkip();
+            if (i % 10 == 0)
+                index.SetStakeModifier(GetRand(std::numeric_limits<uint64_t>::max()), true);
+        }
+        for (CBlockIndex& index : vIndex)
+            index.phashBlock = &mapBlockIndex.insert(std::make_pair(vBlocks[index.nHeight].GetHash(), &index)).first->first;
+        chainActive.SetTip(&vIndex.back());
+    }
+
+    ~KernelTestingSetup()
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(NULL);
+        for (const CBlock& block : vBlocks)
+            mapBlockIndex.erase(block.GetHash());
+    }
+};
+std::deque<CBlockIndex> KernelTestingSetup::vIndex;
+std::vector<CBlock> KernelTestingSetup::vBlocks;
+
+/** Compact target at which an output of nValue has a kernel about once per nOdds attempts at nTime */
+unsigned int GetTestBits(CAmount nValue, int64_t nTimeBlockFrom, int64_t nTime, int nOdds)
+{
+    int64_t nTimeWeight = std::min<int64_t>(nTime - nTimeBlockFrom, Params().COINSTAKE_MAX_AGE() - Params().COINSTAKE_MIN_AGE());
+    uint256 bnTarget = ~uint256(0);
+    bnTarget /= nOdds;
+    bnTarget /= uint256(nValue * nTimeWeight / COIN / 200);
+    return bnTarget.GetCompact();
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(kernel_tests, KernelTestingSetup)
+
+BOOST_AUTO_TEST_CASE(kernel_search_matches_check)
+{
+    // Outputs from blocks with a final stake modifier, and one near the tip
+    // whose modifier isn't final yet
+    std::vector<CStakeKernelSearch::Coin> vCoins;
+    std::vector<CTransaction> vTxPrev;
+    std::vector<const CBlock*> vBlockFrom;
+    const int vHeights[] = {20, 35, 290};
+    for (int i = 0; i < 3; i++) {
+        CMutableTransaction txPrev;
+        txPrev.vout.resize(2);
+        txPrev.vout[1].nValue = (1000 + i) * COIN;
+        txPrev.nLockTime = i;
+        vTxPrev.push_back(txPrev);
+        vBlockFrom.push_back(&vBlocks[vHeights[i]]);
+        vCoins.push_back(CStakeKernelSearch::Coin(COutPoint(vTxPrev[i].GetHash(), 1), txPrev.vout[1].nValue, vBlocks[vHeights[i]].GetHash()));
+    }
+
+    CStakeKernelSearch search;
+    {
+        LOCK(cs_main);
+        search.SetCoins(vCoins);
+    }
+
+    // The youngest output is not old enough at first
+    unsigned int nTimeTx = vBlocks[290].nTime + Params().COINSTAKE_MIN_AGE() + 400;
+    unsigned int nBits = GetTestBits(1000 * COIN, vBlocks[20].nTime, nTimeTx, 64);
+    int nFound = 0;
+    for (int nRound = 0; nRound < 8; nRound++) {
+        size_t nCoin;
+        unsigned int nTime;
+        uint256 hashProofOfStake;
+        bool fFound = search.Search(nBits, nTimeTx, 600, nTimeTx - 1000, nCoin, nTime, hashProofOfStake);
+
+        // No output has a kernel at the timestamps the search passed over
+        unsigned int nTimeFirst = fFound ? nTime + 1 : nTimeTx - 599;
+        for (unsigned int t = nTimeFirst; t <= nTimeTx; t++) {
+            for (int i = 0; i < 3; i++) {
+                if (vBlockFrom[i]->nTime + Params().COINSTAKE_MIN_AGE() > t)
+                    continue;
+                uint256 hash;
+                BOOST_CHECK(!CheckStakeKernelHash(nBits, *vBlockFrom[i], vTxPrev[i], vCoins[i].prevout, t, hash));
+            }
+        }
+
+        // The kernel found is the one CheckStakeKernelHash computes
+        if (fFound) {
+            nFound++;
+            BOOST_CHECK(nCoin < vCoins.size());
+            uint256 hash;
+            BOOST_CHECK(CheckStakeKernelHash(nBits, *vBlockFrom[nCoin], vTxPrev[nCoin], vCoins[nCoin].prevout, nTime, hash));
+            BOOST_CHECK(hash == hashProofOfStake);
+            for (size_t i = 0; i < nCoin; i++)
+                BOOST_CHECK(!CheckStakeKernelHash(nBits, *vBlockFrom[i], vTxPrev[i], vCoins[i].prevout, nTime, hash));
+        }
+        nTimeTx += 600;
+    }
+    BOOST_CHECK(nFound > 0);
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search_split_matches_single)
+{
+    std::vector<CStakeKernelSearch::Coin> vCoins;
+    for (int i = 0; i < 12; i++) {
+        CMutableTransaction txPrev;
+        txPrev.vout.resize(1);
+        txPrev.vout[0].nValue = (500 + 10 * i) * COIN;
+        txPrev.nLockTime = i;
+        vCoins.push_back(CStakeKernelSearch::Coin(COutPoint(CTransaction(txPrev).GetHash(), 0), txPrev.vout[0].nValue, vBlocks[10 + 20 * i].GetHash()));
+    }
+
+    // The worker threads are reused across searches and survive a change of thread count
+    CStakeKernelSearch single, split;
+    split.SetThreads(2);
+    split.SetThreads(4);
+    {
+        LOCK(cs_main);
+        single.SetCoins(vCoins);
+        split.SetCoins(vCoins);
+    }
+
+    unsigned int nTimeTx = vBlocks[299].nTime + Params().COINSTAKE_MIN_AGE() + 400;
+    unsigned int nBits = GetTestBits(500 * COIN, vBlocks[10].nTime, nTimeTx, 256);
+    int nFound = 0;
+    for (int nRound = 0; nRound < 16; nRound++) {
+        size_t nCoinSingle = 0, nCoinSplit = 0;
+        unsigned int nTimeSingle = 0, nTimeSplit = 0;
+        uint256 hashSingle, hashSplit;
+        bool fFound = single.Search(nBits, nTimeTx, 600, nTimeTx - 1000, nCoinSingle, nTimeSingle, hashSingle);
+        BOOST_CHECK_EQUAL(split.Search(nBits, nTimeTx, 600, nTimeTx - 1000, nCoinSplit, nTimeSplit, hashSplit), fFound);
+        if (fFound) {
+            nFound++;
+            BOOST_CHECK_EQUAL(nCoinSplit, nCoinSingle);
+            BOOST_CHECK_EQUAL(nTimeSplit, nTimeSingle);
+            BOOST_CHECK(hashSplit == hashSingle);
+        }
+        nTimeTx += 600;
+    }
+    BOOST_CHECK(nFound > 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "random.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -99,4 +100,345 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+template <typename name>
+static void CheckSort(CTxMemPool& pool, const std::vector<std::string>& sortedOrder)
+{
+    BOOST_CHECK_EQUAL(pool.size(), sortedOrder.size());
+    typename CTxMemPool::indexed_transaction_set::index<name>::type::iterator it = pool.mapTx.get<name>().begin();
+    int count = 0;
+    for (; it != pool.mapTx.get<name>().end(); ++it, ++count) {
+        BOOST_CHECK_EQUAL(it->GetTx().GetHash().ToString(), sortedOrder[count]);
+    }
+}
+
+static CMutableTransaction MakeTx(const std::vector<COutPoint>& vPrevouts, unsigned int nOutputs, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(vPrevouts.size());
+    for (unsigned int i = 0; i < vPrevouts.size(); i++) {
+        tx.vin[i].prevout = vPrevouts[i];
+        tx.vin[i].scriptSig = CScript() << OP_11;
+    }
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = nValue;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolPackageStatsTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A chain parent -> child -> grandchild, plus an unrelated transaction
+    CMutableTransaction txParent = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 2, 10 * COIN);
+    CMutableTransaction txChild = MakeTx(std::vector<COutPoint>(1, COutPoint(txParent.GetHash(), 0)), 1, 10 * COIN);
+    CMutableTransaction txGrandChild = MakeTx(std::vector<COutPoint>(1, COutPoint(txChild.GetHash(), 0)), 1, 10 * COIN);
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 2000, 0, 0.0, 1));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 3000, 0, 0.0, 1));
+
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter itGrandChild = pool.mapTx.find(txGrandChild.GetHash());
+    size_t nParentSize = itParent->GetTxSize(), nChildSize = itChild->GetTxSize(), nGrandChildSize = itGrandChild->GetTxSize();
+
+    BOOST_CHECK_EQUAL(itParent->GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL(itParent->GetSizeWithDescendants(), nParentSize + nChildSize + nGrandChildSize);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 6000);
+    BOOST_CHECK_EQUAL(itParent->GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetSizeWithAncestors(), nParentSize + nChildSize + nGrandChildSize);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 6000);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 2U);
+
+    // Prioritising the child changes the packages it belongs to
+    pool.PrioritiseTransaction(txChild.GetHash(), txChild.GetHash().ToString(), 0, 500);
+    BOOST_CHECK_EQUAL(itParent->GetModFeesWithDescendants(), 6500);
+    BOOST_CHECK_EQUAL(itChild->GetModifiedFee(), 2500);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 6500);
+
+    // The ancestor limits are enforced on new transactions
+    CMutableTransaction txGreatGrandChild = MakeTx(std::vector<COutPoint>(1, COutPoint(txGrandChild.GetHash(), 0)), 1, 10 * COIN);
+    CTxMemPoolEntry entry(txGreatGrandChild, 0, 0, 0.0, 1);
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 3, 1000000, 25, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 25, 1000000, 3, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry, setAncestors, 4, 1000000, 4, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3U);
+
+    // Confirming the parent leaves the child as the root of the package
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1U);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(itGrandChild->GetModFeesWithAncestors(), 5500);
+    BOOST_CHECK_EQUAL(itChild->GetCountWithDescendants(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    /* 3rd highest fee */
+    CMutableTransaction tx1 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 10.0, 1));
+
+    /* highest fee */
+    CMutableTransaction tx2 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 2 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 20000LL, 0, 9.0, 1));
+
+    /* lowest fee */
+    CMutableTransaction tx3 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 5 * COIN);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 0LL, 0, 100.0, 1));
+
+    /* 2nd highest fee */
+    CMutableTransaction tx4 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 6 * COIN);
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 15000LL, 0, 1.0, 1));
+
+    /* equal fee rate to tx1, but newer */
+    CMutableTransaction tx5 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 11 * COIN);
+    pool.addUnchecked(tx5.GetHash(), CTxMemPoolEntry(tx5, 10000LL, 1, 10.0, 1));
+    BOOST_CHECK_EQUAL(pool.size(), 5U);
+
+    std::vector<std::string> sortedOrder;
+    sortedOrder.push_back(tx3.GetHash().ToString()); // 0
+    sortedOrder.push_back(tx5.GetHash().ToString()); // 10000
+    sortedOrder.push_back(tx1.GetHash().ToString()); // 10000
+    sortedOrder.push_back(tx4.GetHash().ToString()); // 15000
+    sortedOrder.push_back(tx2.GetHash().ToString()); // 20000
+    CheckSort<descendant_score>(pool, sortedOrder);
+
+    /* low fee but with high fee child */
+    /* tx6 -> tx7 -> tx8, tx9 -> tx10 */
+    CMutableTransaction tx6 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 20 * COIN);
+    pool.addUnchecked(tx6.GetHash(), CTxMemPoolEntry(tx6, 0LL, 1, 10.0, 1));
+    BOOST_CHECK_EQUAL(pool.size(), 6U);
+    // Check that at this point, tx6 is sorted low
+    sortedOrder.insert(sortedOrder.begin(), tx6.GetHash().ToString());
+    CheckSort<descendant_score>(pool, sortedOrder);
+
+    CTxMemPool::setEntries setAncestors;
+    setAncestors.insert(pool.mapTx.find(tx6.GetHash()));
+    CMutableTransaction tx7 = MakeTx(std::vector<COutPoint>(1, COutPoint(tx6.GetHash(), 0)), 2, 10 * COIN);
+    CTxMemPoolEntry entry7(tx7, 2000000LL, 1, 10.0, 1);
+    pool.addUnchecked(tx7.GetHash(), entry7, setAncestors);
+    BOOST_CHECK_EQUAL(pool.size(), 7U);
+
+    // Now tx6 should be sorted higher (high fee child): tx7, tx6, tx2, ...
+    sortedOrder.erase(sortedOrder.begin());
+    sortedOrder.push_back(tx6.GetHash().ToString());
+    sortedOrder.push_back(tx7.GetHash().ToString());
+    CheckSort<descendant_score>(pool, sortedOrder);
+
+    /* low fee child of tx7 */
+    CMutableTransaction tx8 = MakeTx(std::vector<COutPoint>(1, COutPoint(tx7.GetHash(), 0)), 1, 10 * COIN);
+    setAncestors.insert(pool.mapTx.find(tx7.GetHash()));
+    pool.addUnchecked(tx8.GetHash(), CTxMemPoolEntry(tx8, 0LL, 2, 10.0, 1), setAncestors);
+
+    // Now tx8 should be sorted low, but tx6/tx both high
+    sortedOrder.insert(sortedOrder.begin(), tx8.GetHash().ToString());
+    CheckSort<descendant_score>(pool, sortedOrder);
+
+    /* low fee child of tx7 */
+    CMutableTransaction tx9 = MakeTx(std::vector<COutPoint>(1, COutPoint(tx7.GetHash(), 1)), 1, 1 * COIN);
+    pool.addUnchecked(tx9.GetHash(), CTxMemPoolEntry(tx9, 0LL, 3, 10.0, 1), setAncestors);
+
+    // tx9 should be sorted low
+    BOOST_CHECK_EQUAL(pool.size(), 9U);
+    sortedOrder.insert(sortedOrder.begin(), tx9.GetHash().ToString());
+    CheckSort<descendant_score>(pool, sortedOrder);
+
+    std::vector<std::string> snapshotOrder = sortedOrder;
+
+    setAncestors.insert(pool.mapTx.find(tx8.GetHash()));
+    setAncestors.insert(pool.mapTx.find(tx9.GetHash()));
+    /* tx10 depends on tx8 and tx9 and has a high fee*/
+    std::vector<COutPoint> vPrevouts;
+    vPrevouts.push_back(COutPoint(tx8.GetHash(), 0));
+    vPrevouts.push_back(COutPoint(tx9.GetHash(), 0));
+    CMutableTransaction tx10 = MakeTx(vPrevouts, 1, 10 * COIN);
+    pool.addUnchecked(tx10.GetHash(), CTxMemPoolEntry(tx10, 200000LL, 4, 10.0, 1), setAncestors);
+
+    /**
+     *  tx8 and tx9 should both now be sorted higher
+     *  Final order after tx10 is added:
+     *
+     *  tx3 = 0 (1)
+     *  tx5 = 10000 (1)
+     *  tx1 = 10000 (1)
+     *  tx4 = 15000 (1)
+     *  tx2 = 20000 (1)
+     *  tx9 = 200k (2 txs)
+     *  tx8 = 200k (2 txs)
+     *  tx10 = 200k (1 tx)
+     *  tx6 = 2.2M (5 txs)
+     *  tx7 = 2.2M (4 txs)
+     */
+    sortedOrder.erase(sortedOrder.begin(), sortedOrder.begin() + 2); // take out tx9, tx8 from the beginning
+    sortedOrder.insert(sortedOrder.begin() + 5, tx9.GetHash().ToString());
+    sortedOrder.insert(sortedOrder.begin() + 6, tx8.GetHash().ToString());
+    sortedOrder.insert(sortedOrder.begin() + 7, tx10.GetHash().ToString()); // tx10 is just before tx6
+    CheckSort<descendant_score>(pool, sortedOrder);
+
+    // there should be 10 transactions in the mempool
+    BOOST_CHECK_EQUAL(pool.size(), 10U);
+
+    // Now try removing tx10 and verify the sort order returns to normal
+    std::list<CTransaction> removed;
+    pool.remove(pool.mapTx.find(tx10.GetHash())->GetTx(), removed, true);
+    CheckSort<descendant_score>(pool, snapshotOrder);
+
+    pool.remove(pool.mapTx.find(tx9.GetHash())->GetTx(), removed, true);
+    pool.remove(pool.mapTx.find(tx8.GetHash())->GetTx(), removed, true);
+
+    /* Now check the sort on the entry time index */
+    sortedOrder.clear();
+    sortedOrder.push_back(tx1.GetHash().ToString());
+    sortedOrder.push_back(tx2.GetHash().ToString());
+    sortedOrder.push_back(tx3.GetHash().ToString());
+    sortedOrder.push_back(tx4.GetHash().ToString());
+    sortedOrder.push_back(tx5.GetHash().ToString());
+    sortedOrder.push_back(tx6.GetHash().ToString());
+    sortedOrder.push_back(tx7.GetHash().ToString());
+    // tx1-tx4 entered at time 0 and tx5-tx7 at time 1; within a time the
+    // order is insertion order
+    CheckSort<entry_time>(pool, sortedOrder);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    /* 3rd highest fee */
+    CMutableTransaction tx1 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 10.0, 1));
+
+    /* highest fee */
+    CMutableTransaction tx2 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 2 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 20000LL, 0, 9.0, 1));
+    uint64_t tx2Size = pool.mapTx.find(tx2.GetHash())->GetTxSize();
+
+    /* lowest fee */
+    CMutableTransaction tx3 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 5 * COIN);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 0LL, 0, 100.0, 1));
+
+    /* 2nd highest fee */
+    CMutableTransaction tx4 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 6 * COIN);
+    pool.addUnchecked(tx4.GetHash(), CTxMemPoolEntry(tx4, 15000LL, 0, 1.0, 1));
+
+    /* equal fee rate to tx1, but newer and with a different hash */
+    CMutableTransaction tx5 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 11 * COIN);
+    pool.addUnchecked(tx5.GetHash(), CTxMemPoolEntry(tx5, 10000LL, 1, 10.0, 1));
+    BOOST_CHECK_EQUAL(pool.size(), 5U);
+
+    std::vector<std::string> sortedOrder;
+    sortedOrder.push_back(tx2.GetHash().ToString()); // 20000
+    sortedOrder.push_back(tx4.GetHash().ToString()); // 15000
+    // tx1 and tx5 are both 10000
+    // Ties are broken by hash, not timestamp, so determine which
+    // hash comes first.
+    if (tx1.GetHash() < tx5.GetHash()) {
+        sortedOrder.push_back(tx1.GetHash().ToString());
+        sortedOrder.push_back(tx5.GetHash().ToString());
+    } else {
+        sortedOrder.push_back(tx5.GetHash().ToString());
+        sortedOrder.push_back(tx1.GetHash().ToString());
+    }
+    sortedOrder.push_back(tx3.GetHash().ToString()); // 0
+
+    CheckSort<ancestor_score>(pool, sortedOrder);
+
+    /* low fee parent with high fee child */
+    /* tx6 (0) -> tx7 (high) */
+    CMutableTransaction tx6 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 20 * COIN);
+    pool.addUnchecked(tx6.GetHash(), CTxMemPoolEntry(tx6, 0LL, 1, 10.0, 1));
+    uint64_t tx6Size = pool.mapTx.find(tx6.GetHash())->GetTxSize();
+    BOOST_CHECK_EQUAL(pool.size(), 6U);
+    // Ties are broken by hash
+    if (tx3.GetHash() < tx6.GetHash())
+        sortedOrder.push_back(tx6.GetHash().ToString());
+    else
+        sortedOrder.insert(sortedOrder.end() - 1, tx6.GetHash().ToString());
+    CheckSort<ancestor_score>(pool, sortedOrder);
+
+    CMutableTransaction tx7 = MakeTx(std::vector<COutPoint>(1, COutPoint(tx6.GetHash(), 0)), 1, 10 * COIN);
+    uint64_t tx7Size = ::GetSerializeSize(tx7, SER_NETWORK, PROTOCOL_VERSION);
+
+    /* set the fee to just below tx2's feerate when including ancestor */
+    CAmount fee = (20000 / tx2Size) * (tx7Size + tx6Size) - 1;
+
+    pool.addUnchecked(tx7.GetHash(), CTxMemPoolEntry(tx7, fee, 2, 10.0, 1));
+    BOOST_CHECK_EQUAL(pool.size(), 7U);
+    sortedOrder.insert(sortedOrder.begin() + 1, tx7.GetHash().ToString());
+    CheckSort<ancestor_score>(pool, sortedOrder);
+
+    /* after tx6 is mined, tx7 should move up in the sort */
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx6);
+    std::list<CTransaction> dummy;
+    pool.removeForBlock(vtx, 1, dummy);
+
+    sortedOrder.erase(sortedOrder.begin() + 1);
+    // Ties are broken by hash
+    if (tx3.GetHash() < tx6.GetHash())
+        sortedOrder.pop_back();
+    else
+        sortedOrder.erase(sortedOrder.end() - 2);
+    sortedOrder.insert(sortedOrder.begin(), tx7.GetHash().ToString());
+    CheckSort<ancestor_score>(pool, sortedOrder);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx1 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 10 * COIN);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 10.0, 1));
+
+    CMutableTransaction tx2 = MakeTx(std::vector<COutPoint>(1, COutPoint(GetRandHash(), 0)), 1, 10 * COIN);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 10.0, 1));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage()); // should do nothing
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // should remove the lower-feerate transaction
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 10.0, 1));
+    CMutableTransaction tx3 = MakeTx(std::vector<COutPoint>(1, COutPoint(tx2.GetHash(), 0)), 1, 10 * COIN);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 20000LL, 0, 10.0, 1));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // tx3 should pay for tx2 (CPFP)
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+
+    pool.TrimToSize(::GetSerializeSize(CTransaction(tx1), SER_NETWORK, PROTOCOL_VERSION)); // mempool is limited to tx1's size in memory usage, so nothing fits
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+
+    // The rolling minimum fee is the feerate of the evicted package plus the minimum relay fee
+    CFeeRate maxFeeRateRemoved(25000, ::GetSerializeSize(CTransaction(tx3), SER_NETWORK, PROTOCOL_VERSION) + ::GetSerializeSize(CTransaction(tx2), SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
+
+    // Entries older than the expiry time go, along with their descendants
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 100, 10.0, 1));
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 20000LL, 200, 10.0, 1));
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 300, 10.0, 1));
+    BOOST_CHECK_EQUAL(pool.Expire(50), 0);
+    BOOST_CHECK_EQUAL(pool.Expire(150), 2);
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
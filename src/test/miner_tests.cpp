@@ -202,6 +202,31 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     delete pblocktemplate;
     mempool.clear();
 
+    // a parent paying no fee goes in with the child that pays for both,
+    // while a transaction paying less than the relay fee stays out
+    mapArgs["-blockprioritysize"] = "0";
+    tx.vin[0].prevout.hash = txFirst[0]->GetHash();
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout[0].nValue = 4900000000LL;
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    uint256 hashParent = tx.GetHash();
+    mempool.addUnchecked(hashParent, CTxMemPoolEntry(tx, 0, GetTime(), 111.0, 11));
+    tx.vin[0].prevout.hash = hashParent;
+    tx.vout[0].nValue = 4890000000LL;
+    uint256 hashChild = tx.GetHash();
+    mempool.addUnchecked(hashChild, CTxMemPoolEntry(tx, 10000000LL, GetTime(), 111.0, 11));
+    tx.vin[0].prevout.hash = txFirst[1]->GetHash();
+    tx.vout[0].nValue = 4900000000LL;
+    hash = tx.GetHash();
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, pwalletMain, false));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == hashParent);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == hashChild);
+    delete pblocktemplate;
+    mapArgs.erase("-blockprioritysize");
+    mempool.clear();
+
     // subsidy changing
     int nHeight = chainActive.Height();
     chainActive.Tip()->nHeight = 209999;
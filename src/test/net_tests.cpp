@@ -0,0 +1,371 @@
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "test_alqo.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+boost::mutex mutexRecorded;
+std::set<NodeId> setServing;
+std::map<NodeId, std::vector<int64_t> > mapProcessed;
+std::atomic<int> nActive(0);
+std::atomic<int> nMaxActive(0);
+std::atomic<int> nProcessed(0);
+std::atomic<bool> fOverlap(false);
+
+/** Process one message of the node, recording its sequence number and the threads busy at the same time */
+bool RecordProcessMessages(CNode* pnode)
+{
+    if (pnode->vRecvMsg.empty())
+        return true;
+    {
+        boost::lock_guard<boost::mutex> lock(mutexRecorded);
+        if (!setServing.insert(pnode->id).second)
+            fOverlap = true;
+    }
+    int nNowActive = ++nActive;
+    int nMax = nMaxActive;
+    while (nNowActive > nMax && !nMaxActive.compare_exchange_weak(nMax, nNowActive)) {
+    }
+    MilliSleep(5);
+    int64_t nSequence = pnode->vRecvMsg.front().nTime;
+    pnode->vRecvMsg.pop_front();
+    --nActive;
+    {
+        boost::lock_guard<boost::mutex> lock(mutexRecorded);
+        mapProcessed[pnode->id].push_back(nSequence);
+        setServing.erase(pnode->id);
+    }
+    nProcessed++;
+    return true;
+}
+
+/** A tx message on the wire with a payload of about nSize bytes */
+CSerializedMessageRef MakeWireMessage(size_t nSize, unsigned char chSeed)
+{
+    std::vector<unsigned char> vPayload(nSize);
+    for (size_t i = 0; i < nSize; i++)
+        vPayload[i] = (unsigned char)(chSeed + i * 7);
+    return MakeSerializedMessage("tx", vPayload);
+}
+
+/** Check that msg was received completely and matches the wire message */
+void CheckReceivedMessage(const CNetMessage& msg, const CSerializeData& wire)
+{
+    BOOST_REQUIRE(msg.complete());
+    BOOST_CHECK(msg.hdr.IsValid());
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "tx");
+    BOOST_CHECK_EQUAL(msg.hdr.nMessageSize, wire.size() - CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK_EQUAL(msg.nDataPos, msg.hdr.nMessageSize);
+    BOOST_REQUIRE_EQUAL(msg.vRecv.size(), wire.size() - CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK(std::equal(msg.vRecv.begin(), msg.vRecv.end(), wire.begin() + CMessageHeader::HEADER_SIZE));
+
+    // The hash fed as the bytes arrived is the one of the whole payload, and matches the checksum
+    BOOST_CHECK(msg.GetMessageHash() == Hash(wire.begin() + CMessageHeader::HEADER_SIZE, wire.end()));
+    BOOST_CHECK(memcmp(msg.GetMessageHash().begin(), &msg.hdr.nChecksum, sizeof(msg.hdr.nChecksum)) == 0);
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(message_handler_threads)
+{
+    const int nNodes = 8;
+    const int nMessages = 5;
+    GetNodeSignals().ProcessMessages.connect(&RecordProcessMessages);
+
+    std::vector<CNode*> vTestNodes;
+    for (int i = 0; i < nNodes; i++) {
+        CNode* pnode = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+        for (int n = 0; n < nMessages; n++) {
+            pnode->vRecvMsg.emplace_back(SER_NETWORK, PROTOCOL_VERSION);
+            CNetMessage& msg = pnode->vRecvMsg.back();
+            msg.in_data = true;
+            msg.hdr.nMessageSize = 0;
+            msg.nTime = n;
+        }
+        vTestNodes.push_back(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        vNodes.insert(vNodes.end(), vTestNodes.begin(), vTestNodes.end());
+    }
+
+    boost::thread_group threadGroup;
+    StartMessageHandlerThreads(threadGroup, 4);
+    for (int i = 0; i < 1000 && nProcessed < nNodes * nMessages; i++)
+        MilliSleep(10);
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    {
+        LOCK(cs_vNodes);
+        vNodes.clear();
+    }
+    GetNodeSignals().ProcessMessages.disconnect(&RecordProcessMessages);
+
+    // Every message got processed once, in order, and no node by two threads at a time
+    BOOST_CHECK_EQUAL(nProcessed, nNodes * nMessages);
+    BOOST_CHECK(!fOverlap);
+    for (CNode* pnode : vTestNodes) {
+        const std::vector<int64_t>& vSequence = mapProcessed[pnode->id];
+        BOOST_CHECK_EQUAL(vSequence.size(), nMessages);
+        for (size_t n = 0; n < vSequence.size(); n++)
+            BOOST_CHECK_EQUAL(vSequence[n], n);
+    }
+    // Different nodes were served in parallel
+    BOOST_CHECK(nMaxActive > 1);
+
+    for (CNode* pnode : vTestNodes)
+        delete pnode;
+}
+
+BOOST_AUTO_TEST_CASE(message_lanes)
+{
+    CCriticalSection* pcsCore = GetMessageLane("block");
+    BOOST_CHECK(pcsCore != NULL);
+    const char* vCoreCommands[] = {"tx", "inv", "getdata", "headers", "cmpctblock", "ix", "dstx"};
+    for (const char* strCommand : vCoreCommands)
+        BOOST_CHECK(GetMessageLane(strCommand) == pcsCore);
+
+    // Masternode, spork and budget messages don't wait behind validation
+    CCriticalSection* pcsExtension = GetMessageLane("mnb");
+    BOOST_CHECK(pcsExtension != NULL);
+    BOOST_CHECK(pcsExtension != pcsCore);
+    const char* vExtensionCommands[] = {"mnp", "mnw", "mnget", "dseg", "mvote", "mprop", "fbs", "fbvote", "spork", "getsporks", "ssc"};
+    for (const char* strCommand : vExtensionCommands)
+        BOOST_CHECK(GetMessageLane(strCommand) == pcsExtension);
+
+    // ping and pong only touch the peer
+    BOOST_CHECK(GetMessageLane("ping") == NULL);
+    BOOST_CHECK(GetMessageLane("pong") == NULL);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(socket_send_data_partial)
+{
+    // A small send buffer makes sendmsg take only part of the queue at a time
+    int vSockets[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, vSockets) == 0);
+    int nBufferSize = 4096;
+    setsockopt(vSockets[0], SOL_SOCKET, SO_SNDBUF, &nBufferSize, sizeof(nBufferSize));
+    setsockopt(vSockets[1], SOL_SOCKET, SO_RCVBUF, &nBufferSize, sizeof(nBufferSize));
+
+    CNode node(vSockets[0], CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+    std::vector<CSerializedMessageRef> vMessages;
+    std::vector<char> vExpected;
+    for (size_t nSize : {30000, 70001, 12345}) {
+        std::shared_ptr<CSerializeData> pdata = std::make_shared<CSerializeData>(nSize);
+        for (size_t i = 0; i < nSize; i++)
+            (*pdata)[i] = (char)(vExpected.size() + i);
+        vExpected.insert(vExpected.end(), pdata->begin(), pdata->end());
+        vMessages.push_back(pdata);
+    }
+    {
+        LOCK(node.cs_vSend);
+        for (const CSerializedMessageRef& msg : vMessages) {
+            node.vSendMsg.push_back(msg);
+            node.nSendSize += msg->size();
+        }
+    }
+
+    std::vector<char> vReceived;
+    bool fPartial = false;
+    for (int n = 0; n < 10000 && vReceived.size() < vExpected.size(); n++) {
+        {
+            LOCK(node.cs_vSend);
+            SocketSendData(&node);
+
+            // Fully sent messages leave the queue, the first one left is sent up to nSendOffset
+            size_t nQueued = 0;
+            for (const CSerializedMessageRef& msg : node.vSendMsg)
+                nQueued += msg->size();
+            BOOST_CHECK_EQUAL(node.nSendSize, nQueued);
+            if (node.vSendMsg.empty())
+                BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+            else
+                BOOST_CHECK(node.nSendOffset < node.vSendMsg.front()->size());
+            BOOST_CHECK_EQUAL(node.nSendBytes + node.nSendSize - node.nSendOffset, vExpected.size());
+            if (node.nSendOffset != 0)
+                fPartial = true;
+        }
+        char buf[8192];
+        ssize_t nRead;
+        while ((nRead = recv(vSockets[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            vReceived.insert(vReceived.end(), buf, buf + nRead);
+    }
+
+    BOOST_CHECK(fPartial);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+    BOOST_CHECK(vReceived == vExpected);
+    // The queue let go of the messages, their other holders keep them
+    for (const CSerializedMessageRef& msg : vMessages)
+        BOOST_CHECK_EQUAL(msg.use_count(), 1);
+    close(vSockets[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(receive_msg_bytes_chunking)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+    CSerializedMessageRef pwire = MakeWireMessage(1000, 1);
+    const CSerializeData& wire = *pwire;
+    LOCK(node.cs_vRecvMsg);
+
+    // One byte at a time
+    for (size_t i = 0; i < wire.size(); i++) {
+        BOOST_CHECK(node.ReceiveMsgBytes(&wire[i], 1));
+        BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+        BOOST_CHECK_EQUAL(node.vRecvMsg.back().complete(), i + 1 == wire.size());
+    }
+    CheckReceivedMessage(node.vRecvMsg.front(), wire);
+    node.vRecvMsg.clear();
+
+    // All at once
+    BOOST_CHECK(node.ReceiveMsgBytes(&wire[0], wire.size()));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    CheckReceivedMessage(node.vRecvMsg.front(), wire);
+    node.vRecvMsg.clear();
+
+    // Two messages back to back in one chunk
+    CSerializedMessageRef pwire2 = MakeWireMessage(300, 2);
+    CSerializeData vBoth(wire);
+    vBoth.insert(vBoth.end(), pwire2->begin(), pwire2->end());
+    BOOST_CHECK(node.ReceiveMsgBytes(&vBoth[0], vBoth.size()));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 2U);
+    CheckReceivedMessage(node.vRecvMsg.front(), wire);
+    CheckReceivedMessage(node.vRecvMsg.back(), *pwire2);
+    node.vRecvMsg.clear();
+}
+
+BOOST_AUTO_TEST_CASE(receive_msg_bytes_split_header)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+    CSerializedMessageRef pwire = MakeWireMessage(200, 3);
+    const CSerializeData& wire = *pwire;
+    LOCK(node.cs_vRecvMsg);
+
+    // The first part of the header is gathered in pchHdr
+    BOOST_CHECK(node.ReceiveMsgBytes(&wire[0], 10));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    const CNetMessage& msg = node.vRecvMsg.front();
+    BOOST_CHECK(!msg.in_data);
+    BOOST_CHECK_EQUAL(msg.nHdrPos, 10U);
+    BOOST_CHECK(memcmp(msg.pchHdr, &wire[0], 10) == 0);
+
+    // The rest of it, along with part of the payload
+    BOOST_CHECK(node.ReceiveMsgBytes(&wire[10], CMessageHeader::HEADER_SIZE + 50 - 10));
+    BOOST_CHECK(msg.in_data);
+    BOOST_CHECK_EQUAL(msg.nHdrPos, (unsigned int)CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK(memcmp(msg.pchHdr, &wire[0], CMessageHeader::HEADER_SIZE) == 0);
+    BOOST_CHECK_EQUAL(msg.hdr.nMessageSize, wire.size() - CMessageHeader::HEADER_SIZE);
+    BOOST_CHECK_EQUAL(msg.nDataPos, 50U);
+    BOOST_CHECK(!msg.complete());
+
+    BOOST_CHECK(node.ReceiveMsgBytes(&wire[CMessageHeader::HEADER_SIZE + 50], wire.size() - CMessageHeader::HEADER_SIZE - 50));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    CheckReceivedMessage(msg, wire);
+    node.vRecvMsg.clear();
+}
+
+BOOST_AUTO_TEST_CASE(receive_msg_bytes_buffer_pool)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // A payload gets the smallest buffer class that fits it
+    const size_t vClasses[][2] = {{100, 512}, {3000, 4 * 1024}, {20000, 32 * 1024}, {200000, 256 * 1024}};
+    for (const size_t* vCase : vClasses) {
+        CSerializedMessageRef pwire = MakeWireMessage(vCase[0], 4);
+        BOOST_CHECK(node.ReceiveMsgBytes(&(*pwire)[0], pwire->size()));
+        BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+        CheckReceivedMessage(node.vRecvMsg.front(), *pwire);
+        BOOST_CHECK_EQUAL(node.vRecvMsg.front().vRecv.capacity(), vCase[1]);
+        node.vRecvMsg.clear();
+    }
+
+    // A released buffer serves the next message of its class
+    CSerializedMessageRef pwireSmall = MakeWireMessage(100, 5);
+    BOOST_CHECK(node.ReceiveMsgBytes(&(*pwireSmall)[0], pwireSmall->size()));
+    const char* pchBuffer = &node.vRecvMsg.front().vRecv[0];
+    node.vRecvMsg.clear();
+    CSerializedMessageRef pwireSmall2 = MakeWireMessage(200, 6);
+    BOOST_CHECK(node.ReceiveMsgBytes(&(*pwireSmall2)[0], pwireSmall2->size()));
+    BOOST_CHECK(&node.vRecvMsg.front().vRecv[0] == pchBuffer);
+    CheckReceivedMessage(node.vRecvMsg.front(), *pwireSmall2);
+    node.vRecvMsg.clear();
+
+    // A payload larger than the biggest class grows its buffer as it arrives
+    CSerializedMessageRef pwireLarge = MakeWireMessage(600000, 7);
+    for (size_t nPos = 0; nPos < pwireLarge->size(); nPos += 65536)
+        BOOST_CHECK(node.ReceiveMsgBytes(&(*pwireLarge)[nPos], std::min<size_t>(65536, pwireLarge->size() - nPos)));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    CheckReceivedMessage(node.vRecvMsg.front(), *pwireLarge);
+    BOOST_CHECK(node.vRecvMsg.front().vRecv.capacity() >= pwireLarge->size() - CMessageHeader::HEADER_SIZE);
+    node.vRecvMsg.clear();
+}
+
+BOOST_AUTO_TEST_CASE(msg_stats_process_time_buckets)
+{
+    // Buckets start at 0 and grow tenfold from 100us, the last one takes everything longer
+    const int64_t vBoundaries[][2] = {
+        {0, 0}, {99, 0}, {100, 1}, {999, 1}, {1000, 2}, {9999, 2}, {10000, 3},
+        {99999, 3}, {100000, 4}, {999999, 4}, {1000000, 5}, {3600000000LL, 5}};
+    for (const int64_t* vCase : vBoundaries) {
+        CNetMsgStats stats;
+        stats.RecordRecv(24, vCase[0]);
+        for (int n = 0; n < CNetMsgStats::PROCESS_TIME_BUCKETS; n++)
+            BOOST_CHECK_EQUAL(stats.vProcessTime[n], n == vCase[1] ? 1U : 0U);
+    }
+
+    CNetMsgStats stats;
+    stats.RecordRecv(30, 150);
+    stats.RecordRecv(50, 20000);
+    BOOST_CHECK_EQUAL(stats.nMsgsRecv, 2U);
+    BOOST_CHECK_EQUAL(stats.nBytesRecv, 80U);
+    BOOST_CHECK_EQUAL(stats.nProcessUsec, 20150);
+    BOOST_CHECK_EQUAL(stats.nMaxProcessUsec, 20000);
+}
+
+BOOST_AUTO_TEST_CASE(msg_stats_other_commands)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+    node.RecordMsgRecv("inv", 61, 10);
+    node.RecordMsgRecv("inv", 97, 10);
+    node.RecordMsgSend("getdata", 61);
+
+    // Commands outside GetAllNetMessageTypes() are all folded into one entry
+    node.RecordMsgRecv("nonsense", 30, 10);
+    node.RecordMsgRecv(std::string("inv\0\0", 5), 30, 10);
+    node.RecordMsgSend("made-up", 40);
+
+    LOCK(node.cs_msgStats);
+    BOOST_CHECK_EQUAL(node.mapMsgStats.size(), 3U);
+    BOOST_CHECK_EQUAL(node.mapMsgStats["inv"].nMsgsRecv, 2U);
+    BOOST_CHECK_EQUAL(node.mapMsgStats["inv"].nBytesRecv, 158U);
+    BOOST_CHECK_EQUAL(node.mapMsgStats["getdata"].nMsgsSent, 1U);
+    const CNetMsgStats& other = node.mapMsgStats[NET_MESSAGE_COMMAND_OTHER];
+    BOOST_CHECK_EQUAL(other.nMsgsRecv, 2U);
+    BOOST_CHECK_EQUAL(other.nBytesRecv, 60U);
+    BOOST_CHECK_EQUAL(other.nMsgsSent, 1U);
+    BOOST_CHECK_EQUAL(other.nBytesSent, 40U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,223 @@
+// Copyright (c) 2011-2015 The Bitcoin Core developers
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "clientversion.h"
+#include "policy/fees.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "uint256.h"
+#include "util.h"
+#include "test_alqo.h"
+
+#include <stdio.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(policyestimator_tests, BasicTestingSetup)
+
+static void AddTxs(CTxMemPool& mpool, CMutableTransaction& tx, const std::vector<CAmount>& feeV, int blocknum, std::vector<uint256> txHashes[])
+{
+    for (unsigned int j = 0; j < feeV.size(); j++) { // For each fee
+        for (int k = 0; k < 4; k++) {                // add 4 fee txs
+            tx.vin[0].prevout.n = 10000 * blocknum + 100 * j + k; // make transaction unique
+            uint256 hash = tx.GetHash();
+            mpool.addUnchecked(hash, CTxMemPoolEntry(tx, feeV[j], GetTime(), 0.0, blocknum));
+            txHashes[j].push_back(hash);
+        }
+    }
+}
+
+static void MineTxs(CTxMemPool& mpool, std::vector<uint256>& txHashes, std::vector<CTransaction>& block)
+{
+    while (txHashes.size()) {
+        CTransaction tx;
+        if (mpool.lookup(txHashes.back(), tx))
+            block.push_back(tx);
+        txHashes.pop_back();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    std::list<CTransaction> dummyConflicted;
+    CAmount basefee(2000);
+    CAmount deltaFee(100);
+    std::vector<CAmount> feeV;
+
+    // Populate vectors of increasing fees
+    for (int j = 0; j < 10; j++)
+        feeV.push_back(basefee * (j + 1));
+
+    // Store the hashes of transactions that have been
+    // added to the mempool by their associate fee
+    // txHashes[j] is populated with transactions either of
+    // fee = basefee * (j+1)
+    std::vector<uint256> txHashes[10];
+
+    // Create a transaction template
+    CScript garbage;
+    for (unsigned int i = 0; i < 128; i++)
+        garbage.push_back('X');
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = garbage;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+    CFeeRate baseRate(basefee, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION));
+
+    std::vector<CTransaction> block;
+    int blocknum = 0;
+
+    // Loop through 200 blocks
+    // At a decay .9952 and 4 fee transactions per block
+    // This makes the tx count about 2.5 per bucket, well above the 0.1 threshold
+    while (blocknum < 200) {
+        AddTxs(mpool, tx, feeV, blocknum, txHashes);
+        // Create blocks where higher fee txs are included more often
+        for (int h = 0; h <= blocknum % 10; h++) {
+            // 10/10 blocks add highest fee transactions
+            // 9/10 blocks add 2nd highest and so on until ...
+            // 1/10 blocks add lowest fee transactions
+            MineTxs(mpool, txHashes[9 - h], block);
+        }
+        mpool.removeForBlock(block, ++blocknum, dummyConflicted);
+        block.clear();
+        // Check after just a few txs that combining buckets works as expected
+        if (blocknum == 3) {
+            // At this point we should need to combine 3 buckets to get enough data points
+            // So estimateFee(1) should fail and estimateFee(2) should return somewhere around
+            // 9*baserate.  estimateFee(2) %'s are 100,100,90 = average 97%
+            BOOST_CHECK(mpool.estimateFee(1) == CFeeRate(0));
+            BOOST_CHECK(mpool.estimateFee(2).GetFeePerK() < 9 * baseRate.GetFeePerK() + deltaFee);
+            BOOST_CHECK(mpool.estimateFee(2).GetFeePerK() > 9 * baseRate.GetFeePerK() - deltaFee);
+        }
+    }
+
+    std::vector<CAmount> origFeeEst;
+    // Highest feerate is 10*baseRate and gets in all blocks,
+    // second highest feerate is 9*baseRate and gets in 9/10 blocks = 90%,
+    // third highest feerate is 8*base rate, and gets in 8/10 blocks = 80%,
+    // so estimateFee(1) would return 10*baseRate but is hardcoded to return failure
+    // Second highest feerate has 100% chance of being included by 2 blocks,
+    // so estimateFee(2) should return 9*baseRate etc...
+    for (int i = 1; i < 10; i++) {
+        origFeeEst.push_back(mpool.estimateFee(i).GetFeePerK());
+        if (i > 2) { // Fee estimates should be monotonically decreasing
+            BOOST_CHECK(origFeeEst[i - 1] <= origFeeEst[i - 2]);
+        }
+        int mult = 11 - i;
+        if (i % 2 == 0) { // At scale 2, test logic is only correct for even targets
+            BOOST_CHECK(origFeeEst[i - 1] < mult * baseRate.GetFeePerK() + deltaFee);
+            BOOST_CHECK(origFeeEst[i - 1] > mult * baseRate.GetFeePerK() - deltaFee);
+        }
+    }
+
+    // The smart estimate answers a target of 1 with the estimate for 2, and
+    // an economical estimate is never above a conservative one
+    BOOST_CHECK(mpool.estimateSmartFee(1) == mpool.estimateSmartFee(2));
+    BOOST_CHECK(mpool.estimateSmartFee(1) > CFeeRate(0));
+    for (int i = 1; i < 10; i++)
+        BOOST_CHECK(mpool.estimateSmartFee(i, NULL, false) <= mpool.estimateSmartFee(i, NULL, true));
+
+    // Mine 50 more blocks with no transactions happening, estimates shouldn't change
+    // We haven't decayed the moving average enough so we still have enough data points in every bucket
+    while (blocknum < 250)
+        mpool.removeForBlock(block, ++blocknum, dummyConflicted);
+
+    BOOST_CHECK(mpool.estimateFee(1) == CFeeRate(0));
+    for (int i = 2; i < 10; i++) {
+        BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() < origFeeEst[i - 1] + deltaFee);
+        BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() > origFeeEst[i - 1] - deltaFee);
+    }
+
+    // Mine 15 more blocks with lots of transactions happening and not getting mined
+    // Estimates should go up
+    while (blocknum < 265) {
+        AddTxs(mpool, tx, feeV, blocknum, txHashes);
+        mpool.removeForBlock(block, ++blocknum, dummyConflicted);
+    }
+
+    for (int i = 1; i < 10; i++) {
+        BOOST_CHECK(mpool.estimateFee(i) == CFeeRate(0) || mpool.estimateFee(i).GetFeePerK() > origFeeEst[i - 1] - deltaFee);
+    }
+
+    // Mine all those transactions
+    // Estimates should still not be below original
+    for (int j = 0; j < 10; j++)
+        MineTxs(mpool, txHashes[j], block);
+    mpool.removeForBlock(block, 266, dummyConflicted);
+    block.clear();
+    BOOST_CHECK(mpool.estimateFee(1) == CFeeRate(0));
+    for (int i = 2; i < 10; i++) {
+        BOOST_CHECK(mpool.estimateFee(i) == CFeeRate(0) || mpool.estimateFee(i).GetFeePerK() > origFeeEst[i - 1] - deltaFee);
+    }
+
+    // Mine 400 more blocks where everything is mined every block
+    // Estimates should be below original estimates
+    while (blocknum < 665) {
+        AddTxs(mpool, tx, feeV, blocknum, txHashes);
+        for (int j = 0; j < 10; j++)
+            MineTxs(mpool, txHashes[j], block);
+        mpool.removeForBlock(block, ++blocknum, dummyConflicted);
+        block.clear();
+    }
+    BOOST_CHECK(mpool.estimateFee(1) == CFeeRate(0));
+    for (int i = 2; i < 9; i++) { // At 9, the original estimate was already at the bottom (b/c scale = 2)
+        BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() < origFeeEst[i - 1] - deltaFee);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesPersist)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    std::list<CTransaction> dummyConflicted;
+    std::vector<CAmount> feeV;
+    for (int j = 0; j < 10; j++)
+        feeV.push_back(2000 * (j + 1));
+    std::vector<uint256> txHashes[10];
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+
+    std::vector<CTransaction> block;
+    int blocknum = 0;
+    while (blocknum < 100) {
+        AddTxs(mpool, tx, feeV, blocknum, txHashes);
+        for (int h = 0; h <= blocknum % 10; h++)
+            MineTxs(mpool, txHashes[9 - h], block);
+        mpool.removeForBlock(block, ++blocknum, dummyConflicted);
+        block.clear();
+    }
+    // Mine what is left, unconfirmed transactions aren't saved
+    for (int j = 0; j < 10; j++)
+        MineTxs(mpool, txHashes[j], block);
+    mpool.removeForBlock(block, ++blocknum, dummyConflicted);
+    BOOST_CHECK(mpool.estimateSmartFee(2) > CFeeRate(0));
+
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file != NULL);
+    {
+        CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(mpool.WriteFeeEstimates(fileout));
+        fflush(file);
+        rewind(file);
+        fileout.release();
+    }
+
+    // A restarted node answers the same as before
+    CTxMemPool restarted(CFeeRate(1000));
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(restarted.ReadFeeEstimates(filein));
+    for (int i = 1; i < 20; i++) {
+        BOOST_CHECK(restarted.estimateFee(i) == mpool.estimateFee(i));
+        BOOST_CHECK(restarted.estimateSmartFee(i) == mpool.estimateSmartFee(i));
+        BOOST_CHECK(restarted.estimateSmartFee(i, NULL, false) == mpool.estimateSmartFee(i, NULL, false));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
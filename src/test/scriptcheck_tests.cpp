@@ -0,0 +1,261 @@
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+#include "key.h"
+#include "main.h"
+#include "script/interpreter.h"
+#include "script/script.h"
+#include "script/standard.h"
+#include "test_alqo.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(scriptcheck_tests, BasicTestingSetup)
+
+static const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
+
+static std::vector<unsigned char> Sign(const CKey& key, const CScript& scriptCode, const CTransaction& tx, unsigned int nIn)
+{
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(SignatureHash(scriptCode, tx, nIn, SIGHASH_ALL), vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    return vchSig;
+}
+
+/** Build a transaction spending one pay-to-pubkey output per entry of vScripts, signed by vKeys */
+static CTransaction SpendP2PK(const std::vector<CScript>& vScripts, const std::vector<CKey>& vKeys)
+{
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(vScripts.size());
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txFrom.vout[i].scriptPubKey = vScripts[i];
+
+    CMutableTransaction txTo;
+    txTo.vin.resize(vScripts.size());
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txTo.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txTo.vin[i].scriptSig << Sign(vKeys[i], vScripts[i], txTo, i);
+    return txTo;
+}
+
+static std::vector<CScriptCheck> MakeChecks(const std::vector<CScript>& vScripts, const CTransaction& tx)
+{
+    std::vector<CScriptCheck> vChecks;
+    for (unsigned int i = 0; i < vScripts.size(); i++) {
+        vChecks.push_back(CScriptCheck());
+        CScriptCheck check(vScripts[i], tx, i, flags, false);
+        check.swap(vChecks.back());
+    }
+    return vChecks;
+}
+
+BOOST_AUTO_TEST_CASE(scriptcheck_batch)
+{
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(true);
+
+    std::vector<CScript> vScripts;
+    std::vector<CKey> vKeys;
+    for (int i = 0; i < 6; i++) {
+        vScripts.push_back(CScript() << ToByteVector(key[i % 3].GetPubKey()) << OP_CHECKSIG);
+        vKeys.push_back(key[i % 3]);
+    }
+    CTransaction tx = SpendP2PK(vScripts, vKeys);
+    std::vector<CScriptCheck> vChecks = MakeChecks(vScripts, tx);
+    BOOST_CHECK(RunChecks(vChecks));
+
+    // A signature by the wrong key fails the batch, and with it the block's scripts
+    vKeys[4] = key[0];
+    tx = SpendP2PK(vScripts, vKeys);
+    vChecks = MakeChecks(vScripts, tx);
+    BOOST_CHECK(!RunChecks(vChecks));
+}
+
+BOOST_AUTO_TEST_CASE(scriptcheck_batch_expected_failure)
+{
+    CKey key[2];
+    for (int i = 0; i < 2; i++)
+        key[i].MakeNewKey(true);
+
+    // A script that requires its signature check to fail, and a 1-of-2
+    // multisig signed by the second key, which fails against the first
+    std::vector<CScript> vScripts;
+    vScripts.push_back(CScript() << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG << OP_NOT);
+    vScripts.push_back(CScript() << OP_1 << ToByteVector(key[0].GetPubKey()) << ToByteVector(key[1].GetPubKey()) << OP_2 << OP_CHECKMULTISIG);
+    vScripts.push_back(CScript() << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG);
+
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(vScripts.size());
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txFrom.vout[i].scriptPubKey = vScripts[i];
+    CMutableTransaction txTo;
+    txTo.vin.resize(vScripts.size());
+    txTo.vout.resize(1);
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txTo.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+    txTo.vin[0].scriptSig << Sign(key[1], vScripts[0], txTo, 0);
+    txTo.vin[1].scriptSig << OP_0 << Sign(key[1], vScripts[1], txTo, 1);
+    txTo.vin[2].scriptSig << Sign(key[1], vScripts[2], txTo, 2);
+    CTransaction tx(txTo);
+
+    std::vector<CScriptCheck> vChecks = MakeChecks(vScripts, tx);
+    BOOST_CHECK(RunChecks(vChecks));
+}
+
+BOOST_FIXTURE_TEST_CASE(scriptcheck_execution_cache, TestingSetup)
+{
+    CKey key[2];
+    for (int i = 0; i < 2; i++)
+        key[i].MakeNewKey(true);
+
+    std::vector<CScript> vScripts(1, CScript() << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG);
+    CTransaction tx = SpendP2PK(vScripts, std::vector<CKey>(1, key[0]));
+
+    LOCK(cs_main);
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    view.SetBestBlock(chainActive.Tip()->GetBlockHash());
+    view.AddCoin(tx.vin[0].prevout, Coin(CTxOut(1, vScripts[0]), 1, false, false), false);
+
+    // A view where the same input pays to another key, so the signature doesn't verify
+    CCoinsViewCache viewBad(&dummy);
+    viewBad.SetBestBlock(chainActive.Tip()->GetBlockHash());
+    viewBad.AddCoin(tx.vin[0].prevout, Coin(CTxOut(1, CScript() << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG), 1, false, false), false);
+
+    CValidationState state;
+    BOOST_CHECK(!CheckInputs(tx, state, viewBad, true, flags, true));
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, false));
+
+    // Nothing was stored without cacheStore, so the bad view still fails
+    BOOST_CHECK(!CheckInputs(tx, state, viewBad, true, flags, true));
+
+    // Once stored, a hit skips script execution for the same transaction and flags
+    BOOST_CHECK(CheckInputs(tx, state, view, true, flags, true));
+    BOOST_CHECK(CheckInputs(tx, state, viewBad, true, flags, true));
+
+    // The flags are part of the key: other flags execute the scripts again
+    BOOST_CHECK(!CheckInputs(tx, state, viewBad, true, SCRIPT_VERIFY_P2SH, true));
+    BOOST_CHECK(CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH, true));
+}
+
+BOOST_AUTO_TEST_CASE(scriptcheck_batch_invalid_signature)
+{
+    CKey key[4];
+    for (int i = 0; i < 4; i++)
+        key[i].MakeNewKey(i % 2 == 0);
+
+    // Pay-to-pubkey-hash inputs, all of which go into the batch
+    std::vector<CScript> vScripts;
+    for (int i = 0; i < 8; i++)
+        vScripts.push_back(GetScriptForDestination(key[i % 4].GetPubKey().GetID()));
+
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(vScripts.size());
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txFrom.vout[i].scriptPubKey = vScripts[i];
+    CMutableTransaction txTo;
+    txTo.vin.resize(vScripts.size());
+    txTo.vout.resize(1);
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txTo.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txTo.vin[i].scriptSig << Sign(key[i % 4], vScripts[i], txTo, i) << ToByteVector(key[i % 4].GetPubKey());
+
+    CTransaction tx(txTo);
+    std::vector<CScriptCheck> vChecks = MakeChecks(vScripts, tx);
+    BOOST_CHECK(RunChecks(vChecks));
+
+    // A well-formed signature by the right key over the wrong input
+    txTo.vin[5].scriptSig = CScript() << Sign(key[1], vScripts[5], txTo, 1) << ToByteVector(key[1].GetPubKey());
+    tx = CTransaction(txTo);
+    vChecks = MakeChecks(vScripts, tx);
+    BOOST_CHECK(!RunChecks(vChecks));
+}
+
+BOOST_AUTO_TEST_CASE(scriptcheck_batch_multisig)
+{
+    CKey key[4];
+    for (int i = 0; i < 4; i++)
+        key[i].MakeNewKey(true);
+
+    // A 2-of-3 multisig next to a batched pay-to-pubkey input
+    std::vector<CScript> vScripts;
+    vScripts.push_back(CScript() << OP_2 << ToByteVector(key[0].GetPubKey()) << ToByteVector(key[1].GetPubKey()) << ToByteVector(key[2].GetPubKey()) << OP_3 << OP_CHECKMULTISIG);
+    vScripts.push_back(CScript() << ToByteVector(key[3].GetPubKey()) << OP_CHECKSIG);
+
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(vScripts.size());
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txFrom.vout[i].scriptPubKey = vScripts[i];
+    CMutableTransaction txTo;
+    txTo.vin.resize(vScripts.size());
+    txTo.vout.resize(1);
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+        txTo.vin[i].prevout = COutPoint(txFrom.GetHash(), i);
+    txTo.vin[1].scriptSig << Sign(key[3], vScripts[1], txTo, 1);
+
+    // Signed by the first and third keys: the second key is tried and skipped
+    txTo.vin[0].scriptSig = CScript() << OP_0 << Sign(key[0], vScripts[0], txTo, 0) << Sign(key[2], vScripts[0], txTo, 0);
+    CTransaction tx(txTo);
+    std::vector<CScriptCheck> vChecks = MakeChecks(vScripts, tx);
+    BOOST_CHECK(RunChecks(vChecks));
+
+    // Signed by a key outside the set
+    txTo.vin[0].scriptSig = CScript() << OP_0 << Sign(key[0], vScripts[0], txTo, 0) << Sign(key[3], vScripts[0], txTo, 0);
+    tx = CTransaction(txTo);
+    vChecks = MakeChecks(vScripts, tx);
+    BOOST_CHECK(!RunChecks(vChecks));
+
+    // Signatures in the wrong order
+    txTo.vin[0].scriptSig = CScript() << OP_0 << Sign(key[2], vScripts[0], txTo, 0) << Sign(key[0], vScripts[0], txTo, 0);
+    tx = CTransaction(txTo);
+    vChecks = MakeChecks(vScripts, tx);
+    BOOST_CHECK(!RunChecks(vChecks));
+}
+
+BOOST_AUTO_TEST_CASE(scriptcheck_batch_benchmark)
+{
+    // Compare one-by-one and batched verification of a block-like set of
+    // single input transactions, where the same keys are spent from repeatedly
+    CKey key[20];
+    for (int i = 0; i < 20; i++)
+        key[i].MakeNewKey(i % 2 == 0);
+
+    std::vector<CScript> vScripts;
+    std::vector<CTransaction> vtx;
+    for (int i = 0; i < 500; i++) {
+        std::vector<CScript> vScript(1, CScript() << ToByteVector(key[i % 20].GetPubKey()) << OP_CHECKSIG);
+        vScripts.push_back(vScript[0]);
+        vtx.push_back(SpendP2PK(vScript, std::vector<CKey>(1, key[i % 20])));
+    }
+
+    std::vector<CScriptCheck> vChecks;
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        std::vector<CScriptCheck> vTxChecks = MakeChecks(std::vector<CScript>(1, vScripts[i]), vtx[i]);
+        vChecks.push_back(CScriptCheck());
+        vTxChecks[0].swap(vChecks.back());
+    }
+    int64_t nStart = GetTimeMicros();
+    bool fOk = true;
+    for (CScriptCheck& check : vChecks)
+        fOk = fOk && check();
+    int64_t nSingle = GetTimeMicros() - nStart;
+    BOOST_CHECK(fOk);
+
+    nStart = GetTimeMicros();
+    BOOST_CHECK(RunChecks(vChecks));
+    int64_t nBatch = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("%u inputs: one by one %.2fms, batched %.2fms", vChecks.size(), nSingle * 0.001, nBatch * 0.001));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -162,4 +162,48 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     BOOST_CHECK_EQUAL(ss.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(swap_and_clear)
+{
+    CDataStream ss(SER_DISK, 0);
+    ss << (uint8_t)1 << (uint8_t)2 << (uint8_t)3;
+    uint8_t n;
+    ss >> n;
+
+    // Only the unread bytes are handed over, and the stream takes the other buffer
+    CSerializeData d;
+    d.reserve(100);
+    const char* pchReserved = d.data();
+    ss.SwapAndClear(d);
+    BOOST_CHECK_EQUAL(ss.size(), 0);
+    BOOST_CHECK_EQUAL(d.size(), 2);
+    BOOST_CHECK_EQUAL(d[0], 2);
+    BOOST_CHECK_EQUAL(d[1], 3);
+
+    ss << (uint8_t)4;
+    BOOST_CHECK(&ss[0] == pchReserved);
+    BOOST_CHECK_EQUAL(ss[0], 4);
+}
+
+BOOST_AUTO_TEST_CASE(span_reader)
+{
+    CDataStream ss(SER_DISK, 0);
+    ss << VARINT(100000) << std::string("span") << (uint32_t)0xdeadbeef;
+    std::vector<char> vch(ss.begin(), ss.end());
+
+    CSpanReader reader(&vch[0], &vch[0] + vch.size(), SER_DISK, 0);
+    int nVarInt;
+    std::string str;
+    uint32_t n;
+    reader >> VARINT(nVarInt) >> str >> n;
+    BOOST_CHECK_EQUAL(nVarInt, 100000);
+    BOOST_CHECK_EQUAL(str, "span");
+    BOOST_CHECK_EQUAL(n, 0xdeadbeef);
+    BOOST_CHECK(reader.empty());
+
+    // Reading past the end of the range throws rather than reading beyond it
+    CSpanReader truncated(&vch[0], &vch[0] + vch.size() - 1, SER_DISK, 0);
+    truncated >> VARINT(nVarInt) >> str;
+    BOOST_CHECK_THROW(truncated >> n, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
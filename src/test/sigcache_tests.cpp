@@ -0,0 +1,98 @@
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "random.h"
+#include "script/sigcache.h"
+#include "test_alqo.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(sigcache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(sigcache_set_get)
+{
+    CSignatureCache cache;
+    cache.Setup(1 << 20);
+
+    std::vector<uint256> entries;
+    for (int i = 0; i < 1000; i++) {
+        entries.push_back(GetRandHash());
+        cache.Set(entries.back());
+    }
+    for (unsigned int i = 0; i < entries.size(); i++)
+        BOOST_CHECK(cache.Get(entries[i], false));
+    BOOST_CHECK(!cache.Get(GetRandHash(), false));
+
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, entries.size());
+    BOOST_CHECK_EQUAL(stats.nHits, entries.size());
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+    BOOST_CHECK_EQUAL(stats.nInserts, entries.size());
+    BOOST_CHECK_EQUAL(stats.nEvictions, 0U);
+    BOOST_CHECK(stats.nBytes <= (1 << 20));
+
+    // Inserting an entry twice doesn't take a second slot
+    cache.Set(entries[0]);
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, entries.size());
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_erase)
+{
+    CSignatureCache cache;
+    cache.Setup(1 << 20);
+
+    uint256 entry = GetRandHash();
+    cache.Set(entry);
+    BOOST_CHECK(cache.Get(entry, true));
+    BOOST_CHECK(!cache.Get(entry, false));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_bounded)
+{
+    CSignatureCache cache;
+    cache.Setup(1 << 16);
+
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    size_t nSlots = stats.nSlots;
+    BOOST_CHECK(nSlots > 0);
+
+    // Keep inserting far beyond capacity; the table never grows and recent
+    // entries stay findable
+    std::vector<uint256> entries;
+    for (size_t i = 0; i < 8 * nSlots; i++) {
+        entries.push_back(GetRandHash());
+        cache.Set(entries.back());
+    }
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nSlots, nSlots);
+    BOOST_CHECK(stats.nEntries <= nSlots);
+
+    unsigned int nFound = 0;
+    for (size_t i = entries.size() - nSlots / 4; i < entries.size(); i++)
+        nFound += cache.Get(entries[i], false);
+    BOOST_CHECK(nFound > nSlots / 4 * 9 / 10);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_disabled)
+{
+    CSignatureCache cache;
+    BOOST_CHECK_EQUAL(cache.Setup(0), 0U);
+
+    uint256 entry = GetRandHash();
+    cache.Set(entry);
+    BOOST_CHECK(!cache.Get(entry, false));
+
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nSlots, 0U);
+    BOOST_CHECK_EQUAL(stats.nEntries, 0U);
+    BOOST_CHECK_EQUAL(stats.nInserts, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 
 #include "main.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "txdb.h"
 #include "guiinterface.h"
 #include "util.h"
@@ -32,6 +33,8 @@ BasicTestingSetup::BasicTestingSetup()
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::UNITTEST);
+        InitSignatureCache();
+        InitScriptExecutionCache();
 }
 BasicTestingSetup::~BasicTestingSetup()
 {
@@ -49,7 +52,8 @@ TestingSetup::TestingSetup()
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        pcoinsdbview->InitTally();
+        pcoinsTip = new CCoinsViewCache(pcoinsdbview, true);
         InitBlockIndex();
 #ifdef ENABLE_WALLET
         bool fFirstRun;
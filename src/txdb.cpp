@@ -6,58 +6,145 @@
 
 #include "txdb.h"
 
+#include "guiinterface.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
 #include "uint256.h"
+#include "util.h"
 
 #include <stdint.h>
 
 #include <boost/thread.hpp>
 
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
-{
-    if (coins.IsPruned())
-        batch.Erase(std::make_pair('c', hash));
-    else
-        batch.Write(std::make_pair('c', hash), coins);
-}
+static const char DB_COIN = 'C';
+static const char DB_COINS = 'c';
+static const char DB_BEST_BLOCK = 'B';
+static const char DB_COINS_TALLY = 'S';
 
-void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
+namespace
+{
+/** Key of a single unspent output in the chainstate database */
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(key);
+        READWRITE(outpoint->hash);
+        READWRITE(VARINT(outpoint->n));
+    }
+};
+
+/**
+ * Legacy per-transaction record of unspent outputs, as stored under DB_COINS
+ * before the chainstate was keyed by outpoint. Only used to read old
+ * databases in CCoinsViewDB::Upgrade().
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ *
+ * The nCode value consists of:
+ * - bit 1: IsCoinBase()
+ * - bit 2: IsCoinStake()
+ * - bit 4: vout[0] is not spent
+ * - bit 8: vout[1] is not spent
+ * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
+ *   - In case both bit 4 and bit 8 are unset, they encode N-1, as there must be at
+ *     least one non-spent output).
+ */
+class CCoins
 {
-    batch.Write('B', hash);
+public:
+    bool fCoinBase;
+    bool fCoinStake;
+    std::vector<CTxOut> vout;
+    int nHeight;
+
+    CCoins() : fCoinBase(false), fCoinStake(false), vout(0), nHeight(0) {}
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        fCoinStake = (nCode & 2) != 0;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 4) != 0;
+        vAvail[1] = (nCode & 8) != 0;
+        unsigned int nMaskCode = (nCode / 16) + ((nCode & 12) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), fTally(false)
 {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
+bool CCoinsViewDB::GetCoin(const COutPoint& outpoint, Coin& coin) const
 {
-    return db.Read(std::make_pair('c', txid), coins);
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256& txid) const
+bool CCoinsViewDB::HaveCoin(const COutPoint& outpoint) const
 {
-    return db.Exists(std::make_pair('c', txid));
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
 {
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256(0);
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsTally& tallyChanges)
 {
     CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
+            else
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
@@ -65,10 +152,155 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
         mapCoins.erase(itOld);
     }
     if (hashBlock != uint256(0))
-        BatchWriteHashBestChain(batch, hashBlock);
+        batch.Write(DB_BEST_BLOCK, hashBlock);
+
+    // The statistics go into the same batch as the coins, so they always
+    // describe the stored set. They are keyed to the best block to detect
+    // writes by versions that don't maintain them.
+    CCoinsTally tallyNew = tally;
+    if (fTally) {
+        tallyNew += tallyChanges;
+        batch.Write(DB_COINS_TALLY, std::make_pair(hashBlock != uint256(0) ? hashBlock : GetBestBlock(), tallyNew));
+    }
+
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    if (!db.WriteBatch(batch))
+        return false;
+    tally = tallyNew;
+    return true;
+}
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+bool CCoinsViewDB::GetTally(CCoinsTally& tallyOut) const
+{
+    if (!fTally)
+        return false;
+    tallyOut = tally;
+    return true;
+}
+
+bool CCoinsViewDB::InitTally()
+{
+    uint256 hashBestBlock = GetBestBlock();
+    std::pair<uint256, CCoinsTally> stored;
+    if (db.Read(DB_COINS_TALLY, stored) && stored.first == hashBestBlock) {
+        tally = stored.second;
+        fTally = true;
+        return true;
+    }
+
+    LogPrintf("Computing utxo-set statistics...\n");
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_COIN;
+    pcursor->Seek(ssKeySet.str());
+
+    CCoinsTally tallyNew;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return false;
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            COutPoint key;
+            CoinEntry entry(&key);
+            ssKey >> entry;
+            if (entry.key != DB_COIN)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            Coin coin;
+            ssValue >> coin;
+            tallyNew.AddCoin(key, coin);
+            pcursor->Next();
+        } catch (const std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+
+    if (!db.Write(DB_COINS_TALLY, std::make_pair(hashBestBlock, tallyNew)))
+        return error("%s: failed to write utxo-set statistics", __func__);
+    tally = tallyNew;
+    fTally = true;
+    LogPrintf("Computed statistics of %d unspent transaction outputs.\n", tally.nTransactionOutputs);
+    return true;
+}
+
+bool CCoinsViewDB::Upgrade()
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << std::make_pair(DB_COINS, uint256(0));
+    pcursor->Seek(ssKeySet.str());
+    if (!pcursor->Valid())
+        return true;
+
+    int64_t nCount = 0, nCountOutputs = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t nBatchSize = 1 << 24;
+    CLevelDBBatch batch;
+    size_t nBatchBytes = 0;
+    int nReportDone = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            break;
+        leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        char chType;
+        uint256 txhash;
+        try {
+            ssKey >> chType;
+            if (chType != DB_COINS)
+                break;
+            ssKey >> txhash;
+        } catch (const std::exception& e) {
+            break;
+        }
+        // Keys are sorted bytewise, so the first serialized byte of the txid gives the progress.
+        int nPercentageDone = (int)*txhash.begin() * 100 / 256;
+        if (nPercentageDone / 10 > nReportDone) {
+            nReportDone = nPercentageDone / 10;
+            uiInterface.ShowProgress(_("Upgrading UTXO database"), nPercentageDone);
+            LogPrintf("[%d%%]...", nPercentageDone);
+        }
+
+        CCoins old_coins;
+        try {
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> old_coins;
+        } catch (const std::exception& e) {
+            return error("%s: cannot parse CCoins record: %s", __func__, e.what());
+        }
+        COutPoint outpoint(txhash, 0);
+        for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+            if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase, old_coins.fCoinStake);
+                outpoint.n = i;
+                CoinEntry entry(&outpoint);
+                batch.Write(entry, newcoin);
+                nBatchBytes += 64;
+                nCountOutputs++;
+            }
+        }
+        batch.Erase(std::make_pair(DB_COINS, txhash));
+        nBatchBytes += 40;
+        nCount++;
+        if (nBatchBytes > nBatchSize) {
+            if (!db.WriteBatch(batch))
+                return error("%s: failed to write upgraded coin database batch", __func__);
+            batch = CLevelDBBatch();
+            nBatchBytes = 0;
+        }
+        pcursor->Next();
+    }
+    if (!db.WriteBatch(batch))
+        return error("%s: failed to write upgraded coin database batch", __func__);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s]. Converted %d transactions into %d outputs.\n", ShutdownRequested() ? "CANCELLED" : "DONE", nCount, nCountOutputs);
+    return !ShutdownRequested();
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
@@ -104,57 +336,66 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
+static void ApplyStats(CCoinsStats& stats, CHashWriter& ss, const uint256& hash, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    ss << hash;
+    ss << VARINT(outputs.begin()->second.nHeight * 4 + outputs.begin()->second.fCoinStake * 2 + outputs.begin()->second.fCoinBase);
+    stats.nTransactions++;
+    for (std::map<uint32_t, Coin>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        ss << VARINT(it->first + 1);
+        ss << it->second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += it->second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
 {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << DB_COIN;
+    pcursor->Seek(ssKeySet.str());
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            COutPoint key;
+            CoinEntry entry(&key);
+            ssKey >> entry;
+            if (entry.key != DB_COIN)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            Coin coin;
+            ssValue >> coin;
+            if (!outputs.empty() && key.hash != prevkey) {
+                ApplyStats(stats, ss, prevkey, outputs);
+                outputs.clear();
             }
+            prevkey = key.hash;
+            outputs[key.n] = std::move(coin);
+            stats.nSerializedSize += slKey.size() + slValue.size();
             pcursor->Next();
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    if (!outputs.empty())
+        ApplyStats(stats, ss, prevkey, outputs);
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
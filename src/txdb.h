@@ -15,7 +15,6 @@
 #include <utility>
 #include <vector>
 
-class CCoins;
 class uint256;
 
 //! -dbcache default (MiB)
@@ -30,15 +29,24 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    //! Statistics of the coins in the database, valid if fTally is set
+    CCoinsTally tally;
+    bool fTally;
 
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256& txid, CCoins& coins) const;
-    bool HaveCoins(const uint256& txid) const;
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const;
+    bool HaveCoin(const COutPoint& outpoint) const;
     uint256 GetBestBlock() const;
-    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsTally& tally);
     bool GetStats(CCoinsStats& stats) const;
+    bool GetTally(CCoinsTally& tally) const;
+
+    //! Attempt to update from an older database format. Returns false on error.
+    bool Upgrade();
+    //! Load the coin statistics, or compute them with a full scan if they are missing or stale. Returns false on error.
+    bool InitTally();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -0,0 +1,219 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txorphanage.h"
+
+#include "util.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <algorithm>
+
+CTxOrphanage::CTxOrphanage() : nTotalBytes(0), nNextSweep(0), nExpired(0), nEvicted(0) {}
+
+bool CTxOrphanage::AddTx(const CTransaction& tx, NodeId peer)
+{
+    LOCK(cs);
+
+    const uint256& hash = tx.GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    if (sz > MAX_ORPHAN_TX_SIZE) {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    CPeerOrphans& peerOrphans = mapPeers[peer];
+    COrphanTx& orphan = mapOrphans[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nSize = sz;
+    orphan.itPeer = peerOrphans.lHashes.insert(peerOrphans.lHashes.end(), hash);
+    peerOrphans.nBytes += sz;
+    nTotalBytes += sz;
+    for (const CTxIn& txin : tx.vin)
+        mapOrphansByPrev[txin.prevout].insert(hash);
+
+    LogPrint("mempool", "stored orphan tx %s from peer=%d (mapsz %u outsz %u)\n", hash.ToString(), peer,
+        mapOrphans.size(), mapOrphansByPrev.size());
+    return true;
+}
+
+bool CTxOrphanage::EraseTxInternal(const uint256& hash)
+{
+    std::map<uint256, COrphanTx>::iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return false;
+    const COrphanTx& orphan = it->second;
+    for (const CTxIn& txin : orphan.tx.vin) {
+        boost::unordered_map<COutPoint, std::set<uint256>, SaltedOutpointHasher>::iterator itPrev = mapOrphansByPrev.find(txin.prevout);
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.find(orphan.fromPeer);
+    assert(itPeer != mapPeers.end());
+    itPeer->second.lHashes.erase(orphan.itPeer);
+    itPeer->second.nBytes -= orphan.nSize;
+    if (itPeer->second.lHashes.empty())
+        mapPeers.erase(itPeer);
+    nTotalBytes -= orphan.nSize;
+
+    mapOrphans.erase(it);
+    return true;
+}
+
+bool CTxOrphanage::EraseTx(const uint256& hash)
+{
+    LOCK(cs);
+    return EraseTxInternal(hash);
+}
+
+unsigned int CTxOrphanage::EraseForPeer(NodeId peer)
+{
+    LOCK(cs);
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.find(peer);
+    if (itPeer == mapPeers.end())
+        return 0;
+    // Copy, erasing the last orphan removes the peer's entry
+    std::list<uint256> lHashes = itPeer->second.lHashes;
+    for (const uint256& hash : lHashes)
+        EraseTxInternal(hash);
+    LogPrint("mempool", "Erased %u orphan tx from peer %d\n", lHashes.size(), peer);
+    return lHashes.size();
+}
+
+unsigned int CTxOrphanage::ExpireInternal(int64_t nNow)
+{
+    if (nNextSweep > nNow)
+        return 0;
+
+    // Sweep out expired orphan pool entries
+    unsigned int nErased = 0;
+    int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+    std::map<uint256, COrphanTx>::iterator iter = mapOrphans.begin();
+    while (iter != mapOrphans.end()) {
+        std::map<uint256, COrphanTx>::iterator maybeErase = iter++;
+        if (maybeErase->second.nTimeExpire <= nNow) {
+            nErased += EraseTxInternal(maybeErase->first);
+        } else {
+            nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+        }
+    }
+    // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+    nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+    if (nErased > 0)
+        LogPrint("mempool", "Erased %u orphan tx due to expiration\n", nErased);
+    nExpired += nErased;
+    return nErased;
+}
+
+unsigned int CTxOrphanage::LimitOrphans(unsigned int nMaxOrphans, unsigned int nMaxPerPeer)
+{
+    LOCK(cs);
+
+    ExpireInternal(GetTime());
+
+    // A peer over its quota only evicts its own orphans, oldest first
+    unsigned int nErased = 0;
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.begin();
+    while (itPeer != mapPeers.end()) {
+        std::map<NodeId, CPeerOrphans>::iterator itCurrent = itPeer++;
+        size_t nExcess = itCurrent->second.lHashes.size() > nMaxPerPeer ? itCurrent->second.lHashes.size() - nMaxPerPeer : 0;
+        // The entry goes away with its last orphan
+        while (nExcess-- > 0)
+            nErased += EraseTxInternal(itCurrent->second.lHashes.front());
+    }
+
+    // Then the pool as a whole: whoever holds the most orphans pays
+    while (mapOrphans.size() > nMaxOrphans) {
+        std::map<NodeId, CPeerOrphans>::iterator itLargest = mapPeers.begin();
+        for (itPeer = mapPeers.begin(); itPeer != mapPeers.end(); ++itPeer) {
+            if (itPeer->second.lHashes.size() > itLargest->second.lHashes.size())
+                itLargest = itPeer;
+        }
+        nErased += EraseTxInternal(itLargest->second.lHashes.front());
+    }
+    nEvicted += nErased;
+    return nErased;
+}
+
+void CTxOrphanage::GetChildren(const CTransaction& tx, std::vector<uint256>& vChildren) const
+{
+    LOCK(cs);
+    const uint256& hash = tx.GetHash();
+    std::set<uint256> setChildren;
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        boost::unordered_map<COutPoint, std::set<uint256>, SaltedOutpointHasher>::const_iterator itByPrev = mapOrphansByPrev.find(COutPoint(hash, i));
+        if (itByPrev == mapOrphansByPrev.end())
+            continue;
+        // An orphan spending several outputs of tx is listed once
+        for (const uint256& hashChild : itByPrev->second) {
+            if (setChildren.insert(hashChild).second)
+                vChildren.push_back(hashChild);
+        }
+    }
+}
+
+bool CTxOrphanage::HaveTx(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphans.count(hash) != 0;
+}
+
+bool CTxOrphanage::GetTx(const uint256& hash, CTransaction& tx, NodeId& peer) const
+{
+    LOCK(cs);
+    std::map<uint256, COrphanTx>::const_iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return false;
+    tx = it->second.tx;
+    peer = it->second.fromPeer;
+    return true;
+}
+
+size_t CTxOrphanage::Size() const
+{
+    LOCK(cs);
+    return mapOrphans.size();
+}
+
+void CTxOrphanage::GetStats(COrphanageStats& stats) const
+{
+    LOCK(cs);
+    stats.nCount = mapOrphans.size();
+    stats.nBytes = nTotalBytes;
+    stats.nExpired = nExpired;
+    stats.nEvicted = nEvicted;
+    stats.vPeers.clear();
+    for (const std::pair<const NodeId, CPeerOrphans>& item : mapPeers) {
+        COrphanPeerStats peerStats;
+        peerStats.peer = item.first;
+        peerStats.nCount = item.second.lHashes.size();
+        peerStats.nBytes = item.second.nBytes;
+        stats.vPeers.push_back(peerStats);
+    }
+}
+
+void CTxOrphanage::Clear()
+{
+    LOCK(cs);
+    mapOrphans.clear();
+    mapOrphansByPrev.clear();
+    mapPeers.clear();
+    nTotalBytes = 0;
+    nNextSweep = 0;
+}
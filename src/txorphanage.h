@@ -0,0 +1,108 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Copyright (c) 2019 The ALQO developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ALQO_TXORPHANAGE_H
+#define ALQO_TXORPHANAGE_H
+
+#include "coins.h"
+#include "net.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+/** Orphans larger than this are not kept, they are expected to be rebroadcast once their parents confirm */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Default for -maxorphantxperpeer, maximum number of orphan transactions kept for a single peer */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_PER_PEER = 25;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+
+/** Orphan counts of one peer, as reported by CTxOrphanage::GetStats */
+struct COrphanPeerStats {
+    NodeId peer;
+    unsigned int nCount;
+    size_t nBytes;
+};
+
+struct COrphanageStats {
+    unsigned int nCount;
+    size_t nBytes;
+    uint64_t nExpired; //! Orphans removed because they were not resolved in time, since startup
+    uint64_t nEvicted; //! Orphans removed to stay within the limits, since startup
+    std::vector<COrphanPeerStats> vPeers;
+};
+
+/** \class CTxOrphanage
+ * Transactions whose inputs we can't find yet, kept until their parents
+ * arrive. Every orphan is charged to the peer that sent it: a peer holding
+ * more than its quota loses its own oldest orphans first, and when the pool
+ * as a whole is full the peer holding the most orphans pays. Orphans expire
+ * after ORPHAN_TX_EXPIRE_TIME. An index by spent outpoint finds the orphans
+ * a new transaction resolves without scanning the pool.
+ *
+ * All methods are thread-safe.
+ */
+class CTxOrphanage
+{
+private:
+    struct COrphanTx {
+        CTransaction tx;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+        size_t nSize;
+        std::list<uint256>::iterator itPeer; //! Position in the sending peer's arrival order
+    };
+
+    struct CPeerOrphans {
+        std::list<uint256> lHashes; //! Oldest first
+        size_t nBytes;
+
+        CPeerOrphans() : nBytes(0) {}
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, COrphanTx> mapOrphans;
+    boost::unordered_map<COutPoint, std::set<uint256>, SaltedOutpointHasher> mapOrphansByPrev;
+    std::map<NodeId, CPeerOrphans> mapPeers;
+    size_t nTotalBytes;
+    int64_t nNextSweep;
+    uint64_t nExpired;
+    uint64_t nEvicted;
+
+    bool EraseTxInternal(const uint256& hash);
+    unsigned int ExpireInternal(int64_t nNow);
+
+public:
+    CTxOrphanage();
+
+    /** Keep tx until its parents arrive. Fails if it is known or too large. */
+    bool AddTx(const CTransaction& tx, NodeId peer);
+    bool HaveTx(const uint256& hash) const;
+    /** Look up an orphan and the peer that sent it */
+    bool GetTx(const uint256& hash, CTransaction& tx, NodeId& peer) const;
+    bool EraseTx(const uint256& hash);
+    /** Drop the orphans of a peer that disconnected */
+    unsigned int EraseForPeer(NodeId peer);
+    /** Drop expired orphans, trim every peer to nMaxPerPeer orphans and then the
+     *  whole pool to nMaxOrphans. Returns the number of orphans evicted by the limits. */
+    unsigned int LimitOrphans(unsigned int nMaxOrphans, unsigned int nMaxPerPeer);
+    /** Append the hashes of the orphans spending an output of tx to vChildren, each once */
+    void GetChildren(const CTransaction& tx, std::vector<uint256>& vChildren) const;
+
+    size_t Size() const;
+    void GetStats(COrphanageStats& stats) const;
+    void Clear();
+};
+
+#endif // ALQO_TXORPHANAGE_H
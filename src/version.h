@@ -11,7 +11,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70919;
+static const int PROTOCOL_VERSION = 70920;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -35,5 +35,8 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! short-id-based block download (sendcmpct, cmpctblock, getblocktxn, blocktxn) starts with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 70920;
+
 
 #endif // ALQO_VERSION_H
@@ -2164,32 +2164,6 @@ bool CWallet::CreateTransaction(CScript scriptPubKey, const CAmount& nValue, CWa
     return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet, strFailReason, coinControl, coin_type, useIX, nFeePay);
 }
 
-bool CWallet::CreateCoinStakeKernel(CScript& kernelScript, const CScript& stakeScript, unsigned int nBits, const CBlock& blockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int& nTimeTx, bool fPrintProofOfStake) const
-{
-    unsigned int nTryTime = 0;
-    uint256 hashProofOfStake = 0;
-    if (blockFrom.GetBlockTime() + Params().COINSTAKE_MIN_AGE() + nHashDrift > nTimeTx)
-        return false;
-
-    for (unsigned int i = 0; i < nHashDrift; ++i) {
-        nTryTime = nTimeTx - i;
-        if (CheckStakeKernelHash(nBits, blockFrom, txPrev, prevout, nTryTime, hashProofOfStake, true, true)) {
-            //Double check that this will pass time requirements
-            if (nTryTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStakeKernel() : kernel found, but it is too far in the past \n");
-                continue;
-            }
-            // Found a kernel
-            LogPrintf("CreateCoinStakeKernel : kernel found\n");
-            kernelScript.clear();
-            kernelScript = stakeScript;
-            nTimeTx = nTryTime;
-            return true;
-        }
-    }
-    return false;
-}
-
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, unsigned int& nTxNewTime)
 {
     txNew.vin.clear();
@@ -2208,105 +2182,108 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (nBalance <= nReserveBalance)
         return false;
 
-    static std::set<std::pair<const CWalletTx*, unsigned int> > setStakeCoins;
+    // The outputs in vStakeCoins are searched in the same order by stakeSearch
+    static std::vector<std::pair<const CWalletTx*, unsigned int> > vStakeCoins;
     static int nLastStakeSetUpdate = 0;
     if (GetTime() - nLastStakeSetUpdate > nStakeSetUpdateTime) {
-        setStakeCoins.clear();
+        LOCK2(cs_main, cs_wallet);
+        std::set<std::pair<const CWalletTx*, unsigned int> > setStakeCoins;
         if (!SelectStakeCoins(setStakeCoins, nBalance - nReserveBalance))
             return false;
+        vStakeCoins.assign(setStakeCoins.begin(), setStakeCoins.end());
+
+        std::vector<CStakeKernelSearch::Coin> vCoins;
+        vCoins.reserve(vStakeCoins.size());
+        for (const PAIRTYPE(const CWalletTx*, unsigned int) & pcoin : vStakeCoins)
+            vCoins.push_back(CStakeKernelSearch::Coin(COutPoint(pcoin.first->GetHash(), pcoin.second), pcoin.first->vout[pcoin.second].nValue, pcoin.first->hashBlock));
+        stakeSearch.SetCoins(vCoins);
         nLastStakeSetUpdate = GetTime();
     }
 
-    // Sleep and return if no coins
-    if (setStakeCoins.empty()) {
-        MilliSleep(10000);
+    if (vStakeCoins.empty())
         return false;
-    }
 
     std::vector<const CWalletTx*> vwtxPrev;
     CAmount nCredit = 0;
     CScript scriptPubKeyKernel;
 
-    //prevent staking a time that won't be accepted
-    if (GetAdjustedTime() <= chainActive.Tip()->nTime)
-        MilliSleep(10000);
+    int64_t nTimePast;
+    {
+        LOCK(cs_main);
+        //prevent staking a time that won't be accepted, the stake minter waits for a later one
+        if (GetAdjustedTime() <= chainActive.Tip()->nTime)
+            return false;
+
+        stakeSearch.Update();
+        nTimePast = chainActive.Tip()->GetMedianTimePast();
+        mapHashedBlocks.clear();
+        mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime();
+    }
 
-    bool fKernelFound = false;
-    for (PAIRTYPE(const CWalletTx*, unsigned int) pcoin : setStakeCoins) {
-        //make sure that enough time has elapsed between
-        CBlockIndex* pindex = NULL;
+    size_t nKernel = 0;
+    uint256 hashProofOfStake = 0;
+    bool fKernelFound = stakeSearch.Search(nBits, GetAdjustedTime(), nHashDrift, nTimePast, nKernel, nTxNewTime, hashProofOfStake);
+    const PAIRTYPE(const CWalletTx*, unsigned int) pcoin = fKernelFound ? vStakeCoins[nKernel] : std::make_pair((const CWalletTx*)NULL, 0u);
+    if (fKernelFound) {
+        // Confirm the kernel the way block validation will see it
+        LOCK(cs_main);
         BlockMap::iterator it = mapBlockIndex.find(pcoin.first->hashBlock);
-        if (it != mapBlockIndex.end())
-            pindex = it->second;
-        else {
-            if (fDebug)
-                LogPrintf("CreateCoinStake() failed to find block index \n");
-            continue;
-        }
+        uint256 hashCheck = 0;
+        if (it == mapBlockIndex.end() ||
+            !CheckStakeKernelHash(nBits, it->second->GetBlockHeader(), *pcoin.first, COutPoint(pcoin.first->GetHash(), pcoin.second), nTxNewTime, hashCheck, true, true) ||
+            hashCheck != hashProofOfStake) {
+            LogPrintf("CreateCoinStake : kernel %s from the search failed to verify\n", hashProofOfStake.ToString());
+            fKernelFound = false;
+        } else
+            LogPrintf("CreateCoinStake : kernel found\n");
+    }
 
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
-        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-        nTxNewTime = GetAdjustedTime();
-        CScript kernelScript;
-        auto stakeScript = pcoin.first->vout[pcoin.second].scriptPubKey;
-        fKernelFound = CreateCoinStakeKernel(kernelScript, stakeScript, nBits, block, *pcoin.first, prevoutStake, nTxNewTime, false);
-        if (fKernelFound) {
-            //Double check that this will pass time requirements
-            if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
-                LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
-                continue;
-            }
+    if (fKernelFound) {
+        // Determinine kernel type
+        std::vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
+            LogPrintf("CreateCoinStake : failed to parse kernel type=%d\n", whichType);
+            return false;
+        }
 
-            // Determinine kernel type
-            std::vector<valtype> vSolutions;
-            txnouttype whichType;
-            CScript scriptPubKeyOut;
-            scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-            if (!Solver(scriptPubKeyKernel, whichType, vSolutions)) {
-                LogPrintf("CreateCoinStake : failed to parse kernel type=%d\n", whichType);
-                break;
-            }
+        LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH) {
+            LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            return false;
+        }
 
-            LogPrintf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH) {
-                LogPrintf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                break;
+        // TX_PUBKEYHASH or TX_PUBKEY found
+        if (whichType == TX_PUBKEYHASH) {
+            CKey key;
+            if (!keystore.GetKey(CKeyID(uint160(vSolutions[0])), key)) {
+                LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                return false;
             }
 
-            // TX_PUBKEYHASH or TX_PUBKEY found
-            if (whichType == TX_PUBKEYHASH) {
-                CKey key;
-                if (!keystore.GetKey(CKeyID(uint160(vSolutions[0])), key)) {
-                    LogPrintf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                    break;
-                }
-
-                scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-            } else
-                scriptPubKeyOut = scriptPubKeyKernel;
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        } else
+            scriptPubKeyOut = scriptPubKeyKernel;
 
-            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-            nCredit += pcoin.first->vout[pcoin.second].nValue;
-            vwtxPrev.push_back(pcoin.first);
-            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-            const CBlockIndex* pIndex0 = chainActive.Tip();
-            uint64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetBlockValue(pIndex0->nHeight);
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        const CBlockIndex* pIndex0 = chainActive.Tip();
+        uint64_t nTotalSize = pcoin.first->vout[pcoin.second].nValue + GetBlockValue(pIndex0->nHeight);
 
-            //presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
-            if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        //presstab HyperStake - if MultiSend is set to send in coinstake we will add our outputs here (values asigned further down)
+        if (nTotalSize / 2 > nStakeSplitThreshold * COIN)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
 
-            if (fDebug && GetBoolArg("-printcoinstake", false))
-                LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
-            fKernelFound = true;
-            break;
-        }
+        if (fDebug && GetBoolArg("-printcoinstake", false))
+            LogPrintf("CreateCoinStake : added kernel type=%d\n", whichType);
     }
 
     if (!fKernelFound) {
-        LogPrintf("Failed to find coinstake kernel\n");
-        MilliSleep(5000);
+        LogPrint("staking", "Failed to find coinstake kernel\n");
         return false;
     }
 
@@ -2435,7 +2412,7 @@ CAmount CWallet::GetMinimumFee(unsigned int nTxBytes, unsigned int nConfirmTarge
         nFeeNeeded = payTxFee.GetFeePerK();
     // User didn't set: use -txconfirmtarget to estimate...
     if (nFeeNeeded == 0)
-        nFeeNeeded = pool.estimateFee(nConfirmTarget).GetFee(nTxBytes);
+        nFeeNeeded = pool.estimateSmartFee(nConfirmTarget).GetFee(nTxBytes);
     // ... unless we don't have enough mempool data, in which case fall
     // back to a hard-coded fee
     if (nFeeNeeded == 0)
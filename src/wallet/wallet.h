@@ -209,9 +209,9 @@ public:
 
     // Stake Settings
     unsigned int nHashDrift;
-    unsigned int nHashInterval;
     uint64_t nStakeSplitThreshold;
     int nStakeSetUpdateTime;
+    CStakeKernelSearch stakeSearch;
 
     //MultiSend
     std::vector<std::pair<std::string, int> > vMultiSend;
@@ -261,7 +261,6 @@ public:
         // Stake Settings
         nHashDrift = 45;
         nStakeSplitThreshold = 2000;
-        nHashInterval = 22;
         nStakeSetUpdateTime = 300; // 5 minutes
 
         //MultiSend
@@ -433,7 +432,6 @@ public:
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, std::string strCommand = "tx");
     bool AddAccountingEntry(const CAccountingEntry&, CWalletDB & pwalletdb);
     int GenerateObfuscationOutputs(int nTotalValue, std::vector<CTxOut>& vout);
-    bool CreateCoinStakeKernel(CScript &kernelScript, const CScript &stakeScript, unsigned int nBits, const CBlock &blockFrom, const CTransaction &txPrev, const COutPoint &prevout, unsigned int &nTimeTx, bool fPrintProofOfStake) const;
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction& txNew, unsigned int& nTxNewTime);
     bool MultiSend();
     void AutoCombineDust();